@@ -0,0 +1,358 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+/* Pages are reserved ARENA_CHUNK pages at a time. Runs of up to ARENA_CLASSES
+pages are recycled through one free list per size; bigger runs are mapped and
+unmapped directly, as they are too rare to be worth keeping around. Bigger runs
+of the region can't be unmapped though, and are kept whole on their own list */
+#define ARENA_CHUNK 512
+#define ARENA_CLASSES 64
+
+#define ARENA_LOW 0
+#define ARENA_HIGH (16 * ARENA_CHUNK)
+
+struct arena_run {
+	void *addr;
+	size_t npages;
+	struct arena_run *next;
+};
+
+static struct arena_run *free_runs[ARENA_CLASSES + 1];
+
+/* Free runs of the region bigger than ARENA_CLASSES pages, sorted by address
+so that adjacent runs merge back together */
+static struct arena_run *big_runs = NULL;
+
+/* Current chunk, carved from its start */
+static char *chunk_next = NULL;
+static size_t chunk_left = 0;
+
+/* Region reserved by arena_reserve(), and the part of it not carved yet. Its
+pages are mapped with the same flags as the region, so that the kernel merges
+them back into it */
+#define REGION_FLAGS (MAP_ANON|MAP_PRIVATE|MAP_NORESERVE)
+
+static char *region_start = NULL;
+static char *region_end = NULL;
+static char *region_next = NULL;
+
+/* The number of pages in use is derived from the other two */
+static size_t reserved_pages = 0;
+static size_t free_pages = 0;
+static size_t low_mark = ARENA_LOW;
+static size_t high_mark = ARENA_HIGH;
+
+static void *map_run(size_t npages)
+{
+	void *addr = mmap(NULL, npages * ARENA_PAGE_SIZE, PROT_NONE,
+		MAP_ANON|MAP_PRIVATE, -1, 0);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* Adds a run of free pages to its free list */
+static int push_run(void *addr, size_t npages)
+{
+	struct arena_run *run = malloc(sizeof(struct arena_run));
+
+	if (run == NULL) {
+		return -1;
+	}
+
+	run->addr = addr;
+	run->npages = npages;
+	run->next = free_runs[npages];
+	free_runs[npages] = run;
+	return 0;
+}
+
+static int in_region(void *addr)
+{
+	return (char *) addr >= region_start && (char *) addr < region_end;
+}
+
+/* Adds a run of free pages of the region to the big runs, merging it with its
+neighbours */
+static int push_big_run(char *addr, size_t npages)
+{
+	struct arena_run *prev = NULL;
+	struct arena_run *next = big_runs;
+
+	while (next != NULL && (char *) next->addr < addr) {
+		prev = next;
+		next = next->next;
+	}
+
+	char *end = addr + npages * ARENA_PAGE_SIZE;
+	if (prev != NULL && (char *) prev->addr + prev->npages *
+		ARENA_PAGE_SIZE == addr) {
+		prev->npages += npages;
+		if (next != NULL && (char *) next->addr == end) {
+			prev->npages += next->npages;
+			prev->next = next->next;
+			free(next);
+		}
+		return 0;
+	}
+	if (next != NULL && (char *) next->addr == end) {
+		next->addr = addr;
+		next->npages += npages;
+		return 0;
+	}
+
+	struct arena_run *run = malloc(sizeof(struct arena_run));
+	if (run == NULL) {
+		return -1;
+	}
+
+	run->addr = addr;
+	run->npages = npages;
+	run->next = next;
+	if (prev != NULL) {
+		prev->next = run;
+	} else {
+		big_runs = run;
+	}
+	return 0;
+}
+
+/* Takes npages pages from the first big run holding enough of them. What is
+left of a run too small to stay a big run moves to its free list */
+static void *pop_big_run(size_t npages)
+{
+	for (struct arena_run **link = &big_runs; *link != NULL;
+		link = &(*link)->next) {
+		struct arena_run *run = *link;
+
+		if (run->npages < npages) {
+			continue;
+		}
+
+		void *addr = run->addr;
+		run->addr = (char *) run->addr + npages * ARENA_PAGE_SIZE;
+		run->npages -= npages;
+		if (run->npages <= ARENA_CLASSES) {
+			*link = run->next;
+			if (run->npages > 0) {
+				run->next = free_runs[run->npages];
+				free_runs[run->npages] = run;
+			} else {
+				free(run);
+			}
+		}
+		return addr;
+	}
+
+	return NULL;
+}
+
+int arena_reserve(size_t npages)
+{
+	if (region_start != NULL || npages == 0) {
+		return -1;
+	}
+
+	void *addr = mmap(NULL, npages * ARENA_PAGE_SIZE, PROT_NONE,
+		REGION_FLAGS, -1, 0);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+
+	region_start = addr;
+	region_next = addr;
+	region_end = region_start + npages * ARENA_PAGE_SIZE;
+	return 0;
+}
+
+/* Keeps what is left of the current chunk for later. A chunk started ahead of
+time may leave more pages than the free lists hold, which only the region
+keeps */
+static int keep_chunk_left(void)
+{
+	if (chunk_left <= ARENA_CLASSES) {
+		return push_run(chunk_next, chunk_left);
+	}
+
+	return in_region(chunk_next) ? push_big_run(chunk_next, chunk_left) :
+		-1;
+}
+
+/* Starts a new chunk, keeping what is left of the current one for later */
+static int new_chunk(void)
+{
+	/* The pages of a big run are counted already */
+	char *chunk = pop_big_run(ARENA_CHUNK);
+	int reused = chunk != NULL;
+
+	if (!reused && (size_t) (region_end - region_next) >=
+		ARENA_CHUNK * ARENA_PAGE_SIZE) {
+		chunk = region_next;
+		region_next += ARENA_CHUNK * ARENA_PAGE_SIZE;
+	} else if (!reused) {
+		chunk = map_run(ARENA_CHUNK);
+	}
+
+	if (chunk == NULL) {
+		return -1;
+	}
+
+	if (chunk_left > 0 && keep_chunk_left() < 0) {
+		if (!in_region(chunk_next)) {
+			munmap(chunk_next, chunk_left * ARENA_PAGE_SIZE);
+		}
+		reserved_pages -= chunk_left;
+		free_pages -= chunk_left;
+	}
+
+	chunk_next = chunk;
+	chunk_left = ARENA_CHUNK;
+	if (!reused) {
+		reserved_pages += ARENA_CHUNK;
+		free_pages += ARENA_CHUNK;
+	}
+	return 0;
+}
+
+void *arena_alloc(size_t npages)
+{
+	void *addr;
+
+	if (npages == 0) {
+		return NULL;
+	}
+
+	/* The region is only carved further once no big run fits */
+	if (npages > ARENA_CLASSES) {
+		addr = pop_big_run(npages);
+		if (addr != NULL) {
+			free_pages -= npages;
+			return addr;
+		}
+	}
+	if (npages > ARENA_CLASSES &&
+		(size_t) (region_end - region_next) >= npages * ARENA_PAGE_SIZE) {
+		addr = region_next;
+		region_next += npages * ARENA_PAGE_SIZE;
+		reserved_pages += npages;
+		return addr;
+	}
+	if (npages > ARENA_CLASSES) {
+		addr = map_run(npages);
+		if (addr != NULL) {
+			reserved_pages += npages;
+		}
+		return addr;
+	}
+
+	if (free_runs[npages] != NULL) {
+		struct arena_run *run = free_runs[npages];
+
+		free_runs[npages] = run->next;
+		addr = run->addr;
+		free(run);
+	} else {
+		if (chunk_left < npages && new_chunk() < 0) {
+			return NULL;
+		}
+		addr = chunk_next;
+		chunk_next += npages * ARENA_PAGE_SIZE;
+		chunk_left -= npages;
+	}
+	free_pages -= npages;
+
+	/* Grows ahead of time rather than when pages are needed */
+	if (free_pages < low_mark) {
+		new_chunk();
+	}
+
+	return addr;
+}
+
+int arena_refill(void *addr, size_t npages)
+{
+	int flags = in_region(addr) ? REGION_FLAGS : MAP_ANON|MAP_PRIVATE;
+
+	return mmap(addr, npages * ARENA_PAGE_SIZE, PROT_NONE, flags|MAP_FIXED,
+		-1, 0) == MAP_FAILED ? -1 : 0;
+}
+
+/* Keeps pages of the region whatever their number, the runs too big for the
+free lists being kept whole */
+static void free_region_run(char *addr, size_t npages)
+{
+	int retval = npages > ARENA_CLASSES ? push_big_run(addr, npages) :
+		push_run(addr, npages);
+
+	/* Without a run to keep them in, the pages are lost to the region */
+	if (retval < 0) {
+		reserved_pages -= npages;
+	} else {
+		free_pages += npages;
+	}
+}
+
+void arena_free(void *addr, size_t npages)
+{
+	if (npages == 0) {
+		return;
+	}
+
+	/* Once a region is reserved, pages are mapped anew as they may have
+	been moved away */
+	if (region_start != NULL && arena_refill(addr, npages) < 0) {
+		reserved_pages -= npages;
+		return;
+	}
+	if (in_region(addr)) {
+		free_region_run(addr, npages);
+		return;
+	}
+
+	/* The kernel drops the content of the pages, and hands out zeroed
+	pages the next time they are touched */
+	if (npages <= ARENA_CLASSES && free_pages + npages <= high_mark &&
+		madvise(addr, npages * ARENA_PAGE_SIZE, MADV_DONTNEED) == 0 &&
+		push_run(addr, npages) == 0) {
+		free_pages += npages;
+		return;
+	}
+
+	munmap(addr, npages * ARENA_PAGE_SIZE);
+	reserved_pages -= npages;
+}
+
+void arena_adopt(size_t npages)
+{
+	reserved_pages += npages;
+}
+
+void arena_forget(size_t npages)
+{
+	reserved_pages -= npages;
+}
+
+int arena_set_watermarks(size_t low, size_t high)
+{
+	if (low > high) {
+		return -1;
+	}
+
+	low_mark = low;
+	high_mark = high;
+	while (free_pages < low_mark && new_chunk() == 0) {
+	}
+
+	return 0;
+}
+
+void arena_get_stats(struct arena_stats *stats)
+{
+	stats->reserved = reserved_pages;
+	stats->used = reserved_pages - free_pages;
+	stats->free = free_pages;
+	stats->low = low_mark;
+	stats->high = high_mark;
+}
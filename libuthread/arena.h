@@ -0,0 +1,127 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * The page arena hands out runs of PROT_NONE anonymous pages carved from large
+ * chunks, and recycles the runs it is given back instead of unmapping them.
+ * Recycled pages are zeroed by the kernel (MADV_DONTNEED), so they read as
+ * zeros just like freshly mapped ones.
+ *
+ * The arena is not synchronized: callers must make sure only one thread uses
+ * it at a time.
+ *
+ * The chunks can be carved from a single region reserved up front, see
+ * arena_reserve(), so that the pages handed out make up a single mapping of the
+ * kernel as long as they share the same protection.
+ */
+
+/*
+ * Size of the pages handed out by the arena, in bytes
+ */
+#define ARENA_PAGE_SIZE 4096
+
+/*
+ * struct arena_stats - Occupancy of the arena, in pages
+ * @reserved: Pages currently mapped by the arena
+ * @used: Pages currently handed out
+ * @free: Pages ready to be handed out again, including the unused end of the
+ * current chunk
+ * @low: Low watermark
+ * @high: High watermark
+ */
+struct arena_stats {
+	size_t reserved;
+	size_t used;
+	size_t free;
+	size_t low;
+	size_t high;
+};
+
+/*
+ * arena_reserve - Reserve a region
+ * @npages: Number of pages of the region
+ *
+ * Reserve a region of @npages PROT_NONE pages, without committing any memory,
+ * from which chunks are carved from then on. Chunks are mapped on their own
+ * again once the region is used up. From then on, pages given back with
+ * arena_free() are mapped anew over whatever is left there, which drops their
+ * content and fills the holes left by pages the caller moved away. Pages of
+ * the region are never unmapped, but kept for reuse whatever the high
+ * watermark, runs of any size being handed out again before the region is
+ * carved any further.
+ *
+ * Return: -1 if a region is already reserved, or in case of failure. 0 if the
+ * region was successfully reserved.
+ */
+int arena_reserve(size_t npages);
+
+/*
+ * arena_alloc - Allocate pages
+ * @npages: Number of contiguous pages to allocate
+ *
+ * Return: Address of the first page, or NULL in case of failure.
+ */
+void *arena_alloc(size_t npages);
+
+/*
+ * arena_free - Free pages
+ * @addr: Address of the first page
+ * @npages: Number of pages
+ *
+ * Give back @npages pages starting at @addr, which must be PROT_NONE anonymous
+ * private pages, allocated by arena_alloc() or not. The pages are kept for
+ * reuse unless the arena already holds more free pages than its high
+ * watermark, in which case they are unmapped. Once a region is reserved, the
+ * pages can have any protection, or not be mapped at all.
+ */
+void arena_free(void *addr, size_t npages);
+
+/*
+ * arena_refill - Map pages anew
+ * @addr: Address of the first page
+ * @npages: Number of pages
+ *
+ * Map @npages PROT_NONE pages at @addr, allocated by arena_alloc() and still in
+ * use, over whatever is left there. The pages are mapped like the other pages
+ * of the arena, so that the kernel can merge them with their neighbours.
+ *
+ * Return: -1 in case of failure, 0 otherwise.
+ */
+int arena_refill(void *addr, size_t npages);
+
+/*
+ * arena_adopt - Account for pages mapped by the caller
+ * @npages: Number of pages
+ *
+ * Count @npages pages that the caller mapped or moved itself as handed out by
+ * the arena, before they are given back with arena_free().
+ */
+void arena_adopt(size_t npages);
+
+/*
+ * arena_forget - Account for pages unmapped by the caller
+ * @npages: Number of pages
+ *
+ * Stop counting @npages pages handed out by the arena that the caller unmapped
+ * or moved away itself, and that won't be given back with arena_free().
+ */
+void arena_forget(size_t npages);
+
+/*
+ * arena_set_watermarks - Configure the arena
+ * @low: Number of free pages the arena tries to always have ready
+ * @high: Maximum number of free pages the arena keeps for reuse
+ *
+ * Return: -1 if @low is greater than @high. 0 otherwise.
+ */
+int arena_set_watermarks(size_t low, size_t high);
+
+/*
+ * arena_get_stats - Get the occupancy of the arena
+ * @stats: Address of data item where the occupancy is received
+ */
+void arena_get_stats(struct arena_stats *stats);
+
+#endif /* _ARENA_H */
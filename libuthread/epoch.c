@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/* Every thread that ever entered a section has a reader, holding the epoch it
+entered its current section in, or 0 if it is outside any section. Readers are
+reused once their thread exits, and never freed */
+struct epoch_reader {
+	unsigned long active;
+	int used;
+	struct epoch_reader *next;
+};
+
+/* Retired memory waits in limbo, tagged with the epoch it was retired in,
+until a batch of EPOCH_BATCH items is reached and the readers are scanned */
+#define EPOCH_BATCH 64
+
+struct epoch_item {
+	void *ptr;
+	void (*release)(void *);
+	unsigned long epoch;
+	struct epoch_item *next;
+};
+
+static unsigned long global_epoch = 1;
+static struct epoch_reader *readers = NULL;
+static struct epoch_item *limbo = NULL;
+static size_t limbo_count = 0;
+
+/* Only taken by writers and by threads entering their first section */
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+
+static __thread struct epoch_reader *self = NULL;
+
+/* Gives the reader of an exiting thread back */
+static void put_reader(void *arg)
+{
+	struct epoch_reader *reader = arg;
+
+	pthread_mutex_lock(&epoch_lock);
+	__atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+	reader->used = 0;
+	pthread_mutex_unlock(&epoch_lock);
+}
+
+static void create_key(void)
+{
+	pthread_key_create(&reader_key, put_reader);
+}
+
+static struct epoch_reader *get_reader(void)
+{
+	struct epoch_reader *reader;
+
+	pthread_once(&key_once, create_key);
+	pthread_mutex_lock(&epoch_lock);
+	for (reader = readers; reader != NULL; reader = reader->next) {
+		if (!reader->used) {
+			break;
+		}
+	}
+
+	if (reader == NULL) {
+		reader = calloc(1, sizeof(struct epoch_reader));
+		if (reader == NULL) {
+			pthread_mutex_unlock(&epoch_lock);
+			return NULL;
+		}
+		reader->next = readers;
+		readers = reader;
+	}
+	reader->used = 1;
+	pthread_mutex_unlock(&epoch_lock);
+
+	pthread_setspecific(reader_key, reader);
+	return reader;
+}
+
+int epoch_enter(void)
+{
+	if (self == NULL) {
+		self = get_reader();
+		if (self == NULL) {
+			return -1;
+		}
+	}
+
+	/* The fence orders our announcement before any read of the section,
+	against the fence of writers between their updates and their scan */
+	__atomic_store_n(&self->active, __atomic_load_n(&global_epoch,
+		__ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void epoch_exit(void)
+{
+	__atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Starts a new epoch, and returns it. Readers in a section from an older epoch
+might have seen anything written before */
+static unsigned long advance_epoch(void)
+{
+	unsigned long epoch = global_epoch + 1;
+
+	__atomic_store_n(&global_epoch, epoch, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return epoch;
+}
+
+void epoch_synchronize(void)
+{
+	pthread_mutex_lock(&epoch_lock);
+	unsigned long epoch = advance_epoch();
+
+	for (struct epoch_reader *reader = readers; reader != NULL;
+		reader = reader->next) {
+		unsigned long active;
+
+		while ((active = __atomic_load_n(&reader->active,
+			__ATOMIC_ACQUIRE)) != 0 && active < epoch) {
+			sched_yield();
+		}
+	}
+	pthread_mutex_unlock(&epoch_lock);
+}
+
+/* Releases the items of the limbo retired before the oldest epoch a reader is
+still in */
+static void reclaim(void)
+{
+	unsigned long oldest = advance_epoch();
+
+	for (struct epoch_reader *reader = readers; reader != NULL;
+		reader = reader->next) {
+		unsigned long active = __atomic_load_n(&reader->active,
+			__ATOMIC_ACQUIRE);
+
+		if (active != 0 && active < oldest) {
+			oldest = active;
+		}
+	}
+
+	struct epoch_item **link = &limbo;
+	while (*link != NULL) {
+		struct epoch_item *item = *link;
+
+		if (item->epoch < oldest) {
+			*link = item->next;
+			item->release(item->ptr);
+			free(item);
+			limbo_count--;
+		} else {
+			link = &item->next;
+		}
+	}
+}
+
+void epoch_retire(void *ptr, void (*release)(void *))
+{
+	struct epoch_item *item = malloc(sizeof(struct epoch_item));
+
+	pthread_mutex_lock(&epoch_lock);
+	if (item == NULL) {
+		/* Waiting for the readers is the only other safe option */
+		pthread_mutex_unlock(&epoch_lock);
+		epoch_synchronize();
+		release(ptr);
+		return;
+	}
+
+	item->ptr = ptr;
+	item->release = release;
+	item->epoch = global_epoch;
+	item->next = limbo;
+	limbo = item;
+	if (++limbo_count >= EPOCH_BATCH) {
+		reclaim();
+	}
+	pthread_mutex_unlock(&epoch_lock);
+}
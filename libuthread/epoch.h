@@ -0,0 +1,47 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+/*
+ * Epoch-based reclamation lets threads read shared data structures without
+ * taking any lock nor performing any atomic read-modify-write operation.
+ *
+ * Readers surround their accesses with epoch_enter() and epoch_exit(). Writers
+ * unlink what they want to free, and hand it over to epoch_retire() instead of
+ * freeing it: it is only released once no reader can still be looking at it.
+ * Writers can also wait for every reader currently inside epoch_enter() and
+ * epoch_exit() to be done with epoch_synchronize().
+ */
+
+/*
+ * epoch_enter - Enter a read-side section
+ *
+ * Sections cannot be nested. The first call from a thread registers it, which
+ * takes a lock; later calls are wait-free.
+ *
+ * Return: -1 if the thread could not be registered, in which case it must not
+ * call epoch_exit(). 0 otherwise.
+ */
+int epoch_enter(void);
+
+/*
+ * epoch_exit - Leave a read-side section
+ */
+void epoch_exit(void);
+
+/*
+ * epoch_synchronize - Wait for readers
+ *
+ * Wait until every thread which was inside a read-side section when this
+ * function was called has left it. Everything stored before the call is seen by
+ * any reader entering a section afterwards.
+ */
+void epoch_synchronize(void);
+
+/*
+ * epoch_retire - Free memory once readers are done with it
+ * @ptr: Memory that readers entering a section from now on cannot reach
+ * @release: Function called with @ptr once no reader can still reach it
+ */
+void epoch_retire(void *ptr, void (*release)(void *));
+
+#endif /* _EPOCH_H */
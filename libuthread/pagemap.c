@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pagemap.h"
+
+/* The tree is indexed by page number, 9 bits per level, which makes every
+node exactly one page. Only the lower 48 bits of an address are used by user
+space on the 64-bit architectures we care about, so four levels are enough
+there and three on 32-bit ones. */
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_BITS 9
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+#define PAGEMAP_ADDR_BITS (sizeof(void *) == 8 ? 48 : 32)
+#define PAGEMAP_LEVELS ((PAGEMAP_ADDR_BITS - PAGEMAP_SHIFT + PAGEMAP_BITS - 1) \
+	/ PAGEMAP_BITS)
+
+struct pagemap_node {
+	void *slots[PAGEMAP_FANOUT];
+};
+
+/* Nodes are published with a release compare-and-swap once they are fully
+initialized, and are never freed, so a reader can walk the tree without any
+lock, and threads setting different pages don't need one either */
+static struct pagemap_node pagemap_root;
+
+static size_t slot_index(uintptr_t pgnum, int level)
+{
+	int shift = (PAGEMAP_LEVELS - 1 - level) * PAGEMAP_BITS;
+
+	return (pgnum >> shift) & (PAGEMAP_FANOUT - 1);
+}
+
+int pagemap_set(void *page, void *value)
+{
+	uintptr_t pgnum = (uintptr_t) page >> PAGEMAP_SHIFT;
+	struct pagemap_node *node = &pagemap_root;
+
+	if ((uint64_t) (uintptr_t) page >> PAGEMAP_ADDR_BITS) {
+		return -1;
+	}
+
+	for (int level = 0; level < PAGEMAP_LEVELS - 1; level++) {
+		void **slot = &node->slots[slot_index(pgnum, level)];
+		struct pagemap_node *next = __atomic_load_n(slot,
+			__ATOMIC_ACQUIRE);
+
+		if (next == NULL) {
+			/* No need to allocate a path just to clear a slot */
+			if (value == NULL) {
+				return 0;
+			}
+
+			struct pagemap_node *fresh = calloc(1,
+				sizeof(struct pagemap_node));
+			if (fresh == NULL) {
+				return -1;
+			}
+
+			/* Another thread may have published the same node in
+			the meantime, in which case we use theirs */
+			if (__atomic_compare_exchange_n(slot, &next, fresh, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				next = fresh;
+			} else {
+				free(fresh);
+			}
+		}
+		node = next;
+	}
+
+	__atomic_store_n(&node->slots[slot_index(pgnum, PAGEMAP_LEVELS - 1)],
+		value, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *pagemap_get(void *addr)
+{
+	uintptr_t pgnum = (uintptr_t) addr >> PAGEMAP_SHIFT;
+	struct pagemap_node *node = &pagemap_root;
+
+	if ((uint64_t) (uintptr_t) addr >> PAGEMAP_ADDR_BITS) {
+		return NULL;
+	}
+
+	for (int level = 0; level < PAGEMAP_LEVELS - 1; level++) {
+		node = __atomic_load_n(&node->slots[slot_index(pgnum, level)],
+			__ATOMIC_ACQUIRE);
+		if (node == NULL) {
+			return NULL;
+		}
+	}
+
+	return __atomic_load_n(&node->slots[slot_index(pgnum,
+		PAGEMAP_LEVELS - 1)], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,44 @@
+#ifndef _PAGEMAP_H
+#define _PAGEMAP_H
+
+#include <stdint.h>
+
+/*
+ * Size of the pages indexed by the page map, in bytes
+ */
+#define PAGEMAP_PAGE_SIZE 4096
+
+/*
+ * The page map is a radix tree indexing memory pages by address. Lookups never
+ * take a lock nor allocate memory, which makes pagemap_get() safe to call from
+ * a signal handler, even while another thread is updating the map.
+ *
+ * Updates don't take a lock either: threads may set different pages
+ * concurrently, but callers must make sure a given page is only set by one
+ * thread at a time.
+ */
+
+/*
+ * pagemap_set - Associate a value to a page
+ * @page: Address of the page
+ * @value: Value to associate to @page, or NULL to remove @page from the map
+ *
+ * Any address located inside a page can be used to refer to it.
+ *
+ * Return: -1 if @page cannot be indexed, or in case of memory allocation error.
+ * 0 if @value was successfully associated to @page.
+ */
+int pagemap_set(void *page, void *value);
+
+/*
+ * pagemap_get - Find the value associated to a page
+ * @addr: Any address located inside the page
+ *
+ * This function is lock-free and async-signal-safe.
+ *
+ * Return: Value associated to the page containing @addr, or NULL if the page
+ * is not in the map.
+ */
+void *pagemap_get(void *addr);
+
+#endif /* _PAGEMAP_H */
@@ -5,6 +5,7 @@
 #include "queue.h"
 #include "sem.h"
 #include "thread.h"
+#include "tps.h"
 
 struct semaphore {
 	size_t count;
@@ -44,9 +45,12 @@ int sem_destroy(sem_t sem)
 }
 
 /* Sem down blocks a thread if there are no available resources and
-decrements the semaphore's count once the thread is able to run */
+decrements the semaphore's count once the thread is able to run. The pages
+that TPS_DEFERRED left open are closed first */
 int sem_down(sem_t sem)
 {
+	/* The thread may block, so its TPS must not stay open meanwhile */
+	tps_settle();
 	enter_critical_section();
 
 	if (sem == NULL) {
@@ -1,321 +1,4506 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
-#include "queue.h"
-#include "thread.h"
+#include "arena.h"
+#include "epoch.h"
+#include "pagemap.h"
 #include "tps.h"
 
-/* mempage holds a void pointer to the private memory used by the thread.
-This allows multiple threads to point the the same dynamically allocated 
-space in the case of cloning. When this occurs, num_refs keeps track of the
-number of cloning threads/ */
+/* mempage holds a void pointer to one page of private memory used by the
+thread. This allows multiple threads to point the the same dynamically
+allocated page in the case of cloning. When this occurs, num_refs keeps track
+of the number of cloning threads. Pages are shared and copied one at a time,
+so writing to one page of a large cloned TPS only copies that page.
+
+home is the TPS whose area the page is mapped in, or NULL if the page was
+mapped on its own (e.g. when it outlived the TPS it was created by).
+
+With TPS_MEMFD, a mempage is a page of the memory file instead, found at offset
+foff, and memptr is not used. Every TPS maps the file pages it refers to in its
+own range: MAP_SHARED if the page is its own, in which case it is its home, or
+MAP_PRIVATE if the page is shared, in which case the kernel copies the page
+when it is written to.
+
+lock protects every field of the page, as well as the protection and content
+of the memory it points to, as a shared page can be accessed or copied by
+several threads at once. */
 struct mempage {
+	pthread_mutex_t lock;
 	void *memptr;
+	off_t foff;
 	int num_refs;
+	struct tps *home;
+};
+
+/* Holds the TID of the the thread this TPS belogs too, allowing us to find
+the tps. size is the number of bytes that can be accessed, rounded up to
+npages pages, each of them held by a mempage.
+
+base is a range of npages pages reserved for this TPS, where pages[i] lives
+whenever the TPS owns it. A page borrowed from a cloned TPS lives in that TPS's
+range instead, and the matching page of base is left untouched until a write
+makes the page private. A clone doesn't reserve its range until then.
+
+With TPS_MEMFD, pages always live in the range of the TPS, which is reserved
+from the start. pages[i] is NULL once the kernel has made a private copy of a
+shared page, which is then not part of the memory file anymore.
+
+mapped holds the mode the TPS was mapped with by tps_map(), or 0. While a TPS
+is mapped all its pages live in its range.
+
+lock protects every other field but next, which belongs to the table. Only the
+owner thread changes a TPS, but other threads read it when they clone it. The
+pages of a TPS are locked after the TPS itself, in increasing order: a shared
+page is found at the same index in every TPS referring to it, so two threads
+can never wait on each other's pages. mapped is only changed with every page of
+the TPS locked, as the other TPS's sharing a page look at it.
+
+tps_read() doesn't take any lock when every page it reads is private, see
+read_private(). cloning counts the other threads cloning the TPS, so that the
+owner takes the locks again meanwhile. A cloner counts itself in under the
+table lock, and waits for lock-free readers before taking the lock of the TPS,
+which is not destroyed until every cloner is done.
+
+tps_read_from() doesn't take any lock either, see read_from(). seq is made odd
+by the holder of the lock before the content, the size or the pages of the TPS
+change, and even again afterwards. The pages array is retired rather than
+freed.
+
+backed is the mode a TPS created by tps_create_backed() maps its file with, or
+0. Its range is then a mapping of the file, which must never be handed to the
+arena, and which its pages never outlive.
+
+open is the protection that TPS_DEFERRED and TPS_GUARD_ONLY leave the pages of
+the TPS at between accesses, as a mode of tps_map(), or 0. It is changed like
+mapped, and opens the pages the same way, see open_prot().
+
+unclaimed is set for a TPS made for another thread by tps_clone_batch() or
+tps_transfer(), until that thread first finds it, and claimant is then the CPU
+clock of that thread.
+The clock is made from the kernel's ID of the thread, which is not reused as
+soon as its pthread_t: a later thread reusing the pthread_t finds a TPS which
+isn't its own, and destroys it. Both belong to the table, like next.
+
+spares holds nspares mempages set aside for the signal handler while the TPS is
+mapped for writing, one for each of its shared pages, see reserve_spares(). */
+struct tps {
+	pthread_mutex_t lock;
+	pthread_t tid;
+	size_t size;
+	size_t npages;
+	void *base;
+	int mapped;
+	int open;
+	int cloning;
+	int backed;
+	unsigned int seq;
+	struct mempage **pages;
+	struct tps *next;
+	int unclaimed;
+	clockid_t claimant;
+	struct mempage **spares;
+	size_t nspares;
+};
+
+#define PAGE_ROUND(bytes) (((bytes) + TPS_PAGE_SIZE - 1) & ~(TPS_PAGE_SIZE - 1))
+
+/* Flags given to tps_init() */
+static int tps_flags = 0;
+
+/* Gets the protection level given to tps_init(), which TPS_MEMFD ignores */
+static int protection_level(void)
+{
+	if (tps_flags & TPS_MEMFD) {
+		return TPS_STRICT;
+	}
+
+	return tps_flags & (TPS_DEFERRED|TPS_GUARD_ONLY);
+}
+
+/* Memory file backing the TPS's with TPS_MEMFD. The file only grows, by
+MEMFD_CHUNK bytes at a time, and pages are never reused: pages that are not
+needed anymore are punched out of the file, which gives their memory back */
+#define MEMFD_CHUNK (256 << 20)
+
+static int memfd = -1;
+static off_t memfd_size = 0;
+static off_t memfd_next = 0;
+
+/* Protects the page arena and the allocation of memory file pages. Taken
+last, after any TPS or page lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The TPS's are indexed in a hash table keyed by TID. Each bucket is a singly
+linked list of TPS's chained through their next pointer. The table doubles in
+size whenever the number of TPS's exceeds the number of buckets so that the
+chains stay short no matter how many threads are using the API.
+
+table_lock protects the table, and is only held while looking a TPS up,
+inserting or removing it: a thread working on its own TPS never takes it. It is
+taken before any TPS lock. */
+#define TPS_TABLE_MIN 64
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct tps **tps_table = NULL;
+size_t tps_buckets = 0;
+size_t tps_count = 0;
+
+/* Every thread caches a pointer to its own TPS so the common case (a thread
+working on its own TPS) doesn't have to search the table at all. */
+static __thread struct tps *curr_tps_cache = NULL;
+
+/* The TPS of a thread is also the value of tps_key for that thread, so that a
+thread exiting without destroying its TPS has it reclaimed, see reclaim_tps().
+reclaiming is set meanwhile */
+static pthread_key_t tps_key;
+static __thread int reclaiming = 0;
+
+static void reclaim_tps(void *arg);
+
+/* Statistics are counted by every thread on its own, with plain stores, and
+only added up by tps_get_stats(). The counters of a thread are added to
+retired_stats when it exits. stats_lock protects the list of counters and
+retired_stats, and is taken after any other lock */
+enum { STAT_COW, STAT_MPROTECT, STAT_MMAP, STAT_MUNMAP, STAT_COUNT };
+enum { LATENCY_READ, LATENCY_WRITE, LATENCY_CLONE, LATENCY_COUNT };
+
+struct thread_stats {
+	uint64_t counts[STAT_COUNT];
+	uint64_t latency[LATENCY_COUNT][TPS_STATS_BUCKETS];
+	struct thread_stats *next;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static struct thread_stats *stats_list = NULL;
+static struct thread_stats retired_stats;
+static __thread struct thread_stats *curr_stats = NULL;
+
+static void retire_stats(void *arg)
+{
+	struct thread_stats *stats = arg;
+
+	pthread_mutex_lock(&stats_lock);
+	for (int n = 0; n < STAT_COUNT; n++) {
+		retired_stats.counts[n] += stats->counts[n];
+	}
+	for (int op = 0; op < LATENCY_COUNT; op++) {
+		for (int b = 0; b < TPS_STATS_BUCKETS; b++) {
+			retired_stats.latency[op][b] += stats->latency[op][b];
+		}
+	}
+
+	struct thread_stats **link = &stats_list;
+	while (*link != stats) {
+		link = &(*link)->next;
+	}
+	*link = stats->next;
+	pthread_mutex_unlock(&stats_lock);
+
+	curr_stats = NULL;
+	free(stats);
+}
+
+static void create_stats_key(void)
+{
+	pthread_key_create(&stats_key, retire_stats);
+}
+
+/* Creates the counters of the current thread. This is done when the thread
+first looks its TPS up, as the signal handler can't allocate them. Counting
+simply stops if they can't be allocated */
+static void init_stats(void)
+{
+	if (curr_stats != NULL) {
+		return;
+	}
+
+	struct thread_stats *stats = calloc(1, sizeof(struct thread_stats));
+	if (stats == NULL) {
+		return;
+	}
+
+	pthread_once(&stats_once, create_stats_key);
+	pthread_mutex_lock(&stats_lock);
+	stats->next = stats_list;
+	stats_list = stats;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, stats);
+	curr_stats = stats;
+}
+
+/* Only the owner thread writes its counters, but tps_get_stats() reads them */
+static void bump(uint64_t *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static void count_stat(int stat)
+{
+	if (curr_stats != NULL) {
+		bump(&curr_stats->counts[stat]);
+	}
+}
+
+/* Operations are only timed with TPS_LATENCY, the other counters cost a
+store each and are always kept */
+static void start_latency(struct timespec *start)
+{
+	if (tps_flags & TPS_LATENCY) {
+		clock_gettime(CLOCK_MONOTONIC, start);
+	}
+}
+
+/* Counts a call to operation op which started at start, in the bucket of its
+latency's log2 */
+static void count_latency(int op, const struct timespec *start)
+{
+	struct timespec now;
+
+	if (!(tps_flags & TPS_LATENCY) || curr_stats == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ns = (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+	int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+
+	if (bucket >= TPS_STATS_BUCKETS) {
+		bucket = TPS_STATS_BUCKETS - 1;
+	}
+	bump(&curr_stats->latency[op][bucket]);
+}
+
+/* System calls changing the mappings of TPS ranges go through these, so that
+they are counted */
+static int do_mprotect(void *addr, size_t len, int prot)
+{
+	count_stat(STAT_MPROTECT);
+	return mprotect(addr, len, prot);
+}
+
+static void *do_mmap(void *addr, size_t len, int prot, int flags, int fd,
+	off_t off)
+{
+	count_stat(STAT_MMAP);
+	return mmap(addr, len, prot, flags, fd, off);
+}
+
+static void *do_mremap(void *old_addr, size_t old_len, size_t new_len,
+	int flags, void *new_addr)
+{
+	count_stat(STAT_MMAP);
+	return mremap(old_addr, old_len, new_len, flags, new_addr);
+}
+
+static int do_munmap(void *addr, size_t len)
+{
+	count_stat(STAT_MUNMAP);
+	return munmap(addr, len);
+}
+
+/* Hashes a TID by mixing its bytes, pthread_t being an opaque type */
+static size_t hash_tid(pthread_t tid)
+{
+	const unsigned char *bytes = (const unsigned char *) &tid;
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < sizeof(pthread_t); i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return (size_t) (hash ^ (hash >> 32));
+}
+
+/* This function finds a specific tps in the table by searching for it's TID */
+static struct tps *find_tps(pthread_t tid)
+{
+	struct tps *curr = tps_table[hash_tid(tid) & (tps_buckets - 1)];
+
+	while (curr != NULL && !pthread_equal(tid, curr->tid)) {
+		curr = curr->next;
+	}
+
+	return curr;
+}
+
+static void unlink_tps(struct tps *old_tps);
+static void destroy_unlinked(struct tps *curr_tps);
+
+/* Claims a TPS found in the table under our TID, which is locked: a TPS made
+for a thread which exited without using it is taken out of the table, and
+returned to be destroyed */
+static struct tps *claim_tps(struct tps *curr_tps)
+{
+	clockid_t clock;
+
+	if (curr_tps == NULL || !curr_tps->unclaimed) {
+		return NULL;
+	}
+
+	curr_tps->unclaimed = 0;
+	if (pthread_getcpuclockid(pthread_self(), &clock) == 0 &&
+		clock == curr_tps->claimant) {
+		return NULL;
+	}
+	unlink_tps(curr_tps);
+	return curr_tps;
+}
+
+/* Finds the TPS of the current thread, going through the per-thread cache
+first */
+static struct tps *find_curr_tps(void)
+{
+	init_stats();
+	if (curr_tps_cache == NULL) {
+		struct tps *stale = NULL;
+
+		pthread_mutex_lock(&table_lock);
+		if (tps_table != NULL) {
+			curr_tps_cache = find_tps(pthread_self());
+			stale = claim_tps(curr_tps_cache);
+		}
+		pthread_mutex_unlock(&table_lock);
+
+		if (stale != NULL) {
+			destroy_unlinked(stale);
+			curr_tps_cache = NULL;
+		}
+
+		/* A clone made for us by tps_clone_batch(), or a TPS handed
+		to us by tps_transfer() */
+		if (curr_tps_cache != NULL) {
+			pthread_setspecific(tps_key, curr_tps_cache);
+		}
+	}
+
+	return curr_tps_cache;
+}
+
+/* Makes a TPS the current thread's own, or forgets it if NULL */
+static void own_tps(struct tps *curr_tps)
+{
+	curr_tps_cache = curr_tps;
+	pthread_setspecific(tps_key, curr_tps);
+}
+
+static int close_tps(struct tps *curr_tps);
+
+/* Finds the TPS of the current thread and locks it. With TPS_DEFERRED, the
+pages left open are closed first: only reads, writes and atomic operations
+find them open, and lock the TPS on their own */
+static struct tps *lock_curr_tps(void)
+{
+	struct tps *curr_tps = find_curr_tps();
+
+	if (curr_tps != NULL) {
+		pthread_mutex_lock(&curr_tps->lock);
+		if (protection_level() == TPS_DEFERRED) {
+			close_tps(curr_tps);
+		}
+	}
+
+	return curr_tps;
+}
+
+/* Surround changes to a TPS, whose lock is held, for the readers of
+tps_read_from() */
+static void begin_change(struct tps *curr_tps)
+{
+	__atomic_store_n(&curr_tps->seq, curr_tps->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_change(struct tps *curr_tps)
+{
+	__atomic_store_n(&curr_tps->seq, curr_tps->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Locks the pages first to last of a TPS, in increasing order. Pages that the
+kernel made private with TPS_MEMFD have no mempage, and no lock */
+static void lock_pages(struct tps *curr_tps, size_t first, size_t last)
+{
+	for (size_t i = first; i <= last; i++) {
+		if (curr_tps->pages[i] != NULL) {
+			pthread_mutex_lock(&curr_tps->pages[i]->lock);
+		}
+	}
+}
+
+static void unlock_pages(struct tps *curr_tps, size_t first, size_t last)
+{
+	for (size_t i = first; i <= last; i++) {
+		if (curr_tps->pages[i] != NULL) {
+			pthread_mutex_unlock(&curr_tps->pages[i]->lock);
+		}
+	}
+}
+
+/* Doubles the number of buckets and rehashes every TPS into the new table */
+static int grow_table(void)
+{
+	size_t new_buckets = tps_buckets * 2;
+	struct tps **new_table = calloc(new_buckets, sizeof(struct tps *));
+
+	if (new_table == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < tps_buckets; i++) {
+		struct tps *curr = tps_table[i];
+
+		while (curr != NULL) {
+			struct tps *next = curr->next;
+			size_t bucket = hash_tid(curr->tid) & (new_buckets - 1);
+
+			curr->next = new_table[bucket];
+			new_table[bucket] = curr;
+			curr = next;
+		}
+	}
+
+	free(tps_table);
+	tps_table = new_table;
+	tps_buckets = new_buckets;
+	return 0;
+}
+
+/* Adds a TPS to the table, which is locked, growing it first if it is getting
+crowded. A failure to grow is not fatal, the chains simply get longer */
+static void link_tps(struct tps *new_tps)
+{
+	if (tps_count >= tps_buckets) {
+		grow_table();
+	}
+
+	size_t bucket = hash_tid(new_tps->tid) & (tps_buckets - 1);
+
+	new_tps->next = tps_table[bucket];
+	tps_table[bucket] = new_tps;
+	tps_count++;
+}
+
+static void insert_tps(struct tps *new_tps)
+{
+	pthread_mutex_lock(&table_lock);
+	link_tps(new_tps);
+	pthread_mutex_unlock(&table_lock);
+}
+
+/* Unlinks a TPS from its bucket's chain, the table being locked */
+static void unlink_tps(struct tps *old_tps)
+{
+	struct tps **link = &tps_table[hash_tid(old_tps->tid) & (tps_buckets - 1)];
+
+	while (*link != NULL && *link != old_tps) {
+		link = &(*link)->next;
+	}
+
+	if (*link != NULL) {
+		*link = old_tps->next;
+		tps_count--;
+	}
+}
+
+static void remove_tps(struct tps *old_tps)
+{
+	pthread_mutex_lock(&table_lock);
+	unlink_tps(old_tps);
+	pthread_mutex_unlock(&table_lock);
+}
+
+/* Whether ranges come from the page arena. Ranges made of views of the memory
+file can't be recycled as they are, so TPS_MEMFD doesn't use the arena */
+static int use_arena(void)
+{
+	return (tps_flags & (TPS_ARENA|TPS_MEMFD)) == TPS_ARENA;
+}
+
+/* With TPS_REGION, the chunks of the arena are carved from a single region */
+static int use_region(void)
+{
+	return (tps_flags & (TPS_REGION|TPS_MEMFD)) == TPS_REGION;
+}
+
+/* Number of guard pages following the range of a TPS. The guard page belongs
+to the range, and is given back with it. A backed TPS maps its file on its own,
+and has none */
+static size_t range_guard(struct tps *curr_tps)
+{
+	return use_region() && (tps_flags & TPS_GUARD) && !curr_tps->backed;
+}
+
+/* With TPS_HUGE, ranges of at least a huge page are mapped on their own */
+#define TPS_HUGE_SIZE (2 * 1024 * 1024)
+
+static int use_huge(void)
+{
+	return (tps_flags & (TPS_HUGE|TPS_MEMFD)) == TPS_HUGE;
+}
+
+/* Maps a range of npages PROT_NONE pages starting on a huge page boundary, and
+advises it with MADV_HUGEPAGE so that the kernel backs it with huge pages when
+it can. The kernel splits a huge page back into 4 KB pages by itself as soon as
+part of it gets another protection, or is copied on write */
+static void *map_huge(size_t npages)
+{
+	size_t len = npages * TPS_PAGE_SIZE;
+	size_t slack = TPS_HUGE_SIZE - TPS_PAGE_SIZE;
+	char *addr = do_mmap(NULL, len + slack, PROT_NONE, MAP_ANON|MAP_PRIVATE,
+		-1, 0);
+
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+
+	char *start = (char *) (((uintptr_t) addr + TPS_HUGE_SIZE - 1) &
+		~((uintptr_t) TPS_HUGE_SIZE - 1));
+	if (start > addr) {
+		do_munmap(addr, start - addr);
+	}
+	if (addr + slack > start) {
+		do_munmap(start + len, addr + slack - start);
+	}
+
+	/* Without huge pages, the range is still good as it is */
+	madvise(start, len, MADV_HUGEPAGE);
+	return start;
+}
+
+/* Maps a range of npages PROT_NONE pages. Anonymous memory is already zeroed,
+so there is no need to touch it. Large ranges are not taken from the arena with
+TPS_HUGE, but it still accounts for them so that they can be given back to it */
+static void *map_pages(size_t npages)
+{
+	if (use_huge() && npages * TPS_PAGE_SIZE >= TPS_HUGE_SIZE) {
+		void *addr = map_huge(npages);
+
+		if (addr != NULL && use_arena()) {
+			pthread_mutex_lock(&pool_lock);
+			arena_adopt(npages);
+			pthread_mutex_unlock(&pool_lock);
+		}
+		return addr;
+	}
+
+	if (use_arena()) {
+		pthread_mutex_lock(&pool_lock);
+		void *addr = arena_alloc(npages);
+		pthread_mutex_unlock(&pool_lock);
+		return addr;
+	}
+
+	void *addr = do_mmap(NULL, npages * TPS_PAGE_SIZE, PROT_NONE,
+		MAP_ANON|MAP_PRIVATE, -1, 0);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* Maps the range of a TPS of npages pages, followed by its guard page */
+static void *map_range(struct tps *curr_tps, size_t npages)
+{
+	return map_pages(npages + range_guard(curr_tps));
+}
+
+/* Ranges given up by threads which exit without destroying their TPS are
+unmapped EXIT_BATCH at a time rather than one by one, under the pool lock.
+Threads of a pool tend to exit together, and their ranges were often mapped
+next to each other: adjacent ranges are unmapped with a single munmap(). The
+memory of a range is given back as soon as it is queued, so that a partial
+batch holds none, and the batch is also unmapped by the next tps_destroy().
+Flushing it on tps_create() instead would undo the batching, as threads of a
+pool keep being created while others exit */
+#define EXIT_BATCH 64
+
+struct exit_range {
+	void *addr;
+	size_t npages;
 };
 
-/* Holds the TID of the the thread this TPS belogs too, allowing us to find
-the tps. Holds a memarea which contains the a reference to the allocated
-memory. */
-struct tps {
-	pthread_t tid;
-	struct mempage *memarea;
-};
+static struct exit_range exit_ranges[EXIT_BATCH];
+static size_t exit_count = 0;
+
+static int compare_exit_ranges(const void *a, const void *b)
+{
+	uintptr_t first = (uintptr_t) ((const struct exit_range *) a)->addr;
+	uintptr_t second = (uintptr_t) ((const struct exit_range *) b)->addr;
+
+	return first < second ? -1 : first > second;
+}
+
+static void flush_exit_ranges(void)
+{
+	qsort(exit_ranges, exit_count, sizeof(struct exit_range),
+		compare_exit_ranges);
+
+	size_t run = 0;
+	size_t npages = exit_ranges[0].npages;
+	for (size_t k = 1; k <= exit_count; k++) {
+		if (k < exit_count && exit_ranges[k].addr ==
+			exit_ranges[run].addr + npages * TPS_PAGE_SIZE) {
+			npages += exit_ranges[k].npages;
+			continue;
+		}
+
+		do_munmap(exit_ranges[run].addr, npages * TPS_PAGE_SIZE);
+		if (k < exit_count) {
+			run = k;
+			npages = exit_ranges[k].npages;
+		}
+	}
+	exit_count = 0;
+}
+
+/* Unmaps the ranges queued since the last batch */
+static void flush_exits(void)
+{
+	if (__atomic_load_n(&exit_count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	if (exit_count > 0) {
+		flush_exit_ranges();
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Unmaps a range of PROT_NONE pages, or gives it back to the arena */
+static void unmap_pages(void *addr, size_t npages)
+{
+	if (use_arena()) {
+		pthread_mutex_lock(&pool_lock);
+		arena_free(addr, npages);
+		pthread_mutex_unlock(&pool_lock);
+	} else if (reclaiming) {
+		madvise(addr, npages * TPS_PAGE_SIZE, MADV_DONTNEED);
+		pthread_mutex_lock(&pool_lock);
+		exit_ranges[exit_count].addr = addr;
+		exit_ranges[exit_count++].npages = npages;
+		if (exit_count == EXIT_BATCH) {
+			flush_exit_ranges();
+		}
+		pthread_mutex_unlock(&pool_lock);
+	} else {
+		do_munmap(addr, npages * TPS_PAGE_SIZE);
+	}
+}
+
+/* Tells the arena about pages the kernel moved out of it or into it */
+static void account_pages(size_t forgotten, size_t adopted)
+{
+	if (use_arena()) {
+		pthread_mutex_lock(&pool_lock);
+		arena_forget(forgotten);
+		arena_adopt(adopted);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+/* Reserves npages consecutive pages of the memory file, growing it if needed */
+static off_t alloc_file_pages(size_t npages)
+{
+	pthread_mutex_lock(&pool_lock);
+	off_t foff = memfd_next;
+	off_t end = foff + npages * TPS_PAGE_SIZE;
+
+	if (end > memfd_size) {
+		off_t size = (end + MEMFD_CHUNK - 1) & ~((off_t) MEMFD_CHUNK - 1);
+
+		if (ftruncate(memfd, size) < 0) {
+			pthread_mutex_unlock(&pool_lock);
+			return -1;
+		}
+		memfd_size = size;
+	}
+
+	memfd_next = end;
+	pthread_mutex_unlock(&pool_lock);
+	return foff;
+}
+
+/* Allocates a mempage for the file page at foff */
+static struct mempage *new_file_page(off_t foff, struct tps *home)
+{
+	struct mempage *page = malloc(sizeof(struct mempage));
+
+	if (page == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&page->lock, NULL);
+	page->memptr = NULL;
+	page->foff = foff;
+	page->num_refs = 1;
+	page->home = home;
+	return page;
+}
+
+static void destroy_mempage(void *arg)
+{
+	struct mempage *page = arg;
+
+	pthread_mutex_destroy(&page->lock);
+	free(page);
+}
+
+/* Frees a mempage nobody refers to anymore, once no lock-free reader can still
+be looking at it */
+static void free_mempage(struct mempage *page)
+{
+	epoch_retire(page, destroy_mempage);
+}
+
+/* Registers the slots first to last of a TPS's range in the page map, or
+removes them if value is NULL. Only used with TPS_MEMFD, where the ranges are
+registered as a whole rather than page by page */
+static int register_slots(struct tps *curr_tps, size_t first, size_t last,
+	void *value)
+{
+	for (size_t i = first; i < last; i++) {
+		if (pagemap_set(curr_tps->base + i * TPS_PAGE_SIZE, value) < 0) {
+			register_slots(curr_tps, first, i, NULL);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Allocates a mempage for the page at addr and registers it in the page map
+so the signal handler can recognize it */
+static struct mempage *new_mempage(void *addr, struct tps *home)
+{
+	struct mempage *page = malloc(sizeof(struct mempage));
+
+	if (page == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&page->lock, NULL);
+	page->memptr = addr;
+	page->foff = 0;
+	page->num_refs = 1;
+	page->home = home;
+	if (pagemap_set(addr, page) < 0) {
+		free_mempage(page);
+		return NULL;
+	}
+
+	return page;
+}
+
+/* Gives new pages to the slots first to last of a TPS, taken from its own
+range. With TPS_MEMFD, they are taken from the memory file and mapped over
+that part of the range */
+static int fill_pages(struct tps *curr_tps, size_t first, size_t last)
+{
+	if (tps_flags & TPS_MEMFD) {
+		void *start = curr_tps->base + first * TPS_PAGE_SIZE;
+		size_t len = (last - first) * TPS_PAGE_SIZE;
+		off_t foff = alloc_file_pages(last - first);
+
+		if (foff < 0 || do_mmap(start, len, PROT_NONE,
+			MAP_SHARED|MAP_FIXED, memfd, foff) == MAP_FAILED) {
+			return -1;
+		}
+
+		for (size_t i = first; i < last; i++) {
+			curr_tps->pages[i] = new_file_page(foff + (i - first) *
+				TPS_PAGE_SIZE, curr_tps);
+			if (curr_tps->pages[i] == NULL) {
+				while (i-- > first) {
+					free_mempage(curr_tps->pages[i]);
+				}
+				return -1;
+			}
+		}
+
+		if (register_slots(curr_tps, first, last, curr_tps) < 0) {
+			for (size_t i = first; i < last; i++) {
+				free_mempage(curr_tps->pages[i]);
+			}
+			return -1;
+		}
+		return 0;
+	}
+
+	for (size_t i = first; i < last; i++) {
+		curr_tps->pages[i] = new_mempage(curr_tps->base +
+			i * TPS_PAGE_SIZE, curr_tps);
+		if (curr_tps->pages[i] == NULL) {
+			while (i-- > first) {
+				pagemap_set(curr_tps->pages[i]->memptr, NULL);
+				free_mempage(curr_tps->pages[i]);
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Gets the mode a TPS's pages rest open with: the one given to tps_map(), and
+the one left by the protection level */
+static int open_prot(struct tps *curr_tps)
+{
+	return curr_tps->mapped | curr_tps->open;
+}
+
+/* Gets the protection a page should have when nobody is accessing it through
+the API: none, unless it is mapped or left open by its home TPS. A page mapped
+for writing stays read-only as long as it is shared, so that writing to it
+faults and makes it private first */
+static int refs_prot(struct mempage *page, int num_refs)
+{
+	if (page->home == NULL || open_prot(page->home) == 0) {
+		return PROT_NONE;
+	}
+	if ((open_prot(page->home) & TPS_MAP_WRITE) && num_refs == 1) {
+		return PROT_READ|PROT_WRITE;
+	}
+
+	return PROT_READ;
+}
+
+static int rest_prot(struct mempage *page)
+{
+	return refs_prot(page, page->num_refs);
+}
+
+/* Drops a reference to a shared page, which is locked, and gives the page the
+protection it rests at from then on. The count is published last: a TPS finding
+its page private reads it without any lock, and must find it closed, and moved
+if unshare_page() moved it */
+static int drop_ref(struct mempage *page)
+{
+	int num_refs = page->num_refs - 1;
+	int retval = do_mprotect(page->memptr, TPS_PAGE_SIZE, refs_prot(page,
+		num_refs));
+
+	__atomic_store_n(&page->num_refs, num_refs, __ATOMIC_RELEASE);
+	return retval < 0 ? -1 : 0;
+}
+
+/* Gets the address of page i of a TPS */
+static void *slot_addr(struct tps *curr_tps, size_t i)
+{
+	if (tps_flags & TPS_MEMFD) {
+		return curr_tps->base + i * TPS_PAGE_SIZE;
+	}
+
+	return curr_tps->pages[i]->memptr;
+}
+
+/* Gets the resting protection of page i of a TPS. With TPS_MEMFD, a TPS can
+write to a page of its range if the page is its own or if it already has a
+private copy of it */
+static int slot_prot(struct tps *curr_tps, size_t i)
+{
+	if (!(tps_flags & TPS_MEMFD)) {
+		return rest_prot(curr_tps->pages[i]);
+	}
+
+	if (curr_tps->mapped == 0) {
+		return PROT_NONE;
+	}
+	if ((curr_tps->mapped & TPS_MAP_WRITE) && (curr_tps->pages[i] == NULL ||
+		curr_tps->pages[i]->home == curr_tps)) {
+		return PROT_READ|PROT_WRITE;
+	}
+
+	return PROT_READ;
+}
+
+/* Returns the pages first to last of a TPS to their resting protection, in
+runs of contiguous pages sharing the same protection */
+static int protect_pages(struct tps *curr_tps, size_t first, size_t last)
+{
+	size_t run = first;
+
+	for (size_t i = first; i <= last; i++) {
+		int prot = slot_prot(curr_tps, i);
+
+		if (i < last && slot_addr(curr_tps, i + 1) == slot_addr(curr_tps,
+			i) + TPS_PAGE_SIZE && slot_prot(curr_tps, i + 1) == prot) {
+			continue;
+		}
+
+		if (do_mprotect(slot_addr(curr_tps, run), (i - run + 1) *
+			TPS_PAGE_SIZE, prot) < 0) {
+			return -1;
+		}
+		run = i + 1;
+	}
+
+	return 0;
+}
+
+/* Leaves the pages of a TPS, which is locked, open for good if the protection
+level wants it and they aren't already. On failure, they are closed back */
+static int open_tps(struct tps *curr_tps)
+{
+	if (curr_tps->open || protection_level() == TPS_STRICT) {
+		return 0;
+	}
+
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	curr_tps->open = TPS_MAP_READ|TPS_MAP_WRITE;
+	int retval = protect_pages(curr_tps, 0, curr_tps->npages - 1);
+	if (retval < 0) {
+		curr_tps->open = 0;
+		protect_pages(curr_tps, 0, curr_tps->npages - 1);
+	}
+	unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+	return retval;
+}
+
+/* Closes the pages of a TPS, which is locked, that open_tps() left open */
+static int close_tps(struct tps *curr_tps)
+{
+	if (curr_tps->open == 0) {
+		return 0;
+	}
+
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	curr_tps->open = 0;
+	int retval = protect_pages(curr_tps, 0, curr_tps->npages - 1);
+	unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+	return retval;
+}
+
+/* Whether the pages first to last of a TPS, which are locked, were left open
+enough for an access to go without any system call. Pages shared with other
+TPS's are only left open for reading */
+static int rests_open(struct tps *curr_tps, size_t first, size_t last,
+	int write)
+{
+	int prot = write ? PROT_READ|PROT_WRITE : PROT_READ;
+
+	if (curr_tps->open == 0) {
+		return 0;
+	}
+	for (size_t i = first; i <= last; i++) {
+		if ((slot_prot(curr_tps, i) & prot) != prot) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Copies a whole page from src to dst, opening both for the duration of the
+copy. The caller is in charge of setting their protection back */
+static int copy_page(void *dst, void *src)
+{
+	if (do_mprotect(src, TPS_PAGE_SIZE, PROT_READ) < 0 ||
+		do_mprotect(dst, TPS_PAGE_SIZE, PROT_WRITE) < 0) {
+		return -1;
+	}
+
+	memcpy(dst, src, TPS_PAGE_SIZE);
+	count_stat(STAT_COW);
+	return 0;
+}
+
+/* Drops a reference to a locked page of the memory file, and unlocks it. The
+last reference punches it out of the file */
+static void release_file_page(struct mempage *page)
+{
+	if (--page->num_refs > 0) {
+		pthread_mutex_unlock(&page->lock);
+		return;
+	}
+
+	fallocate(memfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, page->foff,
+		TPS_PAGE_SIZE);
+	pthread_mutex_unlock(&page->lock);
+	free_mempage(page);
+}
+
+/* Drops a TPS's reference to its page i, which is locked, and unlocks it. The
+last reference unmaps the page, unless it is mapped inside its home TPS's range:
+the home then takes care of unmapping it along with the rest of its range. A
+page outliving its home is left mapped on its own, and its slot is set to NULL
+so that unmap_range() leaves it alone */
+static void release_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *page = curr_tps->pages[i];
+
+	if (tps_flags & TPS_MEMFD) {
+		pagemap_set(curr_tps->base + i * TPS_PAGE_SIZE, NULL);
+		if (page != NULL) {
+			release_file_page(page);
+		}
+		return;
+	}
+
+	if (page->num_refs > 1) {
+		if (page->home == curr_tps) {
+			page->home = NULL;
+			curr_tps->pages[i] = NULL;
+		}
+
+		/* A page left private to a TPS which has it mapped or open
+		becomes writable again */
+		if (page->home != NULL && refs_prot(page, page->num_refs - 1) !=
+			rest_prot(page)) {
+			drop_ref(page);
+		} else {
+			__atomic_store_n(&page->num_refs, page->num_refs - 1,
+				__ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&page->lock);
+		return;
+	}
+
+	pagemap_set(page->memptr, NULL);
+	if (page->home == NULL) {
+		unmap_pages(page->memptr, 1);
+	}
+	pthread_mutex_unlock(&page->lock);
+	free_mempage(page);
+}
+
+/* Unmaps the slots first to last of a TPS's range once release_page() has
+been called on them, except the pages that are still referenced by clones and
+now live on their own. The guard page goes with the last slot of the range.
+The range of a backed TPS maps its file, and is never given to the arena */
+static void unmap_range(struct tps *curr_tps, size_t first, size_t last)
+{
+	size_t run = first;
+	size_t guard = last == curr_tps->npages ? range_guard(curr_tps) : 0;
+
+	for (size_t i = first; i <= last; i++) {
+		if (i == last || (!(tps_flags & TPS_MEMFD) &&
+			curr_tps->pages[i] == NULL)) {
+			size_t n = i - run + (i == last ? guard : 0);
+
+			if (n > 0 && curr_tps->backed) {
+				do_munmap(curr_tps->base + run * TPS_PAGE_SIZE,
+					n * TPS_PAGE_SIZE);
+			} else if (n > 0) {
+				unmap_pages(curr_tps->base + run *
+					TPS_PAGE_SIZE, n);
+			}
+			run = i + 1;
+		}
+	}
+}
+
+/* Makes page i of a TPS private before it gets written to, with TPS_MEMFD.
+A page that is not shared anymore is mapped MAP_SHARED again so that writes go
+to the file. Otherwise our reference is dropped, and the kernel makes a copy of
+the page on the first write. The page stays locked unless it is dropped */
+static int unshare_file_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *page = curr_tps->pages[i];
+
+	if (page == NULL || page->home == curr_tps) {
+		return 0;
+	}
+
+	if (page->num_refs == 1) {
+		if (do_mmap(curr_tps->base + i * TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+			PROT_NONE, MAP_SHARED|MAP_FIXED, memfd,
+			page->foff) == MAP_FAILED) {
+			return -1;
+		}
+		page->home = curr_tps;
+		return 0;
+	}
+
+	/* The kernel copies the page on the write that follows */
+	curr_tps->pages[i] = NULL;
+	release_file_page(page);
+	count_stat(STAT_COW);
+	return 0;
+}
+
+/* Makes page i of a TPS shareable with a clone, with TPS_MEMFD. Our own page
+is mapped MAP_PRIVATE from now on. A private copy made by the kernel has to be
+written to a new page of the memory file first, which is the only time the
+content of a page gets copied with this engine. The page is left locked */
+static int share_file_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *page = curr_tps->pages[i];
+	void *slot = curr_tps->base + i * TPS_PAGE_SIZE;
+
+	if (page != NULL && page->home != curr_tps) {
+		return 0;
+	}
+
+	if (page == NULL) {
+		off_t foff = alloc_file_pages(1);
+
+		page = foff < 0 ? NULL : new_file_page(foff, NULL);
+		if (page == NULL) {
+			return -1;
+		}
+		pthread_mutex_lock(&page->lock);
+
+		/* The page is closed first so that it cannot be written to
+		behind our back if the TPS is mapped */
+		if (do_mprotect(slot, TPS_PAGE_SIZE, PROT_READ) < 0 ||
+			pwrite(memfd, slot, TPS_PAGE_SIZE, foff) != TPS_PAGE_SIZE) {
+			do_mprotect(slot, TPS_PAGE_SIZE,
+				slot_prot(curr_tps, i));
+			release_file_page(page);
+			return -1;
+		}
+	}
+
+	if (do_mmap(slot, TPS_PAGE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_FIXED,
+		memfd, page->foff) == MAP_FAILED) {
+		if (curr_tps->pages[i] == NULL) {
+			do_mprotect(slot, TPS_PAGE_SIZE,
+				slot_prot(curr_tps, i));
+			release_file_page(page);
+		}
+		return -1;
+	}
+
+	page->home = NULL;
+	curr_tps->pages[i] = page;
+	return do_mprotect(slot, TPS_PAGE_SIZE, slot_prot(curr_tps, i));
+}
+
+/* Makes page i of a TPS private before it gets written to. If the page is
+shared and mapped in our own range, the other TPS's are given a copy and we
+keep the original; otherwise the copy is made into our own range, which gets
+reserved if we didn't have one yet.
+
+The page must be locked. A new private page replacing it is returned locked,
+and the shared page is unlocked once our reference to it is dropped, so that
+the pages of the TPS are still all locked when this returns */
+static int unshare_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *old = curr_tps->pages[i];
+
+	if (tps_flags & TPS_MEMFD) {
+		return unshare_file_page(curr_tps, i);
+	}
+
+	if (old->num_refs == 1) {
+		return 0;
+	}
+
+	if (curr_tps->base == NULL) {
+		curr_tps->base = map_range(curr_tps, curr_tps->npages);
+		if (curr_tps->base == NULL) {
+			return -1;
+		}
+	}
+
+	void *slot = curr_tps->base + i * TPS_PAGE_SIZE;
+
+	if (old->home == curr_tps) {
+		void *copy = map_pages(1);
+
+		if (copy == NULL) {
+			return -1;
+		}
+		if (copy_page(copy, slot) < 0 || pagemap_set(copy, old) < 0) {
+			do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(old));
+			do_mprotect(copy, TPS_PAGE_SIZE, PROT_NONE);
+			unmap_pages(copy, 1);
+			return -1;
+		}
+
+		/* The page now belongs to us only */
+		pagemap_set(slot, NULL);
+		struct mempage *page = new_mempage(slot, curr_tps);
+		if (page == NULL) {
+			pagemap_set(slot, old);
+			pagemap_set(copy, NULL);
+			do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(old));
+			do_mprotect(copy, TPS_PAGE_SIZE, PROT_NONE);
+			unmap_pages(copy, 1);
+			return -1;
+		}
+
+		old->memptr = copy;
+		old->home = NULL;
+		pthread_mutex_lock(&page->lock);
+		curr_tps->pages[i] = page;
+
+		int retval = drop_ref(old) < 0 ||
+			do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(page)) < 0 ?
+			-1 : 0;
+		pthread_mutex_unlock(&old->lock);
+		return retval;
+	}
+
+	int retval = copy_page(slot, old->memptr);
+	struct mempage *page = retval < 0 ? NULL : new_mempage(slot, curr_tps);
+
+	if (page == NULL) {
+		do_mprotect(slot, TPS_PAGE_SIZE, PROT_NONE);
+		do_mprotect(old->memptr, TPS_PAGE_SIZE, rest_prot(old));
+		return -1;
+	}
+
+	/* Dropping our reference might leave the page private to a TPS which
+	has it mapped, in which case it becomes writable again */
+	pthread_mutex_lock(&page->lock);
+	curr_tps->pages[i] = page;
+	retval = drop_ref(old) < 0 ||
+		do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(page)) < 0 ? -1 : 0;
+	pthread_mutex_unlock(&old->lock);
+	return retval;
+}
+
+/* Sets a spare mempage aside for each shared page of a TPS mapped for writing,
+whose pages are locked. The memory of a spare is a page of its own, with no
+access until it is used, and registered in the page map already, so that
+unshare_mapped_page() can use it from the signal handler without allocating
+anything. TPS_MEMFD needs none, the kernel making the copies */
+static int reserve_spares(struct tps *curr_tps)
+{
+	size_t shared = 0;
+
+	if (!(curr_tps->mapped & TPS_MAP_WRITE) || (tps_flags & TPS_MEMFD)) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < curr_tps->npages; i++) {
+		shared += curr_tps->pages[i]->num_refs > 1;
+	}
+	if (curr_tps->spares == NULL && shared > 0) {
+		curr_tps->spares = malloc(curr_tps->npages *
+			sizeof(struct mempage *));
+		if (curr_tps->spares == NULL) {
+			return -1;
+		}
+	}
+
+	while (curr_tps->nspares < shared) {
+		void *addr = map_pages(1);
+		struct mempage *page = addr == NULL ? NULL : new_mempage(addr,
+			NULL);
+
+		if (page == NULL) {
+			if (addr != NULL) {
+				unmap_pages(addr, 1);
+			}
+			return -1;
+		}
+		curr_tps->spares[curr_tps->nspares++] = page;
+	}
+
+	return 0;
+}
+
+/* Gives back the spares of a TPS that is not mapped anymore */
+static void free_spares(struct tps *curr_tps)
+{
+	while (curr_tps->nspares > 0) {
+		struct mempage *page = curr_tps->spares[--curr_tps->nspares];
+
+		pagemap_set(page->memptr, NULL);
+		unmap_pages(page->memptr, 1);
+		free_mempage(page);
+	}
+
+	free(curr_tps->spares);
+	curr_tps->spares = NULL;
+}
+
+/* Makes page i of a TPS mapped for writing private, from the signal handler.
+A shared page of a mapped TPS lives in its range, see tps_map(), so the other
+TPS's are given a copy, as unshare_page() does, but the copy and our new
+mempage are a spare set aside by reserve_spares(). Nothing is allocated or
+freed, and only the locks of the TPS and of the page are taken */
+static int unshare_mapped_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *old = curr_tps->pages[i];
+
+	if (tps_flags & TPS_MEMFD) {
+		return unshare_file_page(curr_tps, i);
+	}
+	if (old->num_refs == 1) {
+		return 0;
+	}
+	if (old->home != curr_tps || curr_tps->nspares == 0) {
+		return -1;
+	}
+
+	void *slot = curr_tps->base + i * TPS_PAGE_SIZE;
+	struct mempage *page = curr_tps->spares[curr_tps->nspares - 1];
+	void *copy = page->memptr;
+
+	if (copy_page(copy, slot) < 0) {
+		do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(old));
+		do_mprotect(copy, TPS_PAGE_SIZE, PROT_NONE);
+		return -1;
+	}
+	curr_tps->nspares--;
+
+	/* Both pages are registered already, which only takes a store */
+	pagemap_set(copy, old);
+	pagemap_set(slot, page);
+	page->memptr = slot;
+	page->home = curr_tps;
+	old->memptr = copy;
+	old->home = NULL;
+	pthread_mutex_lock(&page->lock);
+	curr_tps->pages[i] = page;
+
+	int retval = drop_ref(old) < 0 ||
+		do_mprotect(slot, TPS_PAGE_SIZE, rest_prot(page)) < 0 ? -1 : 0;
+	pthread_mutex_unlock(&old->lock);
+	return retval;
+}
+
+/* Makes sure page i of a TPS lives in its range, before the range is handed
+out by tps_map(). A page that outlived the TPS it was created by is simply
+moved there, but a page still living in another TPS's range has to be copied.
+The page must be locked, like for unshare_page() */
+static int localize_page(struct tps *curr_tps, size_t i)
+{
+	struct mempage *page = curr_tps->pages[i];
+	void *slot = curr_tps->base + i * TPS_PAGE_SIZE;
+
+	if ((tps_flags & TPS_MEMFD) || page->memptr == slot) {
+		return 0;
+	}
+	if (page->home != NULL) {
+		return unshare_page(curr_tps, i);
+	}
+
+	if (do_mremap(page->memptr, TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+		MREMAP_MAYMOVE|MREMAP_FIXED, slot) == MAP_FAILED) {
+		return -1;
+	}
+
+	/* A hole in the region is filled by giving its page back */
+	pagemap_set(page->memptr, NULL);
+	if (use_region()) {
+		unmap_pages(page->memptr, 1);
+	} else {
+		account_pages(1, 0);
+	}
+	page->memptr = slot;
+	page->home = curr_tps;
+	pagemap_set(slot, page);
+	return 0;
+}
+
+/* Copies the data of one segment between its buffer and the opened pages of
+a TPS, one run of contiguous pages at a time */
+static void copy_segment(struct tps *curr_tps, const struct tps_iovec *seg,
+	int write)
+{
+	size_t offset = seg->offset;
+	char *data = seg->buffer;
+	size_t left = seg->length;
+
+	while (left > 0) {
+		size_t i = offset / TPS_PAGE_SIZE;
+		void *start = slot_addr(curr_tps, i) + offset % TPS_PAGE_SIZE;
+		size_t len = TPS_PAGE_SIZE - offset % TPS_PAGE_SIZE;
+
+		while (len < left && slot_addr(curr_tps, i + 1) ==
+			slot_addr(curr_tps, i) + TPS_PAGE_SIZE) {
+			len += TPS_PAGE_SIZE;
+			i++;
+		}
+		if (len > left) {
+			len = left;
+		}
+
+		if (write) {
+			memcpy(start, data, len);
+		} else {
+			memcpy(data, start, len);
+		}
+
+		offset += len;
+		data += len;
+		left -= len;
+	}
+}
+
+/* Gets the first and last pages spanned by the segments of iov. Returns -1 if
+they span none */
+static int iovec_span(const struct tps_iovec *iov, int iovcnt, size_t *span)
+{
+	size_t first = SIZE_MAX;
+	size_t last = 0;
+
+	for (int n = 0; n < iovcnt; n++) {
+		if (iov[n].length == 0) {
+			continue;
+		}
+		if (iov[n].offset / TPS_PAGE_SIZE < first) {
+			first = iov[n].offset / TPS_PAGE_SIZE;
+		}
+		if ((iov[n].offset + iov[n].length - 1) / TPS_PAGE_SIZE > last) {
+			last = (iov[n].offset + iov[n].length - 1) /
+				TPS_PAGE_SIZE;
+		}
+	}
+
+	span[0] = first;
+	span[1] = last;
+	return first > last ? -1 : 0;
+}
+
+/* Opens the pages first to last of a TPS with prot, in runs of contiguous
+pages */
+static int open_pages(struct tps *curr_tps, size_t first, size_t last, int prot)
+{
+	size_t run = first;
+
+	for (size_t i = first; i <= last; i++) {
+		if (i < last && slot_addr(curr_tps, i + 1) ==
+			slot_addr(curr_tps, i) + TPS_PAGE_SIZE) {
+			continue;
+		}
+
+		if (do_mprotect(slot_addr(curr_tps, run), (i - run + 1) *
+			TPS_PAGE_SIZE, prot) < 0) {
+			return -1;
+		}
+		run = i + 1;
+	}
+
+	return 0;
+}
+
+/* Copies the segments of iov between their buffers and the TPS. All the pages
+spanned by the segments are opened at once, in runs of contiguous pages, so
+that an area which was never cloned only costs two mprotect() calls whatever
+the number and size of the segments. The pages stay locked the whole time, as
+a shared page must not be closed by another thread while we copy it */
+static int access_tps(struct tps *curr_tps, const struct tps_iovec *iov,
+	int iovcnt, int write)
+{
+	size_t span[2];
+
+	if (iovec_span(iov, iovcnt, span) < 0) {
+		return 0;
+	}
+
+	size_t first = span[0];
+	size_t last = span[1];
+
+	lock_pages(curr_tps, first, last);
+
+	/* Pages left open by the protection level are copied right away */
+	if (rests_open(curr_tps, first, last, write)) {
+		if (write) {
+			begin_change(curr_tps);
+		}
+		for (int n = 0; n < iovcnt; n++) {
+			copy_segment(curr_tps, &iov[n], write);
+		}
+		if (write) {
+			end_change(curr_tps);
+		}
+		unlock_pages(curr_tps, first, last);
+		return 0;
+	}
+
+	/* Checks for copies, giving the thread a unique page for every page it
+	is about to write to that is shared */
+	if (write) {
+		begin_change(curr_tps);
+	}
+	for (int n = 0; write && n < iovcnt; n++) {
+		for (size_t i = iov[n].offset / TPS_PAGE_SIZE; iov[n].length &&
+			i <= (iov[n].offset + iov[n].length - 1) / TPS_PAGE_SIZE;
+			i++) {
+			if (unshare_page(curr_tps, i) < 0) {
+				end_change(curr_tps);
+				unlock_pages(curr_tps, first, last);
+				return -1;
+			}
+		}
+	}
+	if (write) {
+		end_change(curr_tps);
+	}
+
+	/* Only the copy itself is a change for tps_read_from(), so that a
+	preempted writer rarely holds its readers up */
+	int retval = open_pages(curr_tps, first, last, write ? PROT_WRITE :
+		PROT_READ);
+	if (retval == 0 && write) {
+		begin_change(curr_tps);
+	}
+	for (int n = 0; retval == 0 && n < iovcnt; n++) {
+		copy_segment(curr_tps, &iov[n], write);
+	}
+	if (retval == 0 && write) {
+		end_change(curr_tps);
+	}
+
+	/* Returns permission back to none, or to what tps_map() gave if the TPS
+	is mapped */
+	if (protect_pages(curr_tps, first, last) < 0) {
+		retval = -1;
+	}
+	unlock_pages(curr_tps, first, last);
+	return retval;
+}
+
+/* Reads the segments of iov from the TPS of the current thread without taking
+any lock, which is possible when no other thread can touch the pages they span.
+That is when every page is private and no clone of the TPS is being made: the
+pages are then only ever opened, closed and moved by the owner. With
+TPS_MEMFD, the clones of a TPS have their own views of the memory file, so its
+pages are all private. A mapped TPS is left to the locked path, as faults make
+its pages private without looking at readers.
+
+Must be called inside an epoch section: a cloner waits for the section to end
+before sharing any page. Returns 1 if the locked path must be taken instead */
+static int read_private(struct tps *curr_tps, const struct tps_iovec *iov,
+	int iovcnt)
+{
+	size_t span[2];
+
+	if (iovec_span(iov, iovcnt, span) < 0) {
+		return 0;
+	}
+	if (curr_tps->mapped || __atomic_load_n(&curr_tps->cloning,
+		__ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+
+	int own = 1;
+	for (size_t i = span[0]; !(tps_flags & TPS_MEMFD) && i <= span[1];
+		i++) {
+		if (__atomic_load_n(&curr_tps->pages[i]->num_refs,
+			__ATOMIC_ACQUIRE) != 1) {
+			return 1;
+		}
+		own = own && curr_tps->pages[i]->home == curr_tps;
+	}
+
+	/* Private pages left open by the protection level are writable, unless
+	they were left to us by another TPS, which decides their protection */
+	if (curr_tps->open && own) {
+		for (int n = 0; n < iovcnt; n++) {
+			copy_segment(curr_tps, &iov[n], 0);
+		}
+		return 0;
+	}
+
+	int retval = open_pages(curr_tps, span[0], span[1], PROT_READ);
+	for (int n = 0; retval == 0 && n < iovcnt; n++) {
+		copy_segment(curr_tps, &iov[n], 0);
+	}
+
+	if (protect_pages(curr_tps, span[0], span[1]) < 0) {
+		retval = -1;
+	}
+	return retval;
+}
+
+/* Whether a buffer overlaps the range of a TPS mapped for writing. Copying
+into it would fault with the TPS locked, see segv_handler() */
+static int in_range(struct tps *curr_tps, const void *buffer, size_t length)
+{
+	const char *start = curr_tps->base;
+
+	return (curr_tps->mapped & TPS_MAP_WRITE) && (const char *) buffer <
+		start + curr_tps->npages * TPS_PAGE_SIZE &&
+		(const char *) buffer + length > start;
+}
+
+/* Checks that the segments of iov fit in a TPS, and don't point inside it */
+static int check_iovec(struct tps *curr_tps, const struct tps_iovec *iov,
+	int iovcnt)
+{
+	if (iov == NULL || iovcnt < 0) {
+		return -1;
+	}
+
+	for (int n = 0; n < iovcnt; n++) {
+		if (iov[n].buffer == NULL || iov[n].offset > curr_tps->size ||
+			iov[n].length > curr_tps->size - iov[n].offset ||
+			in_range(curr_tps, iov[n].buffer, iov[n].length)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Whether the signal handler is installed, and whether it should report TPS
+protection errors. The handlers installed before ours are kept for TPS_FAULTS */
+static int segv_installed = 0;
+static int segv_report = 0;
+static struct sigaction old_segv_action;
+static struct sigaction old_bus_action;
+
+/* With TPS_FAULTS, protection errors are recorded in fault_ring by the signal
+handler, which can't take any lock nor allocate memory. A fault takes the next
+ticket of fault_head, and writes its record into the slot of that ticket. The
+slot's seq is 0 while it is being written, and the ticket plus one afterwards,
+so that readers can tell a record they copied was not overwritten meanwhile */
+struct fault_slot {
+	uint64_t seq;
+	struct tps_fault fault;
+};
+
+static struct fault_slot fault_ring[TPS_FAULT_RING];
+static uint64_t fault_head = 0;
+
+/* Gets the type of access which caused a fault. On x86-64, the kernel passes
+the error code of the page fault along, in which bit 1 is set for writes */
+static int fault_access(void *context)
+{
+#if defined(__x86_64__)
+	ucontext_t *uc = context;
+
+	return uc->uc_mcontext.gregs[REG_ERR] & 2 ? TPS_FAULT_WRITE :
+		TPS_FAULT_READ;
+#else
+	(void) context;
+	return TPS_FAULT_UNKNOWN;
+#endif
+}
+
+/* Records a fault on a TPS page, whose map entry is value. With TPS_MEMFD, the
+entry is the TPS whose range holds the page; otherwise it is the page, which
+knows the TPS it lives in, if any. Neither is locked */
+static void record_fault(void *addr, void *value, void *context)
+{
+	uint64_t ticket = __atomic_fetch_add(&fault_head, 1, __ATOMIC_RELAXED);
+	struct fault_slot *slot = &fault_ring[ticket % TPS_FAULT_RING];
+	struct tps *owner = value;
+	struct timespec ts;
+
+	if (!(tps_flags & TPS_MEMFD)) {
+		owner = ((struct mempage *) value)->home;
+	}
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	slot->fault.tid = pthread_self();
+	slot->fault.addr = addr;
+	slot->fault.owner = 0;
+	slot->fault.offset = -1;
+	if (owner != NULL && addr >= owner->base && addr < owner->base +
+		owner->npages * TPS_PAGE_SIZE) {
+		slot->fault.owner = owner->tid;
+		slot->fault.offset = addr - owner->base;
+	}
+	slot->fault.access = fault_access(context);
+	slot->fault.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	__atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the record of a ticket, unless it is being written or was
+overwritten. Returns -1 in that case */
+static int read_fault(uint64_t ticket, struct tps_fault *fault)
+{
+	struct fault_slot *slot = &fault_ring[ticket % TPS_FAULT_RING];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ticket + 1) {
+		return -1;
+	}
+	*fault = slot->fault;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == ticket + 1 ?
+		0 : -1;
+}
+
+ssize_t tps_faults(struct tps_fault *faults, size_t count)
+{
+	if (!(tps_flags & TPS_FAULTS) || faults == NULL) {
+		return -1;
+	}
+
+	uint64_t head = __atomic_load_n(&fault_head, __ATOMIC_ACQUIRE);
+	uint64_t ticket = head > count ? head - count : 0;
+	size_t copied = 0;
+
+	if (head - ticket > TPS_FAULT_RING) {
+		ticket = head - TPS_FAULT_RING;
+	}
+	for (; ticket < head; ticket++) {
+		if (read_fault(ticket, &faults[copied]) == 0) {
+			copied++;
+		}
+	}
+
+	return copied;
+}
+
+/* Appends the name and value of a field to a line being formatted, in decimal
+or in hexadecimal, without snprintf() which is not async-signal-safe */
+static size_t put_field(char *line, size_t len, const char *name,
+	uint64_t value, int hex)
+{
+	char digits[20];
+	int n = 0;
+
+	while (*name != '\0') {
+		line[len++] = *name++;
+	}
+	if (hex) {
+		line[len++] = '0';
+		line[len++] = 'x';
+	}
+	do {
+		digits[n++] = "0123456789abcdef"[value % (hex ? 16 : 10)];
+		value /= hex ? 16 : 10;
+	} while (value != 0);
+	while (n > 0) {
+		line[len++] = digits[--n];
+	}
+
+	return len;
+}
+
+int tps_fault_dump(int fd)
+{
+	static const char *access_names[] = { "unknown", "read", "write" };
+
+	if (!(tps_flags & TPS_FAULTS)) {
+		return -1;
+	}
+
+	uint64_t head = __atomic_load_n(&fault_head, __ATOMIC_ACQUIRE);
+	uint64_t ticket = head > TPS_FAULT_RING ? head - TPS_FAULT_RING : 0;
+
+	for (; ticket < head; ticket++) {
+		struct tps_fault fault;
+		char line[256];
+		size_t len = 0;
+
+		if (read_fault(ticket, &fault) < 0) {
+			continue;
+		}
+
+		len = put_field(line, len, "TPS fault tid=", fault.tid, 1);
+		len = put_field(line, len, " addr=", (uintptr_t) fault.addr, 1);
+		if (fault.offset >= 0) {
+			len = put_field(line, len, " owner=", fault.owner, 1);
+			len = put_field(line, len, " offset=", fault.offset, 0);
+		}
+		len = put_field(line, len, " time_ns=", fault.time_ns, 0);
+		for (const char *s = " access="; *s != '\0'; s++) {
+			line[len++] = *s;
+		}
+		for (const char *s = access_names[fault.access]; *s != '\0';
+			s++) {
+			line[len++] = *s;
+		}
+		line[len++] = '\n';
+
+		if (write(fd, line, len) != (ssize_t) len) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Passes a signal on to the handler installed before ours. Returns -1 if there
+is none */
+static int chain_signal(int sig, siginfo_t *si, void *context)
+{
+	struct sigaction *old = sig == SIGSEGV ? &old_segv_action :
+		&old_bus_action;
+
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, si, context);
+	} else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		old->sa_handler(sig);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* This signal handler will throw an error when private memory is accessed
+and will exit the program. Every TPS page is registered in the page map, which
+can be searched without taking any lock: the faulting thread might very well be
+holding one already.
+
+A write to a page that the current thread mapped for writing, but which is
+still shared with a clone, is not an error though: the page is made private and
+the write is restarted. The library never accesses a mapped range itself, and
+refuses buffers inside it, so the thread cannot be holding its TPS's lock in
+that case. Nothing is allocated or freed, see unshare_mapped_page(), so the
+write may as well interrupt malloc(). */
+static void segv_handler(int sig, siginfo_t *si, void *context)
+{
+	struct tps *curr_tps = curr_tps_cache;
+	void *addr = si->si_addr;
+
+	if (curr_tps != NULL && (curr_tps->mapped & TPS_MAP_WRITE) &&
+		addr >= curr_tps->base && addr < curr_tps->base +
+		curr_tps->npages * TPS_PAGE_SIZE) {
+		size_t i = (addr - curr_tps->base) / TPS_PAGE_SIZE;
+		int saved_errno = errno;
+
+		pthread_mutex_lock(&curr_tps->lock);
+		lock_pages(curr_tps, i, i);
+		int retval = unshare_mapped_page(curr_tps, i);
+		if (retval == 0) {
+			retval = do_mprotect(slot_addr(curr_tps, i),
+				TPS_PAGE_SIZE, slot_prot(curr_tps, i));
+		}
+		unlock_pages(curr_tps, i, i);
+		pthread_mutex_unlock(&curr_tps->lock);
+		errno = saved_errno;
+		if (retval == 0) {
+			return;
+		}
+	}
+
+	/* Only write() can be used from here */
+	static const char message[] = "TPS protection error!\n";
+	void *value = pagemap_get(addr);
+
+	if (value != NULL && (tps_flags & TPS_FAULTS)) {
+		record_fault(addr, value, context);
+	}
+	if (value != NULL && segv_report &&
+		write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {
+		/* Nothing else can be reported from here */
+	}
+
+	/* The handler installed before ours may recover, and read the record */
+	if ((tps_flags & TPS_FAULTS) && chain_signal(sig, si, context) == 0) {
+		return;
+	}
+	if (value != NULL && (tps_flags & TPS_FAULTS)) {
+		tps_fault_dump(STDERR_FILENO);
+	}
+
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGBUS, SIG_DFL);
+
+	raise(sig);
+}
+
+static void install_segv_handler(void)
+{
+	struct sigaction sa;
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = segv_handler;
+	sigaction(SIGBUS, &sa, &old_bus_action);
+	sigaction(SIGSEGV, &sa, &old_segv_action);
+	segv_installed = 1;
+}
+
+/* Initializes the TPS functionality by creating the table where the TPS's
+can be stored and initiallized the signal handler to maintain privacy */
+int tps_init(int flags)
+{
+	pthread_mutex_lock(&table_lock);
+	if (tps_table != NULL || (flags & (TPS_DEFERRED|TPS_GUARD_ONLY)) ==
+		(TPS_DEFERRED|TPS_GUARD_ONLY)) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	tps_table = calloc(TPS_TABLE_MIN, sizeof(struct tps *));
+
+	if (tps_table == NULL) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+	tps_buckets = TPS_TABLE_MIN;
+
+	if (pthread_key_create(&tps_key, reclaim_tps)) {
+		free(tps_table);
+		tps_table = NULL;
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	if (flags & TPS_MEMFD) {
+		memfd = memfd_create("tps", MFD_CLOEXEC);
+		if (memfd < 0) {
+			pthread_key_delete(tps_key);
+			free(tps_table);
+			tps_table = NULL;
+			pthread_mutex_unlock(&table_lock);
+			return -1;
+		}
+	}
+
+	/* Guard pages need the region, which needs the arena. The levels
+	leaving pages open for good rely on them */
+	if (flags & TPS_GUARD_ONLY) {
+		flags |= TPS_GUARD;
+	}
+	if (flags & TPS_GUARD) {
+		flags |= TPS_REGION;
+	}
+	if (flags & TPS_REGION) {
+		flags |= TPS_ARENA;
+	}
+	tps_flags = flags;
+
+	if (use_region() && arena_reserve(TPS_REGION_SIZE / TPS_PAGE_SIZE) < 0) {
+		if (memfd >= 0) {
+			close(memfd);
+			memfd = -1;
+		}
+		pthread_key_delete(tps_key);
+		free(tps_table);
+		tps_table = NULL;
+		tps_flags = 0;
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	if (flags & TPS_SEGV) {
+		segv_report = 1;
+	}
+	if (flags & (TPS_SEGV|TPS_FAULTS)) {
+		install_segv_handler();
+	}
+
+	pthread_mutex_unlock(&table_lock);
+	return 0;
+}
+
+int tps_create(void)
+{
+	return tps_create_sized(TPS_SIZE);
+}
+
+/* Allocates space for the TPS amd assign it's TID to the current thread. The
+new TPS is only seen by other threads once it is in the table, so it doesn't
+need to be locked until then.
+
+The range of a backed TPS is a mapping of the file fd, with the given mode */
+static int create_tps(size_t bytes, int fd, int backed)
+{
+	struct tps *new_tps = malloc(sizeof(struct tps));
+	if (new_tps == NULL) {
+		return -1;
+	}
+	new_tps->tid = pthread_self();
+	new_tps->mapped = 0;
+	new_tps->open = 0;
+	new_tps->cloning = 0;
+	new_tps->unclaimed = 0;
+	new_tps->spares = NULL;
+	new_tps->nspares = 0;
+	new_tps->backed = backed;
+	new_tps->seq = 0;
+	new_tps->size = bytes;
+	new_tps->npages = PAGE_ROUND(bytes) / TPS_PAGE_SIZE;
+
+	new_tps->pages = malloc(new_tps->npages * sizeof(struct mempage *));
+	if (new_tps->pages == NULL) {
+		free(new_tps);
+		return -1;
+	}
+
+	/* Creates a space in memory that the thread can later use to read and
+	write. This space is initially filled with all 0s, and protection is set
+	to not allow reading or writing by default */
+	if (backed) {
+		new_tps->base = do_mmap(NULL, new_tps->npages * TPS_PAGE_SIZE,
+			PROT_NONE, backed == TPS_BACKED_SHARED ? MAP_SHARED :
+			MAP_PRIVATE, fd, 0);
+		if (new_tps->base == MAP_FAILED) {
+			new_tps->base = NULL;
+		}
+	} else {
+		new_tps->base = map_range(new_tps, new_tps->npages);
+	}
+	if (new_tps->base == NULL) {
+		free(new_tps->pages);
+		free(new_tps);
+		return -1;
+	}
+
+	if (fill_pages(new_tps, 0, new_tps->npages) < 0) {
+		if (backed) {
+			do_munmap(new_tps->base, new_tps->npages *
+				TPS_PAGE_SIZE);
+		} else {
+			unmap_pages(new_tps->base, new_tps->npages +
+				range_guard(new_tps));
+		}
+		free(new_tps->pages);
+		free(new_tps);
+		return -1;
+	}
+
+	/* Every TPS is added to the tps table to be found later */
+	pthread_mutex_init(&new_tps->lock, NULL);
+	insert_tps(new_tps);
+	own_tps(new_tps);
+	return 0;
+}
+
+int tps_create_sized(size_t bytes)
+{
+	/* Makes sure there does not already exist a TPS for this thread */
+	if (tps_table == NULL || bytes == 0 || find_curr_tps() != NULL) {
+		return -1;
+	}
+
+	return create_tps(bytes, -1, 0);
+}
+
+/* Creates a TPS backed by the file fd, which is only needed until it is
+mapped. An empty file is given TPS_SIZE bytes when mapped shared, and can't be
+mapped privately */
+static int create_backed(int fd, int mode)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		return -1;
+	}
+	if (st.st_size == 0) {
+		if (mode == TPS_BACKED_PRIVATE || ftruncate(fd, TPS_SIZE) < 0) {
+			return -1;
+		}
+		st.st_size = TPS_SIZE;
+	}
+
+	return create_tps(st.st_size, fd, mode);
+}
+
+/* Pages of the memory file can't be mixed with the pages of another file, so
+TPS_MEMFD has no backed TPS */
+int tps_create_backed(const char *path, int mode)
+{
+	if (tps_table == NULL || path == NULL || (tps_flags & TPS_MEMFD) ||
+		(mode != TPS_BACKED_SHARED && mode != TPS_BACKED_PRIVATE) ||
+		find_curr_tps() != NULL) {
+		return -1;
+	}
+
+	int fd = open(path, mode == TPS_BACKED_SHARED ?
+		O_RDWR|O_CREAT|O_CLOEXEC : O_RDONLY|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int retval = create_backed(fd, mode);
+	close(fd);
+	return retval;
+}
+
+/* The content of the TPS is copied once into a memory file of its size, read
+like by tps_read(). The file is then sealed, so that every process importing
+it maps the same pages, which the kernel only copies when one of them writes */
+int tps_export(void)
+{
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL) {
+		return -1;
+	}
+
+	int fd = memfd_create("tps_export", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	void *data = MAP_FAILED;
+	if (fd >= 0 && ftruncate(fd, curr_tps->size) == 0) {
+		data = mmap(NULL, curr_tps->size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	}
+
+	int retval = -1;
+	if (data != MAP_FAILED) {
+		struct tps_iovec seg = { 0, curr_tps->size, data };
+
+		retval = access_tps(curr_tps, &seg, 1, 0);
+		munmap(data, curr_tps->size);
+	}
+	pthread_mutex_unlock(&curr_tps->lock);
+
+	if (retval < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|
+		F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+int tps_import(int fd)
+{
+	if (tps_table == NULL || fd < 0 || (tps_flags & TPS_MEMFD) ||
+		find_curr_tps() != NULL) {
+		return -1;
+	}
+
+	return create_backed(fd, TPS_BACKED_PRIVATE);
+}
+
+/* Drops every page of a TPS, which must all be locked, and unmaps what is left
+of its range */
+static void drop_pages(struct tps *curr_tps)
+{
+	for (size_t i = 0; i < curr_tps->npages; i++) {
+		release_page(curr_tps, i);
+	}
+	if (curr_tps->base != NULL) {
+		unmap_range(curr_tps, 0, curr_tps->npages);
+	}
+}
+
+static void destroy_tps(void *arg)
+{
+	struct tps *old_tps = arg;
+
+	pthread_mutex_destroy(&old_tps->lock);
+	free(old_tps->pages);
+	free(old_tps);
+}
+
+/* Destroys a TPS which is not in the table, such as a snapshot */
+static void discard_tps(struct tps *old_tps)
+{
+	pthread_mutex_lock(&old_tps->lock);
+	lock_pages(old_tps, 0, old_tps->npages - 1);
+	drop_pages(old_tps);
+	pthread_mutex_unlock(&old_tps->lock);
+	epoch_retire(old_tps, destroy_tps);
+}
+
+/* Frees all memory associated with the TPS. Pages are only unmapped if there
+are no other threads referencing them as their own. The TPS itself is retired
+rather than freed, like the pages.
+
+The TPS is removed from the table first, so that no other thread can find it
+anymore; a thread which found it before is done cloning it once we get its
+lock and it isn't counted in cloning anymore */
+static void destroy_owned(struct tps *curr_tps)
+{
+	remove_tps(curr_tps);
+	destroy_unlinked(curr_tps);
+}
+
+static void destroy_unlinked(struct tps *curr_tps)
+{
+	pthread_mutex_lock(&curr_tps->lock);
+	while (__atomic_load_n(&curr_tps->cloning, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&curr_tps->lock);
+		sched_yield();
+		pthread_mutex_lock(&curr_tps->lock);
+	}
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	begin_change(curr_tps);
+
+	/* Pages outliving us must not stay accessible */
+	if (curr_tps->mapped || curr_tps->open) {
+		curr_tps->mapped = 0;
+		curr_tps->open = 0;
+		free_spares(curr_tps);
+		protect_pages(curr_tps, 0, curr_tps->npages - 1);
+	}
+
+	/* The pages of a backed TPS map its file: the TPS's sharing them get a
+	copy instead of keeping them */
+	for (size_t i = 0; curr_tps->backed && i < curr_tps->npages; i++) {
+		unshare_page(curr_tps, i);
+	}
+	drop_pages(curr_tps);
+
+	pthread_mutex_unlock(&curr_tps->lock);
+	epoch_retire(curr_tps, destroy_tps);
+}
+
+int tps_destroy(void)
+{
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL) {
+		return -1;
+	}
+
+	destroy_owned(curr_tps);
+	own_tps(NULL);
+	flush_exits();
+	return 0;
+}
+
+/* Destructor of tps_key, called when a thread exits with a TPS. The TPS is
+destroyed as if the thread had called tps_destroy(), except that its range is
+unmapped along with the ranges of other exiting threads */
+static void reclaim_tps(void *arg)
+{
+	reclaiming = 1;
+	destroy_owned(arg);
+	curr_tps_cache = NULL;
+	reclaiming = 0;
+}
+
+/* Moves a TPS's range to a bigger one holding npages pages. mremap() moves
+the pages without copying them, in place if there is room after the range. If
+the range has been split in several mappings, its pages are moved one by one.
+With TPS_REGION, they are always moved one by one to a range of the arena, so
+that they stay in the region, and the holes they leave are filled when the old
+range is given back. The pages of the TPS must be locked, as clones may be
+reading them */
+static int moves_with_range(void *addr)
+{
+	return (tps_flags & TPS_MEMFD) || pagemap_get(addr) != NULL;
+}
+
+static int grow_range(struct tps *curr_tps, size_t npages)
+{
+	size_t old_len = curr_tps->npages * TPS_PAGE_SIZE;
+	size_t guard = range_guard(curr_tps);
+	void *old_base = curr_tps->base;
+	void *new_base = MAP_FAILED;
+
+	/* A range made of views of the memory file can't be extended, as the
+	file pages following it belong to other TPS's */
+	if (!(tps_flags & TPS_MEMFD) && !use_region()) {
+		new_base = do_mremap(old_base, old_len, npages * TPS_PAGE_SIZE,
+			MREMAP_MAYMOVE, NULL);
+	}
+
+	if (new_base == MAP_FAILED) {
+		new_base = map_pages(npages + guard);
+		if (new_base == NULL) {
+			return -1;
+		}
+
+		for (size_t i = 0; i < curr_tps->npages; i++) {
+			void *addr = old_base + i * TPS_PAGE_SIZE;
+
+			if (moves_with_range(addr) &&
+				do_mremap(addr, TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+				MREMAP_MAYMOVE|MREMAP_FIXED, new_base +
+				i * TPS_PAGE_SIZE) == MAP_FAILED) {
+				/* Puts back the pages we already moved */
+				while (i-- > 0) {
+					if (moves_with_range(old_base + i *
+						TPS_PAGE_SIZE)) {
+						do_mremap(new_base + i *
+						TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+						TPS_PAGE_SIZE, MREMAP_MAYMOVE|
+						MREMAP_FIXED, old_base + i *
+						TPS_PAGE_SIZE);
+					}
+				}
+				if (use_region()) {
+					unmap_pages(new_base, npages + guard);
+				} else {
+					do_munmap(new_base, npages *
+						TPS_PAGE_SIZE);
+					account_pages(npages, 0);
+				}
+				return -1;
+			}
+		}
+		if (!use_region()) {
+			do_munmap(old_base, old_len);
+			account_pages(curr_tps->npages, 0);
+		}
+	} else {
+		/* The kernel took the range away from the arena */
+		account_pages(curr_tps->npages, npages);
+	}
+
+	/* Every page that moved is now found at its new address, which the
+	TPS's cloning us will see through the shared mempage */
+	if (new_base != old_base && (tps_flags & TPS_MEMFD)) {
+		register_slots(curr_tps, 0, curr_tps->npages, NULL);
+		curr_tps->base = new_base;
+		return register_slots(curr_tps, 0, curr_tps->npages, curr_tps);
+	}
+
+	if (new_base != old_base) {
+		for (size_t i = 0; i < curr_tps->npages; i++) {
+			struct mempage *page = pagemap_get(old_base +
+				i * TPS_PAGE_SIZE);
+
+			if (page != NULL) {
+				pagemap_set(old_base + i * TPS_PAGE_SIZE, NULL);
+				page->memptr = new_base + i * TPS_PAGE_SIZE;
+				pagemap_set(page->memptr, page);
+			}
+		}
+	}
+
+	/* The old range of the region is given back once nothing refers to it
+	anymore, as it can be handed out again right away */
+	if (use_region()) {
+		unmap_pages(old_base, curr_tps->npages + guard);
+	}
+	curr_tps->base = new_base;
+	return 0;
+}
+
+/* Changes the size of the current thread's TPS. Existing pages are kept where
+they are or moved by the kernel, never copied */
+/* Bytes past the end of a shrunk TPS are cleared so that they read as zeros if
+it grows again */
+static int clear_tail(struct tps *curr_tps, size_t bytes)
+{
+	size_t npages = PAGE_ROUND(bytes) / TPS_PAGE_SIZE;
+
+	if (bytes < curr_tps->size && bytes < npages * TPS_PAGE_SIZE) {
+		size_t len = npages * TPS_PAGE_SIZE - bytes;
+		char *zeros = calloc(1, len);
+
+		struct tps_iovec seg = { bytes, len, zeros };
+
+		if (zeros == NULL || access_tps(curr_tps, &seg, 1, 1) < 0) {
+			free(zeros);
+			return -1;
+		}
+		free(zeros);
+	}
+
+	return 0;
+}
+
+/* Makes slot i of a TPS's range ready to become its guard page once the TPS
+is shrunk to i pages. A page living there which clones still refer to would
+outlive the TPS in that slot, so it is moved to a page of its own first, and
+the hole it leaves is filled */
+static int make_guard(struct tps *curr_tps, size_t i)
+{
+	void *slot = curr_tps->base + i * TPS_PAGE_SIZE;
+	struct mempage *page = curr_tps->pages[i];
+
+	pthread_mutex_lock(&page->lock);
+	if (page->memptr != slot || page->num_refs == 1) {
+		pthread_mutex_unlock(&page->lock);
+		return 0;
+	}
+
+	void *addr = map_pages(1);
+	if (addr == NULL || do_mremap(slot, TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+		MREMAP_MAYMOVE|MREMAP_FIXED, addr) == MAP_FAILED) {
+		pthread_mutex_unlock(&page->lock);
+		if (addr != NULL) {
+			unmap_pages(addr, 1);
+		}
+		return -1;
+	}
+
+	pagemap_set(slot, NULL);
+	page->memptr = addr;
+	page->home = NULL;
+	pagemap_set(addr, page);
+	pthread_mutex_unlock(&page->lock);
+
+	pthread_mutex_lock(&pool_lock);
+	int retval = arena_refill(slot, 1);
+	pthread_mutex_unlock(&pool_lock);
+	return retval;
+}
+
+/* Resizes a TPS, which is locked and not mapped. A grown pages array is
+retired rather than freed, as tps_read_from() may be reading the old one.
+With TPS_GUARD, the first slot past the end of a shrunk TPS becomes its guard
+page, and its content is dropped */
+static int resize_tps(struct tps *curr_tps, size_t bytes)
+{
+	size_t npages = PAGE_ROUND(bytes) / TPS_PAGE_SIZE;
+	size_t guard = curr_tps->base != NULL ? range_guard(curr_tps) : 0;
+
+	if (npages < curr_tps->npages) {
+		if (guard && make_guard(curr_tps, npages) < 0) {
+			return -1;
+		}
+		lock_pages(curr_tps, npages, curr_tps->npages - 1);
+		for (size_t i = npages; i < curr_tps->npages; i++) {
+			release_page(curr_tps, i);
+		}
+		if (curr_tps->base != NULL) {
+			unmap_range(curr_tps, npages + guard,
+				curr_tps->npages);
+		}
+		if (guard) {
+			madvise(curr_tps->base + npages * TPS_PAGE_SIZE,
+				TPS_PAGE_SIZE, MADV_DONTNEED);
+		}
+		curr_tps->npages = npages;
+	} else if (npages > curr_tps->npages) {
+		struct mempage **pages = malloc(npages *
+			sizeof(struct mempage *));
+		if (pages == NULL) {
+			return -1;
+		}
+		memcpy(pages, curr_tps->pages, curr_tps->npages *
+			sizeof(struct mempage *));
+		epoch_retire(curr_tps->pages, free);
+		curr_tps->pages = pages;
+
+		if (curr_tps->base == NULL) {
+			curr_tps->base = map_range(curr_tps, npages);
+		} else {
+			lock_pages(curr_tps, 0, curr_tps->npages - 1);
+			int retval = grow_range(curr_tps, npages);
+			unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+			if (retval < 0) {
+				return -1;
+			}
+		}
+
+		if (curr_tps->base == NULL ||
+			fill_pages(curr_tps, curr_tps->npages, npages) < 0) {
+			return -1;
+		}
+		curr_tps->npages = npages;
+	}
+
+	curr_tps->size = bytes;
+	return 0;
+}
+
+int tps_resize(size_t bytes)
+{
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL || curr_tps->mapped || curr_tps->backed ||
+		bytes == 0) {
+		if (curr_tps != NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+		}
+		return -1;
+	}
+
+	/* The new pages are opened along with the others on the next access */
+	close_tps(curr_tps);
+	int retval = clear_tail(curr_tps, bytes);
+	if (retval == 0) {
+		begin_change(curr_tps);
+		retval = resize_tps(curr_tps, bytes);
+		end_change(curr_tps);
+	}
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+/* Hands out the current thread's range after gathering all its pages in it.
+The pages are then opened according to mode, except that pages shared with
+other TPS's stay read-only until they are written to */
+void *tps_map(int mode)
+{
+	/* Copy-on-write is resolved by the signal handler, which must be
+	there even if tps_init() was asked not to report errors. The table lock
+	has to be taken before our own */
+	if (mode == TPS_MAP_WRITE || mode == (TPS_MAP_READ|TPS_MAP_WRITE)) {
+		pthread_mutex_lock(&table_lock);
+		if (!segv_installed) {
+			install_segv_handler();
+		}
+		pthread_mutex_unlock(&table_lock);
+	}
+
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL || curr_tps->mapped ||
+		(mode & ~(TPS_MAP_READ|TPS_MAP_WRITE)) || mode == 0) {
+		if (curr_tps != NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+		}
+		return NULL;
+	}
+
+	if (curr_tps->base == NULL) {
+		curr_tps->base = map_range(curr_tps, curr_tps->npages);
+		if (curr_tps->base == NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+			return NULL;
+		}
+	}
+
+	/* Gathering the pages moves them */
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	begin_change(curr_tps);
+	for (size_t i = 0; i < curr_tps->npages; i++) {
+		if (localize_page(curr_tps, i) < 0) {
+			end_change(curr_tps);
+			unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+			pthread_mutex_unlock(&curr_tps->lock);
+			return NULL;
+		}
+	}
+	end_change(curr_tps);
+
+	curr_tps->mapped = mode | TPS_MAP_READ;
+	if (reserve_spares(curr_tps) < 0 ||
+		protect_pages(curr_tps, 0, curr_tps->npages - 1) < 0) {
+		curr_tps->mapped = 0;
+		free_spares(curr_tps);
+		protect_pages(curr_tps, 0, curr_tps->npages - 1);
+		unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+		pthread_mutex_unlock(&curr_tps->lock);
+		return NULL;
+	}
+
+	unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return curr_tps->base;
+}
+
+/* Closes the current thread's range again */
+int tps_unmap(void)
+{
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL || curr_tps->mapped == 0) {
+		if (curr_tps != NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+		}
+		return -1;
+	}
+
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	curr_tps->mapped = 0;
+	free_spares(curr_tps);
+	int retval = protect_pages(curr_tps, 0, curr_tps->npages - 1);
+	unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+/* Only the owner opens its pages, so they can be found closed without taking
+any lock, which keeps the call cheap for sem_down() */
+void tps_settle(void)
+{
+	struct tps *curr_tps = curr_tps_cache;
+
+	if (curr_tps == NULL || curr_tps->open == 0 ||
+		protection_level() != TPS_DEFERRED) {
+		return;
+	}
+
+	pthread_mutex_lock(&curr_tps->lock);
+	close_tps(curr_tps);
+	pthread_mutex_unlock(&curr_tps->lock);
+}
+
+/* The range of a backed TPS never moves, so msync() can flush it as a whole,
+whatever the protection of its pages */
+int tps_sync(void)
+{
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL || curr_tps->backed != TPS_BACKED_SHARED) {
+		if (curr_tps != NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+		}
+		return -1;
+	}
+
+	int retval = msync(curr_tps->base, curr_tps->npages * TPS_PAGE_SIZE,
+		MS_SYNC);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval < 0 ? -1 : 0;
+}
+
+/* Gets the size of the current thread's TPS. Only the current thread changes
+it, so there is nothing to lock */
+ssize_t tps_size(void)
+{
+	struct tps *curr_tps = find_curr_tps();
+
+	return curr_tps == NULL ? -1 : (ssize_t) curr_tps->size;
+}
+
+int tps_read(size_t offset, size_t length, void *buffer)
+{
+	struct tps_iovec seg = { offset, length, buffer };
+
+	return tps_readv(&seg, 1);
+}
+
+int tps_write(size_t offset, size_t length, void *buffer)
+{
+	struct tps_iovec seg = { offset, length, buffer };
+
+	return tps_writev(&seg, 1);
+}
+
+/* Reads without any lock when the pages are private, see read_private(). Only
+the owner changes the size, so the segments can be checked beforehand */
+static int read_segments(const struct tps_iovec *iov, int iovcnt)
+{
+	/* Finds the right tps to read from */
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL) {
+		return -1;
+	}
+
+	/* testing to make sure there isn't an overflow */
+	int retval = check_iovec(curr_tps, iov, iovcnt);
+	if (retval < 0) {
+		return -1;
+	}
+
+	/* The protection level opens the pages once, for all the reads to come */
+	if (curr_tps->open == 0 && protection_level() != TPS_STRICT) {
+		pthread_mutex_lock(&curr_tps->lock);
+		retval = open_tps(curr_tps);
+		pthread_mutex_unlock(&curr_tps->lock);
+		if (retval < 0) {
+			return -1;
+		}
+	}
+
+	if (epoch_enter() == 0) {
+		retval = read_private(curr_tps, iov, iovcnt);
+		epoch_exit();
+		if (retval != 1) {
+			return retval;
+		}
+	}
+
+	pthread_mutex_lock(&curr_tps->lock);
+	retval = access_tps(curr_tps, iov, iovcnt, 0);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+/* Pages left open by the protection level must stay so, the TPS is locked
+without lock_curr_tps() */
+static int write_segments(const struct tps_iovec *iov, int iovcnt)
+{
+	/* Finds the right tps to write too */
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&curr_tps->lock);
+
+	/* checking for overflow */
+	int retval = check_iovec(curr_tps, iov, iovcnt);
+	if (retval == 0) {
+		retval = open_tps(curr_tps);
+	}
+	if (retval == 0) {
+		retval = access_tps(curr_tps, iov, iovcnt, 1);
+	}
+
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+/* The latency of every call is counted, whether it succeeds or not */
+int tps_readv(const struct tps_iovec *iov, int iovcnt)
+{
+	struct timespec start;
+
+	start_latency(&start);
+	int retval = read_segments(iov, iovcnt);
+	count_latency(LATENCY_READ, &start);
+	return retval;
+}
+
+int tps_writev(const struct tps_iovec *iov, int iovcnt)
+{
+	struct timespec start;
+
+	start_latency(&start);
+	int retval = write_segments(iov, iovcnt);
+	count_latency(LATENCY_WRITE, &start);
+	return retval;
+}
+
+/* Atomic operations on a word of a TPS. With ATOMIC_CAS, old holds the
+expected value on entry */
+enum { ATOMIC_ADD, ATOMIC_OR, ATOMIC_AND, ATOMIC_SWAP, ATOMIC_CAS };
+
+/* Applies op to a 4 or 8-byte word, storing the value it held into old.
+Returns 1 if op is ATOMIC_CAS and the swap happened, 0 otherwise */
+static int apply_op(void *word, size_t width, int op, uint64_t value,
+	uint64_t *old)
+{
+	int swapped = 0;
+
+	if (width == 4) {
+		uint32_t *word32 = word;
+		uint32_t expected = *old;
+
+		switch (op) {
+		case ATOMIC_ADD:
+			*old = __atomic_fetch_add(word32, value,
+				__ATOMIC_SEQ_CST);
+			break;
+		case ATOMIC_OR:
+			*old = __atomic_fetch_or(word32, value, __ATOMIC_SEQ_CST);
+			break;
+		case ATOMIC_AND:
+			*old = __atomic_fetch_and(word32, value,
+				__ATOMIC_SEQ_CST);
+			break;
+		case ATOMIC_SWAP:
+			*old = __atomic_exchange_n(word32, value,
+				__ATOMIC_SEQ_CST);
+			break;
+		default:
+			swapped = __atomic_compare_exchange_n(word32, &expected,
+				value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			*old = expected;
+		}
+		return swapped;
+	}
+
+	uint64_t *word64 = word;
+	uint64_t expected = *old;
+
+	switch (op) {
+	case ATOMIC_ADD:
+		*old = __atomic_fetch_add(word64, value, __ATOMIC_SEQ_CST);
+		break;
+	case ATOMIC_OR:
+		*old = __atomic_fetch_or(word64, value, __ATOMIC_SEQ_CST);
+		break;
+	case ATOMIC_AND:
+		*old = __atomic_fetch_and(word64, value, __ATOMIC_SEQ_CST);
+		break;
+	case ATOMIC_SWAP:
+		*old = __atomic_exchange_n(word64, value, __ATOMIC_SEQ_CST);
+		break;
+	default:
+		swapped = __atomic_compare_exchange_n(word64, &expected, value,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		*old = expected;
+	}
+	return swapped;
+}
+
+/* Applies op to the word at offset of the TPS of the current thread, in place.
+An aligned word never crosses a page, so only its page is locked, made private
+if it is shared, and opened for the operation. A page the thread has mapped for
+writing, or that the protection level left open, is already open */
+static int atomic_tps(int op, size_t offset, size_t width, uint64_t value,
+	uint64_t *old)
+{
+	if ((width != 4 && width != 8) || offset % width != 0) {
+		return -1;
+	}
+
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&curr_tps->lock);
+	if (offset > curr_tps->size || width > curr_tps->size - offset ||
+		open_tps(curr_tps) < 0) {
+		pthread_mutex_unlock(&curr_tps->lock);
+		return -1;
+	}
+
+	size_t i = offset / TPS_PAGE_SIZE;
+	int retval = 0;
+
+	/* A page found writable is private already. Otherwise it is opened even
+	if unsharing gave it a writable resting protection, as with TPS_MEMFD
+	the protection is only set back by protect_pages() */
+	lock_pages(curr_tps, i, i);
+	int opened = !(slot_prot(curr_tps, i) & PROT_WRITE);
+	begin_change(curr_tps);
+	retval = unshare_page(curr_tps, i);
+	end_change(curr_tps);
+	if (retval < 0) {
+		unlock_pages(curr_tps, i, i);
+		pthread_mutex_unlock(&curr_tps->lock);
+		return -1;
+	}
+
+	if (opened && do_mprotect(slot_addr(curr_tps, i), TPS_PAGE_SIZE,
+		PROT_READ|PROT_WRITE) < 0) {
+		retval = -1;
+	}
+	if (retval == 0) {
+		begin_change(curr_tps);
+		retval = apply_op(slot_addr(curr_tps, i) + offset %
+			TPS_PAGE_SIZE, width, op, value, old);
+		end_change(curr_tps);
+	}
+	if (opened && protect_pages(curr_tps, i, i) < 0) {
+		retval = -1;
+	}
+
+	unlock_pages(curr_tps, i, i);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+int tps_fetch_add(size_t offset, size_t width, uint64_t value, uint64_t *old)
+{
+	uint64_t found;
+
+	if (atomic_tps(ATOMIC_ADD, offset, width, value, &found) < 0) {
+		return -1;
+	}
+	if (old != NULL) {
+		*old = found;
+	}
+	return 0;
+}
+
+int tps_fetch_or(size_t offset, size_t width, uint64_t value, uint64_t *old)
+{
+	uint64_t found;
+
+	if (atomic_tps(ATOMIC_OR, offset, width, value, &found) < 0) {
+		return -1;
+	}
+	if (old != NULL) {
+		*old = found;
+	}
+	return 0;
+}
+
+int tps_fetch_and(size_t offset, size_t width, uint64_t value, uint64_t *old)
+{
+	uint64_t found;
+
+	if (atomic_tps(ATOMIC_AND, offset, width, value, &found) < 0) {
+		return -1;
+	}
+	if (old != NULL) {
+		*old = found;
+	}
+	return 0;
+}
+
+int tps_swap(size_t offset, size_t width, uint64_t value, uint64_t *old)
+{
+	uint64_t found;
+
+	if (atomic_tps(ATOMIC_SWAP, offset, width, value, &found) < 0) {
+		return -1;
+	}
+	if (old != NULL) {
+		*old = found;
+	}
+	return 0;
+}
+
+int tps_cas(size_t offset, size_t width, uint64_t *expected, uint64_t desired)
+{
+	if (expected == NULL) {
+		return -1;
+	}
+
+	return atomic_tps(ATOMIC_CAS, offset, width, desired, expected);
+}
+
+/* Sizes of the slots reserved by tps_key_create(), indexed by their key, which
+is their offset: looking a key up takes a single load, and tells its size and
+thus its bounds. A size is published before its key is returned, and never
+changes afterwards. key_lock protects key_top, the lowest offset reserved so
+far, the slots being carved downwards from the end of the first page */
+static uint16_t key_sizes[TPS_SIZE];
+static size_t key_top = TPS_SIZE;
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ssize_t tps_key_create(size_t size, size_t align)
+{
+	if (size == 0 || align == 0 || (align & (align - 1)) ||
+		align > TPS_PAGE_SIZE) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&key_lock);
+	if (size > key_top) {
+		pthread_mutex_unlock(&key_lock);
+		return -1;
+	}
+	size_t key = (key_top - size) & ~(align - 1);
+	key_top = key;
+	__atomic_store_n(&key_sizes[key], size, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&key_lock);
+	return key;
+}
+
+/* Gets the size of the slot of key, or 0 if it is not a key */
+static size_t key_size(size_t key)
+{
+	return key < TPS_SIZE ? __atomic_load_n(&key_sizes[key],
+		__ATOMIC_ACQUIRE) : 0;
+}
+
+/* Whether the slot of key is a word, which the word paths access without
+going through the segments of tps_read() and tps_write() */
+static int key_word(size_t key, size_t size)
+{
+	return (size == 4 || size == 8) && key % size == 0;
+}
+
+static uint64_t load_word(void *word, size_t width)
+{
+	if (width == 4) {
+		return __atomic_load_n((uint32_t *) word, __ATOMIC_RELAXED);
+	}
+
+	return __atomic_load_n((uint64_t *) word, __ATOMIC_RELAXED);
+}
+
+/* Reads the word of width bytes at offset of the TPS of the current thread,
+which never crosses a page. Like read_private(), a private page is read without
+any lock, and the page is only opened if the protection level didn't leave it
+open */
+static int get_word(size_t offset, size_t width, uint64_t *value)
+{
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL || offset > curr_tps->size ||
+		width > curr_tps->size - offset) {
+		return -1;
+	}
+
+	if (curr_tps->open == 0 && protection_level() != TPS_STRICT) {
+		pthread_mutex_lock(&curr_tps->lock);
+		int retval = open_tps(curr_tps);
+		pthread_mutex_unlock(&curr_tps->lock);
+		if (retval < 0) {
+			return -1;
+		}
+	}
+
+	size_t i = offset / TPS_PAGE_SIZE;
+	int retval = 1;
+
+	if (epoch_enter() == 0) {
+		if (!curr_tps->mapped && !__atomic_load_n(&curr_tps->cloning,
+			__ATOMIC_ACQUIRE) && ((tps_flags & TPS_MEMFD) ||
+			__atomic_load_n(&curr_tps->pages[i]->num_refs,
+			__ATOMIC_ACQUIRE) == 1)) {
+			int opened = curr_tps->open == 0 ||
+				curr_tps->pages[i]->home != curr_tps;
+
+			retval = opened ? open_pages(curr_tps, i, i,
+				PROT_READ) : 0;
+			if (retval == 0) {
+				*value = load_word(slot_addr(curr_tps, i) +
+					offset % TPS_PAGE_SIZE, width);
+			}
+			if (opened && protect_pages(curr_tps, i, i) < 0) {
+				retval = -1;
+			}
+		}
+		epoch_exit();
+		if (retval != 1) {
+			return retval;
+		}
+	}
+
+	pthread_mutex_lock(&curr_tps->lock);
+	lock_pages(curr_tps, i, i);
+	int opened = !(slot_prot(curr_tps, i) & PROT_READ);
+
+	retval = opened ? open_pages(curr_tps, i, i, PROT_READ) : 0;
+	if (retval == 0) {
+		*value = load_word(slot_addr(curr_tps, i) + offset %
+			TPS_PAGE_SIZE, width);
+	}
+	if (opened && protect_pages(curr_tps, i, i) < 0) {
+		retval = -1;
+	}
+	unlock_pages(curr_tps, i, i);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+int tps_get(size_t key, void *buffer)
+{
+	size_t size = key_size(key);
+	uint64_t value;
+
+	if (size == 0 || buffer == NULL) {
+		return -1;
+	}
+	if (!key_word(key, size)) {
+		return tps_read(key, size, buffer);
+	}
+
+	if (get_word(key, size, &value) < 0) {
+		return -1;
+	}
+	if (size == 4) {
+		uint32_t value32 = value;
+
+		memcpy(buffer, &value32, sizeof(value32));
+	} else {
+		memcpy(buffer, &value, sizeof(value));
+	}
+	return 0;
+}
+
+/* A word is written as an atomic swap, which only locks and opens its page */
+int tps_set(size_t key, void *buffer)
+{
+	size_t size = key_size(key);
+	uint64_t value, old;
+
+	if (size == 0 || buffer == NULL) {
+		return -1;
+	}
+	if (!key_word(key, size)) {
+		return tps_write(key, size, buffer);
+	}
+
+	if (size == 4) {
+		uint32_t value32;
+
+		memcpy(&value32, buffer, sizeof(value32));
+		value = value32;
+	} else {
+		memcpy(&value, buffer, sizeof(value));
+	}
+	return atomic_tps(ATOMIC_SWAP, key, size, value, &old);
+}
+
+int tps_get64(size_t key, uint64_t *value)
+{
+	if (value == NULL || key_size(key) != 8 || key % 8 != 0) {
+		return -1;
+	}
+
+	return get_word(key, 8, value);
+}
+
+int tps_set64(size_t key, uint64_t value)
+{
+	uint64_t old;
+
+	if (key_size(key) != 8 || key % 8 != 0) {
+		return -1;
+	}
+
+	return atomic_tps(ATOMIC_SWAP, key, 8, value, &old);
+}
+
+/* tps_read_from() can't open the pages of other threads, as that would race
+with their owner, who closes them behind us. With TPS_MEMFD, the pages still in
+the memory file are read from the file. The others are read through
+/proc/self/mem, which ignores their protection only if the kernel lets it force
+its way in (see proc_mem.force_override). The file is opened on first use, and
+left closed if a page with no access can't be read through it */
+static pthread_once_t self_mem_once = PTHREAD_ONCE_INIT;
+static int self_mem = -1;
+
+static void open_self_mem(void)
+{
+	char byte;
+
+	void *probe = mmap(NULL, TPS_PAGE_SIZE, PROT_NONE, MAP_ANON|MAP_PRIVATE,
+		-1, 0);
+	if (probe == MAP_FAILED) {
+		return;
+	}
+
+	int fd = open("/proc/self/mem", O_RDONLY|O_CLOEXEC);
+	if (fd >= 0 && pread(fd, &byte, 1, (off_t) (uintptr_t) probe) != 1) {
+		close(fd);
+		fd = -1;
+	}
+	munmap(probe, TPS_PAGE_SIZE);
+	self_mem = fd;
+}
+
+/* Finds where page i of a TPS read by another thread is read from, as an
+offset in file fd, which is -1 if the page can't be read. Returns 1 if the TPS
+is changing */
+static int peek_page(struct mempage **pages, void *base, size_t i, int *fd,
+	off_t *off)
+{
+	struct mempage *page = __atomic_load_n(&pages[i], __ATOMIC_RELAXED);
+
+	if (tps_flags & TPS_MEMFD) {
+		*fd = page == NULL ? self_mem : memfd;
+		*off = page == NULL ? (off_t) (uintptr_t) (base + i *
+			TPS_PAGE_SIZE) : page->foff;
+		return 0;
+	}
+
+	void *memptr = page == NULL ? NULL : __atomic_load_n(&page->memptr,
+		__ATOMIC_RELAXED);
+	*fd = self_mem;
+	*off = (off_t) (uintptr_t) memptr;
+	return memptr == NULL;
+}
+
+/* Checks that page i of a TPS is still read from offset off of file fd */
+static int same_page(struct mempage **pages, void *base, size_t i, int fd,
+	off_t off)
+{
+	int page_fd;
+	off_t page_off;
+
+	return peek_page(pages, base, i, &page_fd, &page_off) == 0 &&
+		page_fd == fd && page_off == off;
+}
+
+/* Copies length bytes at offset of a TPS which belongs to another thread,
+without taking any lock. Must be called inside an epoch section, so that
+neither the TPS, its pages array nor its mempages are freed meanwhile.
+
+The copy is thrown away if seq was odd or changed meanwhile. A shared page
+can also be moved away by another TPS it lives in, which keeps its address
+and writes to it (see unshare_page()) without changing our seq, so every run
+of pages is checked to still be where it was read from. A mapped TPS is
+changed through its range without the owner telling us, so it is simply read
+from there. Returns 1 if the read must start over, and -2 if a page can't be
+read */
+static int read_from(struct tps *curr_tps, size_t offset, size_t length,
+	char *buffer)
+{
+	unsigned int seq = __atomic_load_n(&curr_tps->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+		return 1;
+	}
+
+	size_t size = __atomic_load_n(&curr_tps->size, __ATOMIC_RELAXED);
+	struct mempage **pages = __atomic_load_n(&curr_tps->pages,
+		__ATOMIC_RELAXED);
+	void *base = __atomic_load_n(&curr_tps->base, __ATOMIC_RELAXED);
+	int mapped = __atomic_load_n(&curr_tps->mapped, __ATOMIC_RELAXED);
+
+	/* What was loaded must belong together before it is used */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&curr_tps->seq, __ATOMIC_RELAXED) != seq) {
+		return 1;
+	}
+	if (offset > size || length > size - offset) {
+		return -1;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	if (mapped) {
+		if (self_mem < 0) {
+			return -2;
+		}
+		return pread(self_mem, buffer, length, (off_t) (uintptr_t)
+			(base + offset)) == (ssize_t) length ? 0 : -1;
+	}
+
+	while (length > 0) {
+		size_t i = offset / TPS_PAGE_SIZE;
+		size_t first = i;
+		size_t len = TPS_PAGE_SIZE - offset % TPS_PAGE_SIZE;
+		int fd;
+		off_t start;
+
+		if (peek_page(pages, base, i, &fd, &start)) {
+			return 1;
+		}
+		while (len < length && same_page(pages, base, i + 1, fd,
+			start + (i + 1 - first) * TPS_PAGE_SIZE)) {
+			len += TPS_PAGE_SIZE;
+			i++;
+		}
+		if (len > length) {
+			len = length;
+		}
+
+		/* The page may only be unreadable because it is changing */
+		ssize_t count = fd < 0 ? -1 : pread(fd, buffer, len, start +
+			offset % TPS_PAGE_SIZE);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		for (size_t k = first; k <= i; k++) {
+			if (!same_page(pages, base, k, fd, start + (k - first) *
+				TPS_PAGE_SIZE)) {
+				return 1;
+			}
+		}
+		if (fd < 0) {
+			return __atomic_load_n(&curr_tps->seq,
+				__ATOMIC_RELAXED) != seq ? 1 : -2;
+		}
+		if (count != (ssize_t) len) {
+			return __atomic_load_n(&curr_tps->seq,
+				__ATOMIC_RELAXED) != seq ? 1 : -1;
+		}
+
+		offset += len;
+		buffer += len;
+		length -= len;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&curr_tps->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* The TPS is looked up again every time the read starts over, as it may have
+been destroyed meanwhile. The epoch section is left in between, so that the
+threads waiting for readers to be done, such as cloners, are not held up. For
+the same reason, the table lock is never waited for inside the section: a
+thread holding it may itself be waiting for a TPS lock held by a cloner, which
+waits for us */
+int tps_read_from(pthread_t tid, size_t offset, size_t length, void *buffer)
+{
+	if (tps_table == NULL || buffer == NULL) {
+		return -1;
+	}
+
+	pthread_once(&self_mem_once, open_self_mem);
+
+	for (;;) {
+		if (epoch_enter() < 0) {
+			return -1;
+		}
+
+		if (pthread_mutex_trylock(&table_lock)) {
+			epoch_exit();
+			sched_yield();
+			continue;
+		}
+		struct tps *curr_tps = find_tps(tid);
+		pthread_mutex_unlock(&table_lock);
+
+		int retval = curr_tps == NULL ? -1 : read_from(curr_tps, offset,
+			length, buffer);
+		epoch_exit();
+		if (retval != 1) {
+			return retval;
+		}
+		sched_yield();
+	}
+}
+
+/* Gives a clone its range with TPS_MEMFD, made of MAP_PRIVATE views of the
+file pages of the cloned TPS, whose pages must be locked */
+static int clone_file_pages(struct tps *new_tps, struct tps *cpy_tps)
+{
+	size_t len = new_tps->npages * TPS_PAGE_SIZE;
+
+	new_tps->base = map_pages(new_tps->npages);
+	if (new_tps->base == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < new_tps->npages; i++) {
+		if (share_file_page(cpy_tps, i) < 0) {
+			do_munmap(new_tps->base, len);
+			return -1;
+		}
+		new_tps->pages[i] = cpy_tps->pages[i];
+	}
+
+	/* Maps runs of consecutive file pages at once */
+	size_t run = 0;
+	for (size_t i = 0; i < new_tps->npages; i++) {
+		if (i + 1 < new_tps->npages && new_tps->pages[i + 1]->foff ==
+			new_tps->pages[i]->foff + TPS_PAGE_SIZE) {
+			continue;
+		}
+
+		if (do_mmap(new_tps->base + run * TPS_PAGE_SIZE, (i - run + 1) *
+			TPS_PAGE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_FIXED, memfd,
+			new_tps->pages[run]->foff) == MAP_FAILED) {
+			do_munmap(new_tps->base, len);
+			return -1;
+		}
+		run = i + 1;
+	}
+
+	if (register_slots(new_tps, 0, new_tps->npages, new_tps) < 0) {
+		do_munmap(new_tps->base, len);
+		return -1;
+	}
+
+	for (size_t i = 0; i < new_tps->npages; i++) {
+		new_tps->pages[i]->num_refs++;
+	}
+	return 0;
+}
+
+/* Allocates a TPS of the same size as cpy_tps, with no page and no range yet.
+It belongs to the current thread, but is neither in the table nor locked */
+static struct tps *new_tps_like(struct tps *cpy_tps)
+{
+	struct tps *new_tps = malloc(sizeof(struct tps));
+	if (new_tps == NULL) {
+		return NULL;
+	}
+	new_tps->pages = malloc(cpy_tps->npages * sizeof(struct mempage *));
+	if (new_tps->pages == NULL) {
+		free(new_tps);
+		return NULL;
+	}
+	new_tps->tid = pthread_self();
+	new_tps->mapped = 0;
+	new_tps->open = 0;
+	new_tps->cloning = 0;
+	new_tps->unclaimed = 0;
+	new_tps->spares = NULL;
+	new_tps->nspares = 0;
+	new_tps->backed = 0;
+	new_tps->seq = 0;
+	new_tps->size = cpy_tps->size;
+	new_tps->npages = cpy_tps->npages;
+	new_tps->base = NULL;
+	return new_tps;
+}
+
+/* Makes a TPS made by new_tps_like() refer to the pages of cpy_tps, whose pages
+must be locked */
+static int share_pages(struct tps *new_tps, struct tps *cpy_tps)
+{
+	if (tps_flags & TPS_MEMFD) {
+		return clone_file_pages(new_tps, cpy_tps);
+	}
+
+	/* Increments the number of references so that the tps_write()
+	function can correctly differentiate between copied pages and
+	unique ones */
+	for (size_t i = 0; i < new_tps->npages; i++) {
+		new_tps->pages[i] = cpy_tps->pages[i];
+		new_tps->pages[i]->num_refs++;
+	}
+
+	/* If the cloned TPS is mapped or left open for writing, its pages are
+	now shared and must fault on the next write */
+	if ((open_prot(cpy_tps) & TPS_MAP_WRITE) &&
+		(reserve_spares(cpy_tps) < 0 ||
+		protect_pages(cpy_tps, 0, cpy_tps->npages - 1) < 0)) {
+		for (size_t i = 0; i < new_tps->npages; i++) {
+			new_tps->pages[i]->num_refs--;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/* creates a new TPS  with a unique TID but sets every page to point to
+the existing pages of another thread's TPS. The cloned TPS is locked before
+the table is released, so that it cannot be destroyed under our feet */
+static int clone_tps(pthread_t tid)
+{
+	if (tps_table == NULL || find_curr_tps() != NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&table_lock);
+	struct tps *cpy_tps = find_tps(tid);
+	if (cpy_tps == NULL) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	/* The owner of the cloned TPS might be reading it without any lock: it
+	goes back to locking it before we share its pages. Readers are waited
+	for without holding its lock, which they may be waiting for themselves,
+	and the TPS is not destroyed meanwhile, see destroy_unlinked() */
+	__atomic_add_fetch(&cpy_tps->cloning, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&table_lock);
+	epoch_synchronize();
+
+	pthread_mutex_lock(&cpy_tps->lock);
+	struct tps *new_tps = new_tps_like(cpy_tps);
+	int retval = -1;
+	if (new_tps != NULL) {
+		lock_pages(cpy_tps, 0, cpy_tps->npages - 1);
+		retval = share_pages(new_tps, cpy_tps);
+		unlock_pages(cpy_tps, 0, cpy_tps->npages - 1);
+	}
+	__atomic_sub_fetch(&cpy_tps->cloning, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cpy_tps->lock);
+
+	if (retval < 0) {
+		if (new_tps != NULL) {
+			free(new_tps->pages);
+			free(new_tps);
+		}
+		return -1;
+	}
+
+	pthread_mutex_init(&new_tps->lock, NULL);
+	insert_tps(new_tps);
+	own_tps(new_tps);
+	return 0;
+}
+
+int tps_clone(pthread_t tid)
+{
+	struct timespec start;
+
+	start_latency(&start);
+	int retval = clone_tps(tid);
+	count_latency(LATENCY_CLONE, &start);
+	return retval;
+}
+
+static int compare_tids(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(pthread_t));
+}
+
+/* Checks that no thread appears twice in tids */
+static int unique_tids(const pthread_t *tids, size_t count)
+{
+	pthread_t *sorted = malloc(count * sizeof(pthread_t));
+	if (sorted == NULL) {
+		return 0;
+	}
+
+	memcpy(sorted, tids, count * sizeof(pthread_t));
+	qsort(sorted, count, sizeof(pthread_t), compare_tids);
+
+	int retval = 1;
+	for (size_t k = 1; retval && k < count; k++) {
+		retval = !pthread_equal(sorted[k - 1], sorted[k]);
+	}
+
+	free(sorted);
+	return retval;
+}
+
+/* Checks that none of the threads of tids has a TPS. The table must be
+locked */
+static int free_tids(const pthread_t *tids, size_t count)
+{
+	for (size_t k = 0; k < count; k++) {
+		if (find_tps(tids[k]) != NULL) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Like clone_tps() for every thread of tids, but the cloned TPS is flagged,
+waited for and has its pages locked only once for all the clones, which
+matters when hundreds of workers start from the same template. The clones are
+added to the table at the end, all at once, so that a worker finds its own on
+its first call like any TPS, and checks it was made for it, see claim_tps().
+The call fails if one of the threads has exited, or has got a TPS in the
+meantime, so that none of them ends up with two */
+int tps_clone_batch(pthread_t tid, const pthread_t *tids, size_t count)
+{
+	if (tps_table == NULL || tids == NULL || !unique_tids(tids, count)) {
+		return -1;
+	}
+
+	struct tps **clones = calloc(count + 1, sizeof(struct tps *));
+	if (clones == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&table_lock);
+	struct tps *cpy_tps = find_tps(tid);
+	if (cpy_tps == NULL || !free_tids(tids, count)) {
+		pthread_mutex_unlock(&table_lock);
+		free(clones);
+		return -1;
+	}
+	__atomic_add_fetch(&cpy_tps->cloning, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&table_lock);
+	epoch_synchronize();
+	pthread_mutex_lock(&cpy_tps->lock);
+
+	int retval = 0;
+	size_t made, shared = 0;
+	for (made = 0; made < count; made++) {
+		clones[made] = new_tps_like(cpy_tps);
+		if (clones[made] == NULL) {
+			retval = -1;
+			break;
+		}
+		clones[made]->tid = tids[made];
+		clones[made]->unclaimed = 1;
+		if (pthread_getcpuclockid(tids[made],
+			&clones[made]->claimant)) {
+			made++;
+			retval = -1;
+			break;
+		}
+	}
 
-queue_t tps_q = NULL;
+	if (retval == 0) {
+		lock_pages(cpy_tps, 0, cpy_tps->npages - 1);
+		for (; shared < count; shared++) {
+			if (share_pages(clones[shared], cpy_tps) < 0) {
+				retval = -1;
+				break;
+			}
+			pthread_mutex_init(&clones[shared]->lock, NULL);
+		}
+		unlock_pages(cpy_tps, 0, cpy_tps->npages - 1);
+	}
+	__atomic_sub_fetch(&cpy_tps->cloning, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cpy_tps->lock);
 
-/* This function helps us find a specific tps in a tps queue by searching
-for it's TID */
-int find_tps(void *data, void *arg)
-{
-	if (pthread_equal(*((pthread_t *) arg), ((struct tps *) data)->tid)) {
-		return 1;
-	} else {
-		return 0;
+	if (retval == 0) {
+		pthread_mutex_lock(&table_lock);
+		if (free_tids(tids, count)) {
+			for (size_t k = 0; k < count; k++) {
+				link_tps(clones[k]);
+			}
+		} else {
+			retval = -1;
+		}
+		pthread_mutex_unlock(&table_lock);
 	}
-}
 
-/* This function helps us find a specific tps in a tps queue by searching
-for the allocated space */
-int find_by_memarea(void *data, void *arg)
-{
-	if (((void *) arg) == ((struct tps *) data)->memarea->memptr) {
-		return 1;
-	} else {
-		return 0;
+	if (retval < 0) {
+		for (size_t k = 0; k < made; k++) {
+			if (k < shared) {
+				discard_tps(clones[k]);
+			} else {
+				free(clones[k]->pages);
+				free(clones[k]);
+			}
+		}
 	}
+
+	free(clones);
+	return retval;
 }
 
-/* This signal handler will throw an error when private memory is accessed
-and will exit the program */
-static void segv_handler(int sig, siginfo_t *si, __attribute__((unused)) void
-	*context)
+/* Hands the TPS of the current thread over to thread to, which finds it on
+its first call like a clone made by tps_clone_batch(), and claims it the same
+way: a TPS handed to a thread which exits without using it is destroyed by a
+later thread reusing its TID, or by tps_reclaim(). Nothing else than the
+TID of the TPS changes, which moves it to another bucket of the table: its
+pages keep their references and their home, so that no copy-on-write follows,
+and a thread cloning it is not disturbed. Once the pages left open are closed,
+the table lock is the only lock taken: only the owner changes mapped */
+int tps_transfer(pthread_t to)
 {
-	void *p_fault = (void *)((uintptr_t)si->si_addr & ~(TPS_SIZE - 1));
+	clockid_t claimant;
 
-	enter_critical_section();
-	void *temp = NULL;
-	queue_iterate(tps_q, &find_by_memarea, p_fault, &temp);
-	exit_critical_section();
-	if (temp != NULL) {
-		fprintf(stderr, "TPS protection error!\n");
+	struct tps *curr_tps = find_curr_tps();
+	if (curr_tps == NULL || curr_tps->mapped || pthread_equal(to,
+		pthread_self()) || pthread_getcpuclockid(to, &claimant)) {
+		return -1;
 	}
 
-	signal(SIGSEGV, SIG_DFL);
-	signal(SIGBUS, SIG_DFL);
+	/* Pages left open by TPS_DEFERRED are closed as by any other call */
+	tps_settle();
 
-	raise(sig);
+	pthread_mutex_lock(&table_lock);
+	if (find_tps(to) != NULL) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+	unlink_tps(curr_tps);
+	curr_tps->tid = to;
+	curr_tps->unclaimed = 1;
+	curr_tps->claimant = claimant;
+	link_tps(curr_tps);
+	pthread_mutex_unlock(&table_lock);
+
+	own_tps(NULL);
+	return 0;
 }
 
-/* Initializes the TPS functionality by creating a queue where the TPS's
-can be stored and initiallized the signal handler to maintain privacy */
-int tps_init(int segv)
+/* The TPS is taken out of the table before the thread it was made for can
+claim it, and destroyed like the TPS of an exiting thread */
+int tps_reclaim(pthread_t tid)
 {
-	enter_critical_section();
-	if (tps_q != NULL) {
-		exit_critical_section();
+	if (tps_table == NULL) {
 		return -1;
 	}
 
-	tps_q = queue_create();
-
-	if (tps_q == NULL) {
-		exit_critical_section();
+	pthread_mutex_lock(&table_lock);
+	struct tps *old_tps = find_tps(tid);
+	if (old_tps == NULL || !old_tps->unclaimed) {
+		pthread_mutex_unlock(&table_lock);
 		return -1;
 	}
+	unlink_tps(old_tps);
+	pthread_mutex_unlock(&table_lock);
+
+	destroy_unlinked(old_tps);
+	return 0;
+}
 
-	if (segv) {
-		struct sigaction sa;
+/* A snapshot holds a TPS of its own, which is never in the table: it refers
+to the pages of the TPS it was taken from like a clone, and is never written
+to. Only the owner of a TPS reads it without locking it, so there is no reader
+to wait for */
+struct tps_snapshot {
+	struct tps *tps;
+};
 
-		sigemptyset(&sa.sa_mask);
-		sa.sa_flags = SA_SIGINFO;
-		sa.sa_sigaction = segv_handler;
-		sigaction(SIGBUS, &sa, NULL);
-		sigaction(SIGSEGV, &sa, NULL);
+tps_snapshot_t tps_snapshot(void)
+{
+	struct tps_snapshot *snap = malloc(sizeof(struct tps_snapshot));
+	if (snap == NULL) {
+		return NULL;
 	}
 
-	exit_critical_section();
-	return 0;
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL) {
+		free(snap);
+		return NULL;
+	}
+
+	snap->tps = new_tps_like(curr_tps);
+	if (snap->tps == NULL) {
+		pthread_mutex_unlock(&curr_tps->lock);
+		free(snap);
+		return NULL;
+	}
+
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	int retval = share_pages(snap->tps, curr_tps);
+	unlock_pages(curr_tps, 0, curr_tps->npages - 1);
+	pthread_mutex_unlock(&curr_tps->lock);
+
+	if (retval < 0) {
+		free(snap->tps->pages);
+		free(snap->tps);
+		free(snap);
+		return NULL;
+	}
+
+	pthread_mutex_init(&snap->tps->lock, NULL);
+	return snap;
 }
 
-/* Allocates space for the TPS amd assign it's TID to the current thread */
-int tps_create(void)
+/* Rolls a backed TPS, which is locked, back to a snapshot of the same size. Its
+pages must stay in its file, so the pages it doesn't share with the snapshot
+anymore are written with the snapshot's content instead of being dropped */
+static int restore_backed(struct tps *curr_tps, struct tps *snap)
 {
-	enter_critical_section();
-	if (tps_q == NULL) {
-		return -1;
+	char page[TPS_PAGE_SIZE];
+	int retval = 0;
+
+	pthread_mutex_lock(&snap->lock);
+	if (snap->size != curr_tps->size) {
+		retval = -1;
 	}
+	for (size_t i = 0; retval == 0 && i < snap->npages; i++) {
+		struct tps_iovec seg = { i * TPS_PAGE_SIZE, TPS_PAGE_SIZE, page };
 
-	struct tps *new_tps = malloc(sizeof(struct tps));
-	new_tps->tid = pthread_self();
+		if (snap->pages[i] != curr_tps->pages[i] &&
+			(access_tps(snap, &seg, 1, 0) < 0 ||
+			access_tps(curr_tps, &seg, 1, 1) < 0)) {
+			retval = -1;
+		}
+	}
+	pthread_mutex_unlock(&snap->lock);
+	return retval;
+}
 
-	void *temp = NULL;
-	/* Makes sure there does not already exist a TPS for this thread */
-	queue_iterate(tps_q, &find_tps, &(new_tps->tid), &temp);
-	if (temp != NULL) {
-		free(new_tps);
-		exit_critical_section();
+/* The pages of the snapshot are shared with a new TPS first, so that a failure
+leaves ours untouched. Our pages are then dropped like when destroying the TPS,
+and the new TPS's pages and range are moved into ours. Like a clone, the TPS
+copies the pages it writes to into its own range. Our range is kept for that
+when no page outlives us in it, so that retrying from a snapshot over and over
+doesn't reserve a new range every time */
+int tps_rollback(tps_snapshot_t handle)
+{
+	struct tps *curr_tps = lock_curr_tps();
+	if (curr_tps == NULL || handle == NULL || curr_tps->mapped) {
+		if (curr_tps != NULL) {
+			pthread_mutex_unlock(&curr_tps->lock);
+		}
 		return -1;
 	}
 
-	new_tps->memarea = malloc(sizeof(struct mempage));
-	if (new_tps->memarea == NULL) {
-		exit_critical_section();
+	struct tps *snap = handle->tps;
+
+	/* The pages of the snapshot are opened on the next access */
+	close_tps(curr_tps);
+	if (curr_tps->backed) {
+		int retval = restore_backed(curr_tps, snap);
+		pthread_mutex_unlock(&curr_tps->lock);
+		return retval;
+	}
+
+	pthread_mutex_lock(&snap->lock);
+	struct tps *new_tps = new_tps_like(snap);
+	int retval = -1;
+	if (new_tps != NULL) {
+		lock_pages(snap, 0, snap->npages - 1);
+		retval = share_pages(new_tps, snap);
+		unlock_pages(snap, 0, snap->npages - 1);
+	}
+	pthread_mutex_unlock(&snap->lock);
+
+	if (retval < 0) {
+		if (new_tps != NULL) {
+			free(new_tps->pages);
+			free(new_tps);
+		}
+		pthread_mutex_unlock(&curr_tps->lock);
 		return -1;
 	}
 
-	/* Creates a space in memory that the thread can later use to read and
-	write. This space is initially filled with all 0s */
-	new_tps->memarea->num_refs = 1;
-	new_tps->memarea->memptr = mmap(NULL, TPS_SIZE, PROT_WRITE,
-		MAP_ANON|MAP_PRIVATE, -1, 0);
-	memset(new_tps->memarea->memptr, 0, TPS_SIZE);
+	lock_pages(curr_tps, 0, curr_tps->npages - 1);
+	begin_change(curr_tps);
+	int keep = !(tps_flags & TPS_MEMFD) && curr_tps->base != NULL &&
+		curr_tps->npages == new_tps->npages;
+	for (size_t i = 0; i < curr_tps->npages; i++) {
+		release_page(curr_tps, i);
+		keep = keep && curr_tps->pages[i] != NULL;
+	}
+	if (keep) {
+		new_tps->base = curr_tps->base;
+	} else if (curr_tps->base != NULL) {
+		unmap_range(curr_tps, 0, curr_tps->npages);
+	}
+	epoch_retire(curr_tps->pages, free);
+
+	curr_tps->size = new_tps->size;
+	curr_tps->npages = new_tps->npages;
+	curr_tps->base = new_tps->base;
+	curr_tps->pages = new_tps->pages;
+	free(new_tps);
+
+	/* With TPS_MEMFD, the range was registered for the new TPS */
+	if ((tps_flags & TPS_MEMFD) &&
+		register_slots(curr_tps, 0, curr_tps->npages, curr_tps) < 0) {
+		retval = -1;
+	}
 
-	/* Protection is set to not allow reading or writing by default */
-	if (mprotect(new_tps->memarea->memptr, TPS_SIZE, PROT_NONE) < 0) {
-		exit_critical_section();
+	end_change(curr_tps);
+	pthread_mutex_unlock(&curr_tps->lock);
+	return retval;
+}
+
+int tps_snapshot_destroy(tps_snapshot_t snap)
+{
+	if (snap == NULL) {
 		return -1;
 	}
 
-	/* Every TPS is enqueue'd to the tps queue to be found later */
-	queue_enqueue(tps_q, (void *)new_tps);
-	exit_critical_section();
+	discard_tps(snap->tps);
+	free(snap);
 	return 0;
 }
 
-/* Used to free the memory allowcated for the TPS. Checks to make sure
-there are no other threads referencing it as their own */
-int unmap_tps(void *data, void *arg)
+/* tps_compact() looks at one page index at a time: a shared page must be
+found at the same index in every TPS referring to it. An index is gone through
+in batches of at most COMPACT_BATCH TPS's, found among at most COMPACT_SCAN
+TPS's of the table, so that only the TPS's of a batch are ever locked at once.
+The TPS's holding the most common pages of the batches before, whose TIDs are
+kept in compact_keep, join the next batch at the same index so that pages can
+be merged across batches.
+
+compact_at is where the next batch starts, and compact_max the size of the
+largest TPS seen at its index so far. A TPS inserted or moved by a resize of the
+table meanwhile may be skipped or looked at twice. compact_lock lets only one
+thread compact at a time. It is taken before the table lock, and is the only
+place where several TPS's, and several pages of the same index, are locked at
+once */
+#define COMPACT_BATCH 8
+#define COMPACT_SCAN 256
+#define COMPACT_KEEP 8
+
+struct compact_cursor {
+	size_t index;
+	size_t bucket;
+	size_t pos;
+};
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compact_cursor compact_at;
+static size_t compact_max = 0;
+static pthread_t compact_keep[COMPACT_KEEP];
+static size_t compact_nkeep = 0;
+
+/* Page i of a TPS, as seen by tps_compact(), along with where the TPS was
+found in the table, or bucket SIZE_MAX for a TPS kept from the batches before.
+page is NULL for a private copy made by the kernel with TPS_MEMFD */
+struct compact_entry {
+	struct tps *tps;
+	struct mempage *page;
+	uint64_t hash;
+	size_t bucket;
+	size_t pos;
+};
+
+static int compare_pages(const void *a, const void *b)
+{
+	uintptr_t first = (uintptr_t) *(struct mempage * const *) a;
+	uintptr_t second = (uintptr_t) *(struct mempage * const *) b;
+
+	return first < second ? -1 : first > second;
+}
+
+/* Sorts by hash, then with the pages of the memory file first as only they
+can be merged into */
+static int compare_entries(const void *a, const void *b)
 {
-	struct tps *curr_tps = data;
-	if (pthread_equal(*((pthread_t *) arg), curr_tps->tid) && 
-		curr_tps->memarea->num_refs <= 1) {
-		munmap(curr_tps->memarea->memptr, TPS_SIZE);
-		return 1;
-	} else {
+	const struct compact_entry *first = a;
+	const struct compact_entry *second = b;
+
+	if (first->hash != second->hash) {
+		return first->hash < second->hash ? -1 : 1;
+	}
+	return (first->page == NULL) - (second->page == NULL);
+}
+
+static uint64_t hash_page(const void *data)
+{
+	const uint64_t *words = data;
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < TPS_PAGE_SIZE / sizeof(uint64_t); i++) {
+		hash = (hash ^ words[i]) * 1099511628211ULL;
+	}
+
+	return hash ^ (hash >> 29);
+}
+
+/* Whether page i of a TPS can be looked at. The pages of a mapped TPS must stay
+in its range, those of a backed TPS in its file, and a page living in a mapped
+TPS's range might be written to at any time. The pages left open by the
+protection level are only written to with their TPS locked, and read without
+lock only while it isn't being cloned: they can be looked at, and protected
+again afterwards, as long as their home is in the batch */
+static int compactable(struct tps *curr_tps, size_t i)
+{
+	struct mempage *page = curr_tps->pages[i];
+
+	if (curr_tps->mapped || curr_tps->backed) {
 		return 0;
 	}
+	return (tps_flags & TPS_MEMFD) || page->home == NULL ||
+		page->home == curr_tps || open_prot(page->home) == 0;
 }
 
-/* Frees all memory associated with the TPS, calls unmap_tps to assist */
-int tps_destroy(void)
+/* Makes page i of the TPS of e refer to page instead of its own private page,
+which is locked and dropped, consuming its lock. With TPS_MEMFD, the slot is
+mapped from the file page again, which drops the kernel's copy. Otherwise the
+private page is unmapped, or emptied if it lives in the range of its TPS */
+static int merge_page(struct compact_entry *e, size_t i, struct mempage *page)
 {
-	pthread_t curr_tid = pthread_self();
+	struct tps *curr_tps = e->tps;
+	struct mempage *old = e->page;
+	int retval = 0;
 
-	enter_critical_section();
-	void *temp = NULL;
-	queue_iterate(tps_q, &unmap_tps, &curr_tid, &temp);
-	if (temp == NULL) {
-		exit_critical_section();
-		return -1;
-	} else {
-		struct tps *curr_tps = temp;
-		if (curr_tps->memarea->num_refs > 1) {
-			curr_tps->memarea->num_refs--;
+	begin_change(curr_tps);
+	if (tps_flags & TPS_MEMFD) {
+		if (do_mmap(curr_tps->base + i * TPS_PAGE_SIZE, TPS_PAGE_SIZE,
+			PROT_NONE, MAP_PRIVATE|MAP_FIXED, memfd,
+			page->foff) == MAP_FAILED) {
+			retval = -1;
 		} else {
-			free(((struct tps *) temp)->memarea);
+			curr_tps->pages[i] = page;
+			page->num_refs++;
+			if (old != NULL) {
+				old->home = NULL;
+				release_file_page(old);
+			}
 		}
+		end_change(curr_tps);
+		return retval;
+	}
 
-		queue_delete(tps_q, temp);
-		free(temp);
-		exit_critical_section();
-		return 0;
+	curr_tps->pages[i] = page;
+	__atomic_store_n(&page->num_refs, page->num_refs + 1, __ATOMIC_RELEASE);
+	pagemap_set(old->memptr, NULL);
+	if (old->home == NULL) {
+		unmap_pages(old->memptr, 1);
+	} else {
+		do_mprotect(old->memptr, TPS_PAGE_SIZE, PROT_NONE);
+		madvise(old->memptr, TPS_PAGE_SIZE, MADV_DONTNEED);
 	}
+	end_change(curr_tps);
+	pthread_mutex_unlock(&old->lock);
+	free_mempage(old);
+	return 0;
 }
 
-int tps_read(size_t offset, size_t length, void *buffer)
+static double elapsed_us(const struct timespec *start)
 {
-	pthread_t curr_tid = pthread_self();
+	struct timespec now;
 
-	enter_critical_section();
-	struct tps *curr_tps = NULL;
-	/* Iterate to find the right tps to read from */
-	queue_iterate(tps_q, &find_tps, &curr_tid, (void **) &curr_tps);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e6 +
+		(now.tv_nsec - start->tv_nsec) / 1e3;
+}
 
-	if (curr_tps == NULL || buffer == NULL) {
-		exit_critical_section();
-		return -1;
+/* Keeps the TIDs of the TPS's heading the longest runs of the n sorted
+entries, whose page can be merged into */
+static void keep_runs(struct compact_entry *entries, size_t n)
+{
+	size_t lengths[COMPACT_KEEP];
+
+	compact_nkeep = 0;
+	for (size_t first = 0, e = 1; e <= n; e++) {
+		if (e < n && entries[e].hash == entries[first].hash) {
+			continue;
+		}
+
+		size_t length = e - first;
+		size_t k = compact_nkeep;
+		if (entries[first].page != NULL && (k < COMPACT_KEEP ||
+			length > lengths[k - 1])) {
+			if (k == COMPACT_KEEP) {
+				k--;
+			} else {
+				compact_nkeep++;
+			}
+			for (; k > 0 && lengths[k - 1] < length; k--) {
+				lengths[k] = lengths[k - 1];
+				compact_keep[k] = compact_keep[k - 1];
+			}
+			lengths[k] = length;
+			compact_keep[k] = entries[first].tps->tid;
+		}
+		first = e;
 	}
-	/* testing to make sure there isn't an overflow */
-	if (offset + length > TPS_SIZE) {
-		exit_critical_section();
+}
+
+/* Sets resume to where the first of the n entries was found in the table.
+Entries kept from the batches before were not found there */
+static void resume_at(struct compact_entry *entries, size_t n,
+	struct compact_cursor *resume)
+{
+	int found = 0;
+
+	for (size_t e = 0; e < n; e++) {
+		if (entries[e].bucket == SIZE_MAX || (found &&
+			(entries[e].bucket > resume->bucket ||
+			(entries[e].bucket == resume->bucket &&
+			entries[e].pos >= resume->pos)))) {
+			continue;
+		}
+		resume->bucket = entries[e].bucket;
+		resume->pos = entries[e].pos;
+		found = 1;
+	}
+}
+
+/* Merges the identical private pages found at index i of the n TPS's of
+entries, which are locked. The first nkeep entries are the TPS's kept from the
+batches before, and are always looked at. Once budget_us have passed since
+start, the entries left are not looked at, or not merged once a page was, and
+resume is set to where the first of them was found, and done is cleared.
+Returns the number of pages merged */
+static size_t compact_index(struct compact_entry *entries, size_t n,
+	size_t nkeep, size_t i, const struct timespec *start, size_t budget_us,
+	struct compact_cursor *resume, int *done)
+{
+	struct mempage *locked[COMPACT_BATCH + COMPACT_KEEP];
+	char dropped[COMPACT_BATCH + COMPACT_KEEP] = { 0 };
+	size_t nlocked = 0;
+	size_t merged = 0;
+
+	/* Pages shared by several TPS's are locked once */
+	for (size_t e = 0; e < n; e++) {
+		if (entries[e].page != NULL) {
+			locked[nlocked++] = entries[e].page;
+		}
+	}
+	qsort(locked, nlocked, sizeof(struct mempage *), compare_pages);
+	size_t unique = 0;
+	for (size_t k = 0; k < nlocked; k++) {
+		if (unique == 0 || locked[k] != locked[unique - 1]) {
+			locked[unique++] = locked[k];
+			pthread_mutex_lock(&locked[k]->lock);
+		}
+	}
+	nlocked = unique;
+
+	/* The pages that can be looked at are opened, hashed and moved to the
+	front. The entries after e keep their order meanwhile */
+	size_t kept = 0;
+	for (size_t e = 0; e < n; e++) {
+		if (e > nkeep && elapsed_us(start) >= budget_us) {
+			resume->bucket = entries[e].bucket;
+			resume->pos = entries[e].pos;
+			*done = 0;
+			break;
+		}
+		if (compactable(entries[e].tps, i) &&
+			do_mprotect(slot_addr(entries[e].tps, i), TPS_PAGE_SIZE,
+			PROT_READ) == 0) {
+			struct compact_entry entry = entries[e];
+
+			entry.hash = hash_page(slot_addr(entry.tps, i));
+			entries[e] = entries[kept];
+			entries[kept++] = entry;
+		}
+	}
+	n = kept;
+	qsort(entries, n, sizeof(struct compact_entry), compare_entries);
+
+	/* Every private page is merged into the first page of its run of
+	identical pages */
+	for (size_t first = 0, e = 1; e < n; e++) {
+		struct compact_entry *keep = &entries[first];
+		struct compact_entry *drop = &entries[e];
+
+		if (drop->hash != keep->hash) {
+			first = e;
+			continue;
+		}
+		if (keep->page == NULL || drop->page == keep->page ||
+			(drop->page != NULL && drop->page->num_refs > 1) ||
+			memcmp(slot_addr(keep->tps, i), slot_addr(drop->tps, i),
+			TPS_PAGE_SIZE)) {
+			continue;
+		}
+
+		/* Past the budget, the batch is resumed at the first TPS
+		which was not merged yet, once a page was */
+		if (merged > 0 && elapsed_us(start) >= budget_us) {
+			resume_at(entries + e, n - e, resume);
+			*done = 0;
+			break;
+		}
+
+		/* With TPS_MEMFD, a page mapped MAP_SHARED by its TPS has to
+		be mapped MAP_PRIVATE first, as for a clone */
+		if ((tps_flags & TPS_MEMFD) && keep->page->home == keep->tps &&
+			(share_file_page(keep->tps, i) < 0 ||
+			do_mprotect(slot_addr(keep->tps, i), TPS_PAGE_SIZE,
+			PROT_READ) < 0)) {
+			continue;
+		}
+
+		struct mempage **slot = drop->page == NULL ? NULL :
+			bsearch(&drop->page, locked, nlocked,
+			sizeof(struct mempage *), compare_pages);
+		if (merge_page(drop, i, keep->page) == 0) {
+			if (slot != NULL) {
+				dropped[slot - locked] = 1;
+			}
+			merged++;
+		}
+	}
+	keep_runs(entries, n);
+
+	for (size_t e = 0; e < n; e++) {
+		do_mprotect(slot_addr(entries[e].tps, i), TPS_PAGE_SIZE,
+			slot_prot(entries[e].tps, i));
+	}
+	for (size_t k = 0; k < nlocked; k++) {
+		if (!dropped[k]) {
+			pthread_mutex_unlock(&locked[k]->lock);
+		}
+	}
+
+	return merged;
+}
+
+/* Locks a TPS having a page at the index of compact_at and adds it to the n
+entries of a batch, flagged as being cloned so that its owner stops reading
+without locks. Returns the new number of entries */
+static size_t add_entry(struct compact_entry *entries, size_t n,
+	struct tps *curr, size_t bucket, size_t pos)
+{
+	size_t i = compact_at.index;
+
+	pthread_mutex_lock(&curr->lock);
+	if (curr->npages > compact_max) {
+		compact_max = curr->npages;
+	}
+	if (i >= curr->npages) {
+		pthread_mutex_unlock(&curr->lock);
+		return n;
+	}
+
+	entries[n].tps = curr;
+	entries[n].page = curr->pages[i];
+	entries[n].bucket = bucket;
+	entries[n].pos = pos;
+	__atomic_add_fetch(&curr->cloning, 1, __ATOMIC_RELAXED);
+	return n + 1;
+}
+
+/* Gathers the next batch at the index of compact_at, the TPS's kept from the
+batches before first, and sets next to where the batch after it starts. The
+table must be locked. Returns the number of entries, or 0 with *done set once
+the index has been gone through */
+static size_t gather_batch(struct compact_entry *entries, size_t *nkeep,
+	struct compact_cursor *next, int *done)
+{
+	size_t bucket = compact_at.bucket;
+	size_t pos = compact_at.pos;
+	size_t n = 0;
+
+	for (size_t k = 0; k < compact_nkeep; k++) {
+		struct tps *curr = find_tps(compact_keep[k]);
+
+		if (curr != NULL) {
+			n = add_entry(entries, n, curr, SIZE_MAX, 0);
+		}
+	}
+	*nkeep = n;
+
+	struct tps *curr = bucket < tps_buckets ? tps_table[bucket] : NULL;
+	for (size_t p = 0; curr != NULL && p < pos; p++) {
+		curr = curr->next;
+	}
+
+	*done = 0;
+	for (size_t scanned = 0; n < *nkeep + COMPACT_BATCH &&
+		scanned < COMPACT_SCAN; ) {
+		if (curr == NULL) {
+			if (bucket + 1 >= tps_buckets) {
+				*done = 1;
+				break;
+			}
+			curr = tps_table[++bucket];
+			pos = 0;
+			continue;
+		}
+
+		/* A kept TPS is already part of the batch */
+		int kept = 0;
+		for (size_t e = 0; e < *nkeep; e++) {
+			kept |= entries[e].tps == curr;
+		}
+		if (!kept) {
+			n = add_entry(entries, n, curr, bucket, pos);
+		}
+		curr = curr->next;
+		pos++;
+		scanned++;
+	}
+
+	next->index = compact_at.index;
+	next->bucket = bucket;
+	next->pos = pos;
+	return n;
+}
+
+/* Every batch is a unit of work: its TPS's are locked and flagged as being
+cloned, and their pages at the batch's index are merged. The budget is checked
+before every batch but the first, and while the pages of a batch are hashed. A
+call stops once it has gone through as many indexes as the largest TPS has
+pages */
+ssize_t tps_compact(size_t budget_us)
+{
+	struct compact_entry entries[COMPACT_BATCH + COMPACT_KEEP];
+	struct timespec start;
+	ssize_t merged = 0;
+
+	if (tps_table == NULL) {
 		return -1;
 	}
 
-	/* Changes the permission to allow a read */
-	if (mprotect(curr_tps->memarea->memptr, TPS_SIZE, PROT_READ) < 0) {
-		exit_critical_section();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_stats();
+	pthread_mutex_lock(&compact_lock);
+	for (size_t visited = 0, batches = 0; batches == 0 ||
+		elapsed_us(&start) < budget_us; batches++) {
+		struct compact_cursor next;
+		size_t i = compact_at.index;
+		size_t nkeep;
+		int done;
+
+		pthread_mutex_lock(&table_lock);
+		size_t n = gather_batch(entries, &nkeep, &next, &done);
+		pthread_mutex_unlock(&table_lock);
+
+		if (n > 1) {
+			epoch_synchronize();
+			merged += compact_index(entries, n, nkeep, i, &start,
+				budget_us, &next, &done);
+		}
+
+		/* compact_index() reorders the entries, but keeps them all */
+		for (size_t e = 0; e < n; e++) {
+			__atomic_sub_fetch(&entries[e].tps->cloning, 1,
+				__ATOMIC_RELEASE);
+			pthread_mutex_unlock(&entries[e].tps->lock);
+		}
+
+		/* A batch stopped short is resumed where it was left */
+		compact_at = next;
+		if (!done) {
+			continue;
+		}
+
+		size_t max_pages = compact_max;
+		compact_at.index = i + 1 < max_pages ? i + 1 : 0;
+		compact_at.bucket = 0;
+		compact_at.pos = 0;
+		compact_max = 0;
+		compact_nkeep = 0;
+		if (++visited >= max_pages) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compact_lock);
+
+	return merged;
+}
+
+int tps_arena_watermarks(size_t low, size_t high)
+{
+	if (tps_table == NULL || !use_arena()) {
 		return -1;
 	}
 
-	memcpy(buffer, curr_tps->memarea->memptr + offset, length);
+	pthread_mutex_lock(&pool_lock);
+	int retval = arena_set_watermarks(low, high);
+	pthread_mutex_unlock(&pool_lock);
+	return retval;
+}
 
-	/* Returns permission back to none before exiting */
-	if (mprotect(curr_tps->memarea->memptr, TPS_SIZE, PROT_NONE) < 0) {
-		exit_critical_section();
+int tps_arena_occupancy(struct tps_arena_stats *stats)
+{
+	if (tps_table == NULL || !use_arena() || stats == NULL) {
 		return -1;
 	}
 
-	exit_critical_section();
+	struct arena_stats occupancy;
+
+	pthread_mutex_lock(&pool_lock);
+	arena_get_stats(&occupancy);
+	pthread_mutex_unlock(&pool_lock);
+	stats->reserved = occupancy.reserved;
+	stats->used = occupancy.used;
+	stats->free = occupancy.free;
+	stats->low = occupancy.low;
+	stats->high = occupancy.high;
 	return 0;
 }
 
-int tps_write(size_t offset, size_t length, void *buffer)
+/* Gets the number of bytes of [start, end) covered by the sorted ranges */
+static size_t range_overlap(uintptr_t (*ranges)[2], size_t nranges,
+	uintptr_t start, uintptr_t end)
 {
-	pthread_t curr_tid = pthread_self();
+	size_t low = 0;
+	size_t high = nranges;
+	size_t overlap = 0;
 
-	enter_critical_section();
+	while (low < high) {
+		size_t mid = (low + high) / 2;
 
-	struct tps *curr_tps = NULL;
-	/* Iterate to find the right tps to write too */
-	queue_iterate(tps_q, &find_tps, &curr_tid, (void **) &curr_tps);
+		if (ranges[mid][1] <= start) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
 
-	if (curr_tps == NULL || buffer == NULL) {
-		exit_critical_section();
-		return -1;
+	for (size_t i = low; i < nranges && ranges[i][0] < end; i++) {
+		uintptr_t first = ranges[i][0] > start ? ranges[i][0] : start;
+		uintptr_t last = ranges[i][1] < end ? ranges[i][1] : end;
+
+		overlap += last - first;
 	}
-	/* checking for overflow */
-	if (offset + length > TPS_SIZE) {
-		exit_critical_section();
+
+	return overlap;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+	uintptr_t first = *(const uintptr_t *) a;
+	uintptr_t second = *(const uintptr_t *) b;
+
+	return first < second ? -1 : first > second;
+}
+
+/* The ranges of every TPS are collected first, then matched against the
+mappings listed by /proc/self/smaps. A mapping is only partly made of TPS
+ranges when ranges are next to each other or to other memory with the same
+protection, in which case its huge pages are counted in proportion */
+int tps_huge_stats(struct tps_huge_stats *stats)
+{
+	if (tps_table == NULL || !use_huge() || stats == NULL) {
 		return -1;
 	}
 
-	/* Checks for copies, choosing to write to a new unique mempage if there
-	are more than 1 references to a mempage */ 
-	if (curr_tps->memarea->num_refs > 1) {
-		struct mempage *newpage = malloc(sizeof(struct mempage));
-		newpage->num_refs = 1;
-		newpage->memptr = mmap(NULL, TPS_SIZE, PROT_WRITE,
-			MAP_ANON|MAP_PRIVATE, -1, 0);
+	memset(stats, 0, sizeof(struct tps_huge_stats));
 
-		if (newpage == NULL) {
-			free(newpage);
-			exit_critical_section();
-			return -1;
+	pthread_mutex_lock(&table_lock);
+	uintptr_t (*ranges)[2] = malloc((tps_count + 1) * sizeof(*ranges));
+	size_t nranges = 0;
+	if (ranges == NULL) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	for (size_t bucket = 0; bucket < tps_buckets; bucket++) {
+		for (struct tps *curr = tps_table[bucket]; curr != NULL;
+			curr = curr->next) {
+			pthread_mutex_lock(&curr->lock);
+			if (curr->base != NULL) {
+				ranges[nranges][0] = (uintptr_t) curr->base;
+				ranges[nranges][1] = (uintptr_t) curr->base +
+					curr->npages * TPS_PAGE_SIZE;
+				stats->range_bytes += curr->npages *
+					TPS_PAGE_SIZE;
+				nranges++;
+			}
+			pthread_mutex_unlock(&curr->lock);
 		}
-		tps_read(0, TPS_SIZE, newpage->memptr);
-		curr_tps->memarea->num_refs--;
-		curr_tps->memarea = newpage;
 	}
-	else {
-		/* Sets write permissions on TPS */
-		if (mprotect(curr_tps->memarea->memptr, TPS_SIZE, PROT_WRITE) < 0) {
-			perror(NULL);
-			exit_critical_section();
-			return -1;
+	pthread_mutex_unlock(&table_lock);
+	qsort(ranges, nranges, sizeof(*ranges), compare_ranges);
+
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (smaps == NULL) {
+		free(ranges);
+		return -1;
+	}
+
+	char line[1024];
+	unsigned long first, last, start = 0, end = 0;
+	size_t overlap = 0, kb;
+	while (fgets(line, sizeof(line), smaps) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &first, &last) == 2) {
+			start = first;
+			end = last;
+			overlap = range_overlap(ranges, nranges, start, end);
+		} else if (overlap > 0 &&
+			sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+			stats->huge_bytes += (double) kb * 1024 * overlap /
+				(end - start);
+		} else if (overlap > 0 && !strncmp(line, "VmFlags:", 8) &&
+			strstr(line, " hg") != NULL) {
+			stats->huge_range_bytes += overlap;
 		}
 	}
 
-	memcpy(curr_tps->memarea->memptr + offset, buffer, length);
+	fclose(smaps);
+	free(ranges);
+	return 0;
+}
+
+/* A page seen from a TPS by tps_get_stats(), with its number of references
+read while the TPS was locked, as the page can't be freed then */
+struct stats_page {
+	struct mempage *page;
+	int num_refs;
+};
+
+static int compare_stats_pages(const void *a, const void *b)
+{
+	uintptr_t first = (uintptr_t) ((const struct stats_page *) a)->page;
+	uintptr_t second = (uintptr_t) ((const struct stats_page *) b)->page;
+
+	return first < second ? -1 : first > second;
+}
+
+/* Counts the pages of every TPS in the table. A page shared by several TPS's
+is counted once. With TPS_MEMFD, a private copy made by the kernel has no
+mempage, and is counted as a private page of its own */
+static int count_pages(struct tps_stats *stats)
+{
+	size_t npages = 0;
+	size_t n = 0;
+
+	pthread_mutex_lock(&table_lock);
+	for (size_t bucket = 0; bucket < tps_buckets; bucket++) {
+		for (struct tps *curr = tps_table[bucket]; curr != NULL;
+			curr = curr->next) {
+			npages += curr->npages;
+		}
+	}
 
-	/* returns the page's privacy settings to none for either an old or a new
-	page */
-	if (mprotect(curr_tps->memarea->memptr, TPS_SIZE, PROT_NONE) < 0) {
-		exit_critical_section();
+	struct stats_page *pages = malloc((npages + 1) *
+		sizeof(struct stats_page));
+	if (pages == NULL) {
+		pthread_mutex_unlock(&table_lock);
 		return -1;
 	}
 
-	exit_critical_section();
+	stats->live_tps = tps_count;
+	for (size_t bucket = 0; bucket < tps_buckets; bucket++) {
+		for (struct tps *curr = tps_table[bucket]; curr != NULL;
+			curr = curr->next) {
+			pthread_mutex_lock(&curr->lock);
+			for (size_t i = 0; i < curr->npages; i++) {
+				struct mempage *page = curr->pages[i];
+
+				if (page == NULL) {
+					stats->pages++;
+					stats->refs[0]++;
+					continue;
+				}
+				pages[n].page = page;
+				pages[n++].num_refs = __atomic_load_n(
+					&page->num_refs, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&curr->lock);
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	qsort(pages, n, sizeof(struct stats_page), compare_stats_pages);
+	for (size_t k = 0; k < n; k++) {
+		if (k > 0 && pages[k].page == pages[k - 1].page) {
+			continue;
+		}
+
+		int num_refs = pages[k].num_refs < 1 ? 1 : pages[k].num_refs;
+		int bucket = 31 - __builtin_clz(num_refs);
+
+		if (bucket >= TPS_STATS_REFS) {
+			bucket = TPS_STATS_REFS - 1;
+		}
+		stats->pages++;
+		stats->shared_pages += num_refs > 1;
+		stats->refs[bucket]++;
+	}
+
+	free(pages);
 	return 0;
 }
 
-/* creates a new TPS  with a unique TID but sets the memarea to point to
-the existing memarea of another thread's TPS */
-int tps_clone(pthread_t tid)
+int tps_get_stats(struct tps_stats *stats)
 {
-	enter_critical_section();
-	struct tps *new_tps = malloc(sizeof(struct tps));
-	new_tps->tid = pthread_self();
-
-	void *temp = NULL;
-	queue_iterate(tps_q, &find_tps, &(new_tps->tid), &temp);
-	if (temp != NULL) {
-		free(new_tps);
-		exit_critical_section();
+	if (tps_table == NULL || stats == NULL) {
 		return -1;
 	}
 
-	struct tps *cpy_tps = NULL;
-	queue_iterate(tps_q, &find_tps, &tid, (void **) &cpy_tps);
+	memset(stats, 0, sizeof(struct tps_stats));
+	if (count_pages(stats) < 0) {
+		return -1;
+	}
 
-	if (cpy_tps == NULL) {
-		exit_critical_section();
+	uint64_t counts[STAT_COUNT] = { 0 };
+	uint64_t (*latency)[TPS_STATS_BUCKETS] = calloc(LATENCY_COUNT,
+		sizeof(*latency));
+	if (latency == NULL) {
 		return -1;
 	}
 
-	/* Increments the number of references so that the tps_write() function
-	can correctly differentiate between copied pages and unique ones */
-	new_tps->memarea = cpy_tps->memarea;
-	new_tps->memarea->num_refs++;
+	pthread_mutex_lock(&stats_lock);
+	for (struct thread_stats *curr = stats_list; ; curr = curr->next) {
+		struct thread_stats *from = curr == NULL ? &retired_stats : curr;
+
+		for (int n = 0; n < STAT_COUNT; n++) {
+			counts[n] += __atomic_load_n(&from->counts[n],
+				__ATOMIC_RELAXED);
+		}
+		for (int op = 0; op < LATENCY_COUNT; op++) {
+			for (int b = 0; b < TPS_STATS_BUCKETS; b++) {
+				latency[op][b] += __atomic_load_n(
+					&from->latency[op][b], __ATOMIC_RELAXED);
+			}
+		}
+		if (curr == NULL) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
 
-	queue_enqueue(tps_q, (void *)new_tps);
-	exit_critical_section();
+	stats->protection = protection_level();
+	stats->cow_copies = counts[STAT_COW];
+	stats->mprotect_calls = counts[STAT_MPROTECT];
+	stats->mmap_calls = counts[STAT_MMAP];
+	stats->munmap_calls = counts[STAT_MUNMAP];
+	memcpy(stats->read_ns, latency[LATENCY_READ], sizeof(stats->read_ns));
+	memcpy(stats->write_ns, latency[LATENCY_WRITE],
+		sizeof(stats->write_ns));
+	memcpy(stats->clone_ns, latency[LATENCY_CLONE],
+		sizeof(stats->clone_ns));
+	free(latency);
 	return 0;
 }
@@ -6,23 +6,228 @@
 #include <sys/types.h>
 
 /*
- * Size of a TPS area in bytes
+ * Size of a TPS area in bytes, when created with tps_create()
  */
 #define TPS_SIZE 4096
 
+/*
+ * Size of the pages making up a TPS area in bytes. Pages are the unit of
+ * sharing between cloned TPS areas.
+ */
+#define TPS_PAGE_SIZE 4096
+
+/*
+ * Modes for tps_map()
+ */
+#define TPS_MAP_READ 1
+#define TPS_MAP_WRITE 2
+
+/*
+ * Modes for tps_create_backed()
+ */
+#define TPS_BACKED_SHARED 1
+#define TPS_BACKED_PRIVATE 2
+
+/*
+ * Flags for tps_init()
+ *
+ * TPS_SEGV: Install a page fault handler reporting TPS protection errors.
+ *
+ * TPS_MEMFD: Back the TPS areas with a memory file rather than anonymous
+ * memory. Cloned pages are then mapped privately from the file, and copied by
+ * the kernel itself when they are written to.
+ *
+ * TPS_ARENA: Take the TPS areas from a page arena reserving memory in large
+ * chunks, and recycle the pages of destroyed areas instead of unmapping them.
+ * Ignored with TPS_MEMFD.
+ *
+ * TPS_HUGE: Map the TPS areas of at least 2 MB in 2 MB-aligned regions advised
+ * with MADV_HUGEPAGE, so that the kernel can back them with huge pages. A huge
+ * page is split back into 4 KB pages when part of it is protected differently,
+ * as any tps_read() or tps_write() of less than the whole page does, or copied
+ * on write. Mapping the area with tps_map() keeps it whole. Ignored with
+ * TPS_MEMFD.
+ *
+ * TPS_FAULTS: Install a page fault handler recording TPS protection errors in a
+ * ring buffer, see tps_faults(). The handler then passes faults on to the
+ * handler installed before tps_init(), if any, which can recover from them.
+ * Otherwise the records are written to stderr before the process is killed.
+ *
+ * TPS_REGION: Take the TPS areas from a page arena whose chunks are all carved
+ * from a single region of TPS_REGION_SIZE bytes of address space, reserved by
+ * tps_init(). The pages at rest then make up a single mapping of the kernel
+ * whatever else the process maps, and opening a page only splits it around
+ * that page. Implies TPS_ARENA, and is ignored with TPS_MEMFD.
+ *
+ * TPS_GUARD: Follow every TPS area with a guard page of its own, which is
+ * never opened, so that overrunning an area faults instead of reaching into the
+ * next one, even while both are mapped. Implies TPS_REGION.
+ *
+ * TPS_LATENCY: Time every read, write and clone to fill the latency histograms
+ * of struct tps_stats, which otherwise stay empty. This takes two calls to
+ * clock_gettime() per operation.
+ *
+ * The protection level is given by at most one of the following flags, and is
+ * ignored with TPS_MEMFD:
+ *
+ * TPS_STRICT: Open the pages of a TPS area for the duration of every access,
+ * so that they are only ever readable or writable while the API itself copies
+ * them. This is the default.
+ *
+ * TPS_DEFERRED: Leave the pages of the calling thread's TPS area open after
+ * tps_read(), tps_write() and the atomic operations, so that the accesses
+ * following them make no system call. The pages are closed again when the
+ * thread calls any other TPS function, or tps_settle(), which sem_down() calls
+ * before the thread may block.
+ *
+ * TPS_GUARD_ONLY: Leave the pages of every TPS area open, and rely on the
+ * guard pages alone to catch overruns. The pages of an area are only opened
+ * again after the calls changing them, such as tps_resize() or tps_rollback().
+ * Implies TPS_GUARD.
+ *
+ * With either level, pages shared with a clone, or merged by tps_compact(), are
+ * only left open for reading until they are copied on the next write.
+ */
+#define TPS_SEGV 1
+#define TPS_MEMFD 2
+#define TPS_ARENA 4
+#define TPS_HUGE 8
+#define TPS_FAULTS 16
+#define TPS_REGION 32
+#define TPS_GUARD 64
+#define TPS_STRICT 0
+#define TPS_DEFERRED 128
+#define TPS_GUARD_ONLY 256
+#define TPS_LATENCY 512
+
+/*
+ * Address space reserved with TPS_REGION, in bytes. No memory is committed for
+ * it until pages are used. The arena maps chunks on their own once it is used
+ * up.
+ */
+#define TPS_REGION_SIZE (64ULL << 30)
+
+/*
+ * Number of faults kept by TPS_FAULTS, the oldest ones being overwritten
+ */
+#define TPS_FAULT_RING 256
+
+/*
+ * Access types of struct tps_fault
+ */
+#define TPS_FAULT_UNKNOWN 0
+#define TPS_FAULT_READ 1
+#define TPS_FAULT_WRITE 2
+
+/*
+ * struct tps_fault - TPS protection error recorded with TPS_FAULTS
+ * @tid: Thread which made the invalid access
+ * @addr: Address accessed
+ * @owner: Thread owning the TPS area the address belongs to
+ * @offset: Offset of the address in that area, or -1 if the page accessed
+ *	doesn't belong to any area anymore, in which case @owner is 0
+ * @access: Type of access, TPS_FAULT_UNKNOWN if the platform doesn't tell
+ * @time_ns: Time of the fault on the CLOCK_MONOTONIC clock, in nanoseconds
+ *
+ * The owner and offset are found without taking any lock: they might be stale
+ * if the area was being destroyed or resized at the time of the fault.
+ */
+struct tps_fault {
+	pthread_t tid;
+	void *addr;
+	pthread_t owner;
+	ssize_t offset;
+	int access;
+	uint64_t time_ns;
+};
+
+/*
+ * struct tps_arena_stats - Occupancy of the page arena, in pages
+ * @reserved: Pages currently mapped by the arena
+ * @used: Pages currently making up TPS areas
+ * @free: Pages ready to be reused
+ * @low: Low watermark
+ * @high: High watermark
+ */
+struct tps_arena_stats {
+	size_t reserved;
+	size_t used;
+	size_t free;
+	size_t low;
+	size_t high;
+};
+
+/*
+ * struct tps_huge_stats - Huge page backing of the TPS areas, in bytes
+ * @range_bytes: Address space reserved for the TPS areas
+ * @huge_range_bytes: Part of @range_bytes advised with MADV_HUGEPAGE
+ * @huge_bytes: Part of @range_bytes actually backed by huge pages
+ */
+struct tps_huge_stats {
+	size_t range_bytes;
+	size_t huge_range_bytes;
+	size_t huge_bytes;
+};
+
+/*
+ * Number of buckets of the histograms of struct tps_stats
+ */
+#define TPS_STATS_REFS 16
+#define TPS_STATS_BUCKETS 32
+
+/*
+ * struct tps_stats - Statistics of the TPS API
+ * @live_tps: TPS areas currently existing
+ * @pages: Distinct memory pages making up these areas
+ * @shared_pages: Part of @pages shared by several areas
+ * @refs: Number of @pages by their number of references: bucket k counts the
+ *	pages with 2^k to 2^(k+1)-1 references, the last one counts the rest
+ * @cow_copies: Copy-on-write operations performed
+ * @mprotect_calls: Calls to mprotect()
+ * @mmap_calls: Calls to mmap() and mremap()
+ * @munmap_calls: Calls to munmap()
+ * @read_ns: Number of calls to tps_read() and tps_readv() by the log2 of their
+ *	latency in nanoseconds: bucket k counts the calls taking 2^k to
+ *	2^(k+1)-1 ns, the last one counts the rest
+ * @write_ns: Same as @read_ns, for tps_write() and tps_writev()
+ * @clone_ns: Same as @read_ns, for tps_clone()
+ *	The three histograms are only filled with TPS_LATENCY
+ * @protection: Protection level given to tps_init(): TPS_STRICT, TPS_DEFERRED
+ *	or TPS_GUARD_ONLY
+ *
+ * The counters cover every thread since the TPS API was initialized. The system
+ * calls are the ones made on TPS areas, the chunks reserved by the page arena
+ * are not counted.
+ */
+struct tps_stats {
+	size_t live_tps;
+	size_t pages;
+	size_t shared_pages;
+	size_t refs[TPS_STATS_REFS];
+	uint64_t cow_copies;
+	uint64_t mprotect_calls;
+	uint64_t mmap_calls;
+	uint64_t munmap_calls;
+	uint64_t read_ns[TPS_STATS_BUCKETS];
+	uint64_t write_ns[TPS_STATS_BUCKETS];
+	uint64_t clone_ns[TPS_STATS_BUCKETS];
+	int protection;
+};
+
 /*
  * tps_init - Initialize TPS
- * @segv - Activate segfault handler
+ * @flags - Flags ORed together
  *
  * Initialize TPS API. This function should only be called once by the client
- * application. If @segv is different than 0, the TPS API should install a
+ * application. If @flags contains TPS_SEGV, the TPS API should install a
  * page fault handler that is able to recognize TPS protection errors and
  * display the message "TPS protection error!\n" on stderr.
  *
- * Return: -1 if TPS API has already been initialized, or in case of failure
- * during the initialization. 0 if the TPS API was successfully initialized.
+ * Return: -1 if TPS API has already been initialized, if @flags contains
+ * several protection levels, or in case of failure during the initialization.
+ * 0 if the TPS API was successfully initialized.
  */
-int tps_init(int segv);
+int tps_init(int flags);
 
 /*
  * tps_create - Create TPS
@@ -36,10 +241,115 @@ int tps_init(int segv);
  */
 int tps_create(void);
 
+/*
+ * tps_create_sized - Create TPS of a given size
+ * @bytes: Size of the TPS area in bytes
+ *
+ * Create a TPS area of @bytes bytes and associate it to the current thread. The
+ * TPS area is initialized to all zeros.
+ *
+ * Return: -1 if current thread already has a TPS, if @bytes is 0, or in case of
+ * failure during the creation. 0 if the TPS area was successfully created.
+ */
+int tps_create_sized(size_t bytes);
+
+/*
+ * tps_create_backed - Create TPS backed by a file
+ * @path: Path of the file
+ * @mode: TPS_BACKED_SHARED or TPS_BACKED_PRIVATE
+ *
+ * Create a TPS area mapped from the file at @path and associate it to the
+ * current thread. The area has the size of the file, and holds its content.
+ * Pages are only read from the file when they are first accessed.
+ *
+ * With TPS_BACKED_SHARED, the file is created with a size of TPS_SIZE bytes if
+ * it doesn't exist or is empty, and writes to the area go to the file, so that
+ * it keeps the content of the area once the thread, or the process, is gone.
+ * With TPS_BACKED_PRIVATE, the file must exist and is never written to: the
+ * area is a private copy of it, typically used as a template for tps_clone().
+ *
+ * A backed area cannot be resized. Rolling it back to a snapshot writes the
+ * content of the snapshot to it. Backed areas are not available with
+ * TPS_MEMFD.
+ *
+ * Return: -1 if current thread already has a TPS, if @path is NULL, if @mode is
+ * invalid, if the file cannot be opened or is empty with TPS_BACKED_PRIVATE,
+ * or in case of failure during the creation. 0 if the TPS area was
+ * successfully created.
+ */
+int tps_create_backed(const char *path, int mode);
+
+/*
+ * tps_sync - Flush TPS to its file
+ *
+ * Write the pages of the current thread's TPS area which changed since they
+ * were last written back to the file the area was created from with
+ * TPS_BACKED_SHARED, and wait for the writes to complete.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if the TPS was not created
+ * with TPS_BACKED_SHARED, or in case of failure. 0 if the TPS area was
+ * successfully flushed.
+ */
+int tps_sync(void);
+
+/*
+ * tps_export - Export TPS to other processes
+ *
+ * Copy the content of the current thread's TPS area into a new sealed memory
+ * file, which can be handed to other processes, e.g. inherited through fork()
+ * or passed over a UNIX socket. The file keeps the content the area had at the
+ * time of the call, and cannot be modified. It is closed on exec().
+ *
+ * Return: -1 if current thread doesn't have a TPS, or in case of failure.
+ * File descriptor of the memory file otherwise, to be closed by the caller.
+ */
+int tps_export(void);
+
+/*
+ * tps_import - Import TPS from another process
+ * @fd: File descriptor returned by tps_export()
+ *
+ * Create a TPS area holding the content of a TPS area exported by
+ * tps_export(), possibly from another process, and associate it to the current
+ * thread. Like with tps_create_backed() and TPS_BACKED_PRIVATE, the area maps
+ * the memory file privately: the pages of the file are shared by all the
+ * processes importing it, and copied on the first write. @fd can be closed
+ * once this returns. Not available with TPS_MEMFD.
+ *
+ * Return: -1 if current thread already has a TPS, if @fd is invalid or empty,
+ * or in case of failure during the creation. 0 if the TPS area was
+ * successfully created.
+ */
+int tps_import(int fd);
+
+/*
+ * tps_resize - Resize TPS
+ * @bytes: New size of the TPS area in bytes
+ *
+ * Change the size of the current thread's TPS area to @bytes bytes. The
+ * content of the area is preserved up to the smaller of the old and new sizes,
+ * and any new byte is initialized to zero. The existing pages are never copied,
+ * although they might be moved to a different address.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @bytes is 0, if the TPS
+ * is mapped or backed by a file, or in case of failure. 0 if the TPS area was
+ * successfully resized.
+ */
+int tps_resize(size_t bytes);
+
+/*
+ * tps_size - Get TPS size
+ *
+ * Return: -1 if current thread doesn't have a TPS. Size of the current thread's
+ * TPS area in bytes otherwise.
+ */
+ssize_t tps_size(void);
+
 /*
  * tps_destroy - Destroy TPS
  *
- * Destroy the TPS area associated to the current thread.
+ * Destroy the TPS area associated to the current thread. A thread exiting
+ * without calling this function has its TPS area destroyed automatically.
  *
  * Return: -1 if current thread doesn't have a TPS. 0 if the TPS area was
  * successfully destroyed.
@@ -72,6 +382,7 @@ int tps_read(size_t offset, size_t length, void *buffer);
  *
  * If the current thread's TPS shares a memory page with another thread's TPS,
  * this should trigger a copy-on-write operation before the actual write occurs.
+ * Only the pages covered by the write are copied.
  *
  * Return: -1 if current thread doesn't have a TPS, or if the writing operation
  * is out of bound, or if @buffer is NULL, or in case of failure. 0 if the TPS
@@ -79,17 +390,481 @@ int tps_read(size_t offset, size_t length, void *buffer);
  */
 int tps_write(size_t offset, size_t length, void *buffer);
 
+/*
+ * tps_read_from - Read from another thread's TPS
+ * @tid: TID of the thread whose TPS to read from
+ * @offset: Offset where to read from in the TPS
+ * @length: Length of the data to read
+ * @buffer: Data buffer receiving the read data
+ *
+ * Read @length bytes of data from thread @tid's TPS at byte offset @offset into
+ * data buffer @buffer. The data is read as it was at a single point in time:
+ * the read starts over if the TPS changes while it is copied. Unlike
+ * tps_clone(), this keeps no reference to the pages of the TPS, and thread @tid
+ * never waits for the read. Writes made through the pointer returned by
+ * tps_map() are not seen as changes though, so a mapped TPS is read as is.
+ *
+ * The pages of another thread's TPS have no access, and are read through
+ * /proc/self/mem, which only works if the kernel lets it force access to them
+ * (it doesn't with proc_mem.force_override=never), and costs a system call per
+ * run of consecutive pages. With TPS_MEMFD, the pages still in the memory file
+ * are read from the file instead, which needs neither, and only the pages the
+ * kernel has copied on write after a clone are read through /proc/self/mem.
+ *
+ * Return: -2 if some of the pages can't be read, as the kernel refuses to
+ * force access to them. -1 if thread @tid doesn't have a TPS, if the reading
+ * operation is out of bound, if @buffer is NULL, or in case of failure. 0 if
+ * the TPS was successfully read from.
+ */
+int tps_read_from(pthread_t tid, size_t offset, size_t length, void *buffer);
+
+/*
+ * struct tps_iovec - Segment of a vectored TPS access
+ * @offset: Offset of the segment in the TPS
+ * @length: Length of the segment
+ * @buffer: Data buffer holding or receiving the data of the segment
+ */
+struct tps_iovec {
+	size_t offset;
+	size_t length;
+	void *buffer;
+};
+
+/*
+ * tps_readv - Read several segments from TPS
+ * @iov: Array of segments to read
+ * @iovcnt: Number of segments in @iov
+ *
+ * Read every segment of @iov from the current thread's TPS, as if by calling
+ * tps_read() on each of them, but opening the TPS only once for all of them.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @iov is NULL or @iovcnt
+ * is negative, if any segment is out of bound or has a NULL buffer, or in case
+ * of internal failure. Nothing is read if -1 is returned because of an invalid
+ * segment. 0 if the TPS was successfully read from.
+ */
+int tps_readv(const struct tps_iovec *iov, int iovcnt);
+
+/*
+ * tps_writev - Write several segments to TPS
+ * @iov: Array of segments to write, in order
+ * @iovcnt: Number of segments in @iov
+ *
+ * Write every segment of @iov to the current thread's TPS, as if by calling
+ * tps_write() on each of them in order, but opening the TPS and performing
+ * the copy-on-write operations only once for all of them.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @iov is NULL or @iovcnt
+ * is negative, if any segment is out of bound or has a NULL buffer, or in case
+ * of failure. Nothing is written if -1 is returned because of an invalid
+ * segment. 0 if the TPS was successfully written to.
+ */
+int tps_writev(const struct tps_iovec *iov, int iovcnt);
+
+/*
+ * tps_fetch_add - Atomically add to a TPS word
+ * @offset: Offset of the word in the TPS, a multiple of @width
+ * @width: Size of the word in bytes, 4 or 8
+ * @value: Value to add to the word
+ * @old: Address where the value the word held is received, or NULL
+ *
+ * Add @value to the word of @width bytes at byte offset @offset of the current
+ * thread's TPS, in place. Unlike a tps_read() followed by a tps_write(), the
+ * TPS is opened only once, and the page holding the word is copied only if it
+ * is shared. A 4-byte word only uses the low 32 bits of @value, and its value
+ * is zero-extended into @old.
+ *
+ * The operation is atomic, even with respect to accesses made through the
+ * pointer returned by tps_map().
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @width is neither 4
+ * nor 8, if @offset is not aligned on @width, if the word is out of bound, or
+ * in case of failure. 0 if the word was successfully updated.
+ */
+int tps_fetch_add(size_t offset, size_t width, uint64_t value, uint64_t *old);
+
+/*
+ * tps_fetch_or - Atomically OR a TPS word
+ *
+ * Same as tps_fetch_add(), but ORs @value into the word.
+ */
+int tps_fetch_or(size_t offset, size_t width, uint64_t value, uint64_t *old);
+
+/*
+ * tps_fetch_and - Atomically AND a TPS word
+ *
+ * Same as tps_fetch_add(), but ANDs @value into the word.
+ */
+int tps_fetch_and(size_t offset, size_t width, uint64_t value, uint64_t *old);
+
+/*
+ * tps_swap - Atomically replace a TPS word
+ *
+ * Same as tps_fetch_add(), but replaces the word with @value.
+ */
+int tps_swap(size_t offset, size_t width, uint64_t value, uint64_t *old);
+
+/*
+ * tps_cas - Atomically compare and swap a TPS word
+ * @offset: Offset of the word in the TPS, a multiple of @width
+ * @width: Size of the word in bytes, 4 or 8
+ * @expected: Address of the value the word is expected to hold
+ * @desired: Value to give the word
+ *
+ * Replace the word of @width bytes at byte offset @offset of the current
+ * thread's TPS with @desired if it holds the value at @expected. The value the
+ * word held is received at @expected either way. The page holding the word is
+ * made private if it is shared, even if the word doesn't change.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @expected is NULL, if
+ * @width is neither 4 nor 8, if @offset is not aligned on @width, if the word
+ * is out of bound, or in case of failure. 1 if the word was replaced, 0 if it
+ * didn't hold the expected value.
+ */
+int tps_cas(size_t offset, size_t width, uint64_t *expected, uint64_t desired);
+
+/*
+ * tps_key_create - Create a TPS key
+ * @size: Size of the slot in bytes
+ * @align: Alignment of the slot in bytes, a power of two
+ *
+ * Reserve a slot of @size bytes in the TPS area of every thread, as
+ * pthread_key_create() does for thread-specific data. The key is the offset of
+ * the slot, the same for all threads, and can also be given to tps_read() and
+ * tps_write(). Slots are carved downwards from the end of the first TPS_SIZE
+ * bytes of the area, so that offsets picked by hand from its start stay clear
+ * of them as long as the two don't meet. Keys are never deleted.
+ *
+ * Return: -1 if @size is 0, if @align is not a power of two or is larger than
+ * TPS_PAGE_SIZE, or if there is no room left for the slot. The key otherwise.
+ */
+ssize_t tps_key_create(size_t size, size_t align);
+
+/*
+ * tps_get - Read a TPS slot
+ * @key: Key returned by tps_key_create()
+ * @buffer: Data buffer receiving the slot
+ *
+ * Read the whole slot @key of the current thread's TPS into @buffer. A slot of
+ * 4 or 8 bytes aligned on its size is read as a single word, which takes less
+ * work than tps_read().
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @key is not a key, if
+ * @buffer is NULL, if the slot lies beyond the end of the TPS, or in case of
+ * failure. 0 if the slot was successfully read.
+ */
+int tps_get(size_t key, void *buffer);
+
+/*
+ * tps_set - Write a TPS slot
+ * @key: Key returned by tps_key_create()
+ * @buffer: Data buffer holding the new content of the slot
+ *
+ * Write @buffer to the whole slot @key of the current thread's TPS. A slot of
+ * 4 or 8 bytes aligned on its size is written as a single word, as tps_swap()
+ * does.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @key is not a key, if
+ * @buffer is NULL, if the slot lies beyond the end of the TPS, or in case of
+ * failure. 0 if the slot was successfully written.
+ */
+int tps_set(size_t key, void *buffer);
+
+/*
+ * tps_get64 - Read an 8-byte TPS slot
+ * @key: Key returned by tps_key_create() with a @size and @align of 8
+ * @value: Address of data item where the slot is received
+ *
+ * Same as tps_get(), for a slot holding a 64-bit value.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @key is not the key of
+ * an 8-byte slot aligned on 8 bytes, if @value is NULL, if the slot lies beyond
+ * the end of the TPS, or in case of failure. 0 if the slot was successfully
+ * read.
+ */
+int tps_get64(size_t key, uint64_t *value);
+
+/*
+ * tps_set64 - Write an 8-byte TPS slot
+ * @key: Key returned by tps_key_create() with a @size and @align of 8
+ * @value: New value of the slot
+ *
+ * Same as tps_set(), for a slot holding a 64-bit value.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @key is not the key of
+ * an 8-byte slot aligned on 8 bytes, if the slot lies beyond the end of the
+ * TPS, or in case of failure. 0 if the slot was successfully written.
+ */
+int tps_set64(size_t key, uint64_t value);
+
 /*
  * tps_clone - Clone TPS
  * @tid: TID of the thread to clone
  *
  * Clone thread @tid's TPS. In the first phase, the cloned TPS's content should
  * copied directly. In the last phase, the new TPS should not copy the cloned
- * TPS's content but should refer to the same memory page.
+ * TPS's content but should refer to the same memory pages. The new TPS has the
+ * same size as the cloned one.
  *
  * Return: -1 if thread @tid doesn't have a TPS, or if current thread already
  * has a TPS, or in case of failure. 0 is TPS was successfully cloned.
  */
 int tps_clone(pthread_t tid);
 
+/*
+ * tps_clone_batch - Clone TPS for several threads
+ * @tid: TID of the thread to clone
+ * @tids: Array of TIDs of the threads to give a clone to
+ * @count: Number of threads in @tids
+ *
+ * Clone thread @tid's TPS for every thread of @tids, as if each of them had
+ * called tps_clone(@tid), but preparing the clones all at once. This is meant
+ * for a thread starting a pool of workers from the same template: each worker
+ * then finds its clone on its first call to the TPS API, as if it had made it.
+ * The threads of @tids must be running, and must not create a TPS of their own
+ * until this returns. A clone is only destroyed automatically when its thread
+ * exits if the thread has used it. The clone of a thread which exits without
+ * using it is destroyed by tps_reclaim(), or by the first call to the TPS API
+ * of a later thread reusing its TID, which then has no TPS.
+ *
+ * Return: -1 if thread @tid doesn't have a TPS, if @tids is NULL, if a thread
+ * appears twice in @tids, has exited or already has a TPS, or in case of
+ * failure. No clone is made in that case. 0 if the TPS was successfully cloned
+ * for every thread.
+ */
+int tps_clone_batch(pthread_t tid, const pthread_t *tids, size_t count);
+
+/*
+ * tps_transfer - Hand TPS over to another thread
+ * @to: TID of the thread to give the TPS to
+ *
+ * Make the current thread's TPS area thread @to's own, as if @to had created
+ * it, and leave the current thread without a TPS. Nothing is copied, whatever
+ * the size of the area, and the pages of the area are not shared: writing to
+ * them afterwards doesn't copy them. Thread @to finds the area on its first
+ * call to the TPS API, and must not create a TPS of its own until this
+ * returns. The area is only destroyed automatically when @to exits if @to has
+ * used it. Otherwise, it is destroyed by tps_reclaim(), or by the first call to
+ * the TPS API of a later thread reusing the TID of @to, as the clones of
+ * tps_clone_batch() are.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if its TPS is mapped, if
+ * @to is the current thread, has exited or already has a TPS. 0 if the TPS was
+ * successfully handed over.
+ */
+int tps_transfer(pthread_t to);
+
+/*
+ * tps_reclaim - Destroy TPS made for or handed to a thread which didn't use it
+ * @tid: TID of the thread
+ *
+ * Destroy the TPS area made for thread @tid by tps_clone_batch(), or handed to
+ * it by tps_transfer(), as long as @tid hasn't used it yet. This is meant for
+ * the thread which made or handed it, once @tid has exited or will never use
+ * the area. If @tid calls the TPS API afterwards, it has no TPS.
+ *
+ * Return: -1 if TPS API was not initialized, if thread @tid doesn't have a TPS,
+ * or if it has already used it. 0 if the TPS area was successfully destroyed.
+ */
+int tps_reclaim(pthread_t tid);
+
+/*
+ * tps_snapshot_t - TPS snapshot type
+ *
+ * A snapshot keeps the content a TPS area had when it was taken. It refers to
+ * the same memory pages as the area, as a clone would, so that taking it and
+ * rolling back to it never copies the content. The pages are copied by the
+ * first write to them afterwards, as for a clone. The handle is opaque, and
+ * only accepted by the snapshot functions.
+ */
+typedef struct tps_snapshot *tps_snapshot_t;
+
+/*
+ * tps_snapshot - Take a snapshot of TPS
+ *
+ * Take a snapshot of the current thread's TPS area, including its size.
+ *
+ * With TPS_MEMFD, the snapshot is given a range of its own, mapped from the
+ * memory file, and the pages written to since the area was last cloned or
+ * snapshotted are first copied into the file, as a clone's would be. Taking a
+ * snapshot then costs time in proportion to the size of the area, and to the
+ * pages written since the last one.
+ *
+ * Return: NULL if current thread doesn't have a TPS, or in case of failure.
+ * Snapshot of the TPS area otherwise.
+ */
+tps_snapshot_t tps_snapshot(void);
+
+/*
+ * tps_rollback - Roll TPS back to a snapshot
+ * @snap: Snapshot to roll back to
+ *
+ * Give the current thread's TPS area the content and size saved in @snap. The
+ * snapshot is not consumed, and can be rolled back to again. It can come from
+ * the TPS area of another thread.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @snap is NULL, if the TPS
+ * is mapped, if it is backed by a file and @snap has another size, or in case
+ * of failure. The TPS area is left untouched in that
+ * case. 0 if the TPS area was successfully rolled back.
+ */
+int tps_rollback(tps_snapshot_t snap);
+
+/*
+ * tps_snapshot_destroy - Destroy a snapshot
+ * @snap: Snapshot to destroy
+ *
+ * Return: -1 if @snap is NULL. 0 if the snapshot was successfully destroyed.
+ */
+int tps_snapshot_destroy(tps_snapshot_t snap);
+
+/*
+ * tps_compact - Merge identical TPS pages
+ * @budget_us: Time after which to stop, in microseconds
+ *
+ * Look for memory pages that are private to a TPS area but hold the same
+ * content as a page at the same offset of another area, as after clones of the
+ * same area wrote the same data to it. Each of them is dropped, and its area
+ * shares the other page instead, which is copied on the next write as after a
+ * call to tps_clone(). Mapped areas and areas backed by a file are left alone.
+ * The pages left open by TPS_DEFERRED or TPS_GUARD_ONLY are merged as well,
+ * and only left open for reading afterwards, as the pages of a clone are.
+ *
+ * The pages are looked at one offset at a time, a few areas at once, so that
+ * the owners of the other areas are never held up. The call returns once it
+ * has looked at every offset, or once @budget_us microseconds have passed, in
+ * which case the next call resumes where it stopped. A call always makes some
+ * progress, and overruns its budget by a few pages' worth of work at most.
+ *
+ * Return: -1 if TPS API was not initialized. Number of pages dropped otherwise.
+ */
+ssize_t tps_compact(size_t budget_us);
+
+/*
+ * tps_map - Map TPS
+ * @mode: TPS_MAP_READ, or TPS_MAP_WRITE to also allow writing
+ *
+ * Give the current thread direct access to its TPS area, until it calls
+ * tps_unmap(). The area can then be accessed through the returned pointer
+ * without going through tps_read() and tps_write().
+ *
+ * Pages that are shared with other TPS areas after a call to tps_clone() stay
+ * read-only: writing to one of them through the pointer triggers a
+ * copy-on-write operation of this page only, which is handled by the page fault
+ * handler. If tps_init() didn't install the handler, it is installed by the
+ * first call to tps_map() with TPS_MAP_WRITE, without reporting protection
+ * errors. The handler allocates nothing: a page is set aside for every shared
+ * page by tps_map() or by the call to tps_clone() sharing it, and only the
+ * locks of the area and of the page are taken, which the current thread never
+ * holds outside of the TPS API. A write through the pointer may thus happen in
+ * the middle of malloc(), but the pointer must not be given as a buffer to the
+ * TPS API: tps_read() and tps_write() refuse it.
+ *
+ * Pages that the current thread's TPS still shares with the TPS it was cloned
+ * from are copied when it gets mapped, as they don't live in its area.
+ *
+ * The area cannot be resized while it is mapped.
+ *
+ * Return: NULL if current thread doesn't have a TPS, if it is already mapped, if
+ * @mode is invalid, or in case of failure. Address of the TPS area otherwise.
+ */
+void *tps_map(int mode);
+
+/*
+ * tps_unmap - Unmap TPS
+ *
+ * Revoke the direct access given by tps_map(). The pointer returned by
+ * tps_map() must not be used anymore.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if it is not mapped, or
+ * in case of failure. 0 if the TPS area was successfully unmapped.
+ */
+int tps_unmap(void);
+
+/*
+ * tps_settle - Close TPS
+ *
+ * Close the pages of the current thread's TPS area that TPS_DEFERRED left
+ * open. Does nothing if the area has no open pages, if the current thread
+ * doesn't have a TPS, or with any other protection level.
+ */
+void tps_settle(void);
+
+/*
+ * tps_arena_watermarks - Configure the page arena
+ * @low: Number of free pages the arena keeps ready for new TPS areas
+ * @high: Maximum number of free pages the arena keeps for reuse
+ *
+ * Once fewer than @low pages are free, the arena reserves a new chunk without
+ * waiting for it to be needed. Pages given back while more than @high pages
+ * are free are unmapped.
+ *
+ * Return: -1 if TPS API was not initialized with TPS_ARENA, if @low is greater
+ * than @high, or in case of failure. 0 if the arena was successfully
+ * configured.
+ */
+int tps_arena_watermarks(size_t low, size_t high);
+
+/*
+ * tps_arena_occupancy - Get the occupancy of the page arena
+ * @stats: Address of data item where the occupancy is received
+ *
+ * Return: -1 if TPS API was not initialized with TPS_ARENA, or if @stats is
+ * NULL. 0 if the occupancy was successfully received.
+ */
+int tps_arena_occupancy(struct tps_arena_stats *stats);
+
+/*
+ * tps_huge_stats - Get the huge page backing of the TPS areas
+ * @stats: Address of data item where the backing is received
+ *
+ * The backing is read from /proc/self/smaps, and covers the TPS areas of every
+ * thread. Pages of a TPS area living in the area of another, as after a call
+ * to tps_clone(), are counted with the area they live in.
+ *
+ * Return: -1 if TPS API was not initialized with TPS_HUGE, if @stats is NULL,
+ * or in case of failure. 0 if the backing was successfully received.
+ */
+int tps_huge_stats(struct tps_huge_stats *stats);
+
+/*
+ * tps_get_stats - Get statistics of the TPS API
+ * @stats: Address of data item where the statistics are received
+ *
+ * Every thread counts its own operations, without sharing anything with the
+ * others. The counts of all the threads, including the ones which have exited,
+ * are added together by this call.
+ *
+ * Return: -1 if TPS API was not initialized, if @stats is NULL, or in case of
+ * failure. 0 if the statistics were successfully received.
+ */
+int tps_get_stats(struct tps_stats *stats);
+
+/*
+ * tps_faults - Get recorded protection errors
+ * @faults: Array receiving the faults
+ * @count: Number of elements of @faults
+ *
+ * Copy the last @count TPS protection errors recorded with TPS_FAULTS into
+ * @faults, oldest first. Faults being recorded by other threads at the same
+ * time are skipped.
+ *
+ * Return: -1 if TPS API was not initialized with TPS_FAULTS, or if @faults is
+ * NULL. Number of faults copied otherwise.
+ */
+ssize_t tps_faults(struct tps_fault *faults, size_t count);
+
+/*
+ * tps_fault_dump - Write recorded protection errors
+ * @fd: File descriptor to write to
+ *
+ * Write the TPS protection errors recorded with TPS_FAULTS to @fd, oldest
+ * first, one line of text per fault. This function only uses write(2), and is
+ * async-signal-safe: it can be called from a signal handler.
+ *
+ * Return: -1 if TPS API was not initialized with TPS_FAULTS, or in case of
+ * write error. 0 if the faults were successfully written.
+ */
+int tps_fault_dump(int fd);
+
 #endif /* _TPS_H */
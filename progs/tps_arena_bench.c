@@ -0,0 +1,117 @@
+/*
+ * TPS page arena benchmark
+ *
+ * THREADS threads (10000 by default) run one after the other, each creating a
+ * TPS of PAGES pages (1 by default), writing one byte to every page and
+ * destroying it. The engine is either "mmap", where every TPS is mapped and
+ * unmapped on its own, or "arena" (the default), where pages are recycled by
+ * the page arena. The number of mmap() and munmap() calls and the time spent
+ * per thread in the TPS API are printed as CSV, along with the occupancy of the
+ * arena once all threads are done.
+ *
+ * Usage: tps_arena_bench.x [mmap|arena] [THREADS] [PAGES]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <tps.h>
+
+static size_t nthreads = 10000;
+static size_t npages = 1;
+
+static size_t mmap_calls;
+static size_t munmap_calls;
+static double tps_ns;
+
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fd,
+	off_t off);
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd,
+	off_t off)
+{
+	mmap_calls++;
+	return __real_mmap(addr, len, prot, flags, fd, off);
+}
+
+int __real_munmap(void *addr, size_t len);
+int __wrap_munmap(void *addr, size_t len)
+{
+	munmap_calls++;
+	return __real_munmap(addr, len);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *churn_thread(__attribute__((unused)) void *arg)
+{
+	char byte = 1;
+	double start = now_ns();
+
+	tps_create_sized(npages * TPS_PAGE_SIZE);
+	for (size_t i = 0; i < npages; i++) {
+		tps_write(i * TPS_PAGE_SIZE, 1, &byte);
+	}
+	tps_destroy();
+
+	tps_ns += now_ns() - start;
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *engine = "arena";
+	pthread_t tid;
+
+	if (argc > 1)
+		engine = argv[1];
+	if (argc > 2)
+		nthreads = get_argv(argv[2]);
+	if (argc > 3)
+		npages = get_argv(argv[3]);
+	if (strcmp(engine, "mmap") && strcmp(engine, "arena")) {
+		fprintf(stderr, "invalid engine: %s\n", engine);
+		return 1;
+	}
+
+	tps_init(strcmp(engine, "arena") ? 0 : TPS_ARENA);
+
+	for (size_t t = 0; t < nthreads; t++) {
+		pthread_create(&tid, NULL, churn_thread, NULL);
+		pthread_join(tid, NULL);
+	}
+
+	printf("engine,threads,pages,mmap_calls,munmap_calls,ns_per_thread\n");
+	printf("%s,%zu,%zu,%zu,%zu,%.1f\n", engine, nthreads, npages,
+		mmap_calls, munmap_calls, tps_ns / nthreads);
+
+	struct tps_arena_stats stats;
+
+	if (tps_arena_occupancy(&stats) == 0) {
+		printf("reserved,used,free,low,high\n");
+		printf("%zu,%zu,%zu,%zu,%zu\n", stats.reserved, stats.used,
+			stats.free, stats.low, stats.high);
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * TPS atomic operation benchmark
+ *
+ * A thread with a TPS increments an 8-byte counter held in it OPS times
+ * (1000000 by default). In "rw" mode, the counter is read with tps_read() and
+ * written back with tps_write(). In "atomic" mode (the default), it is
+ * incremented in place with tps_fetch_add(). The average latency of an
+ * increment and the number of mprotect() calls it takes are printed as a line
+ * of CSV.
+ *
+ * Usage: tps_atomic_bench.x [rw|atomic] [OPS]
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tps.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "atomic";
+	size_t nops = 1000000;
+	struct tps_stats before, after;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nops = get_argv(argv[2]);
+	if (strcmp(mode, "rw") && strcmp(mode, "atomic")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	int atomic_mode = !strcmp(mode, "atomic");
+
+	tps_init(0);
+	tps_create();
+	tps_get_stats(&before);
+
+	double start = now_ns();
+	for (size_t op = 0; op < nops; op++) {
+		if (atomic_mode) {
+			tps_fetch_add(0, 8, 1, NULL);
+		} else {
+			uint64_t counter;
+
+			tps_read(0, 8, &counter);
+			counter++;
+			tps_write(0, 8, &counter);
+		}
+	}
+	double elapsed = now_ns() - start;
+	tps_get_stats(&after);
+
+	uint64_t counter;
+	tps_read(0, 8, &counter);
+	if (counter != nops) {
+		fprintf(stderr, "counter is %lu instead of %zu\n",
+			(unsigned long) counter, nops);
+		return 1;
+	}
+
+	printf("mode,ops,op_ns,mprotect_per_op\n");
+	printf("%s,%zu,%.2f,%.2f\n", mode, nops, elapsed / nops,
+		(double) (after.mprotect_calls - before.mprotect_calls) / nops);
+
+	tps_destroy();
+	return 0;
+}
@@ -0,0 +1,516 @@
+/*
+ * TPS microbenchmark suite
+ *
+ * Measures the latency of the basic TPS operations, SAMPLES times each (1000
+ * by default), and prints its distribution as CSV, one line per measurement,
+ * so that runs of two versions of the library can be compared line by line:
+ *
+ * rw: tps_read() and tps_write() of 8 bytes to 16 KB, at the start of a page
+ * and straddling the end of one.
+ *
+ * clone: tps_clone() of a template of 16 pages by 1, 2, 4... up to THREADS
+ * threads (64 by default) at the same time.
+ *
+ * cow: the first write to a page of a clone, which copies it, and the second
+ * one, which doesn't.
+ *
+ * churn: tps_create() and tps_destroy() of a TPS of TPS_SIZE bytes.
+ *
+ * handoff: a TPS of 16 pages filled by one thread is handed to another, which
+ * writes a byte to every page, either by cloning it, the first thread then
+ * destroying its own, or with tps_transfer(). The samples go from the start of
+ * the handoff until both threads are done.
+ *
+ * key: tps_get64() and tps_set64() of an 8-byte slot, and tps_get() and
+ * tps_set() of a 64-byte one, to be compared with the rw lines.
+ *
+ * scale: 1, 2, 4... up to THREADS threads doing SAMPLES operations each on a
+ * TPS of their own, READS percent of them (90 by default) being 64-byte reads
+ * at random offsets and the others 64-byte writes. The throughput of all the
+ * threads together is also given.
+ *
+ * The API is initialized with FLAGS (0 by default), see tps_init(). Every line
+ * gives the benchmark, the operation, the length and offset of the accesses and
+ * the number of threads when they apply, then the number of samples, their
+ * mean, their 50th, 90th and 99th percentiles and their maximum in
+ * nanoseconds, and the throughput in operations per second.
+ *
+ * Usage: tps_bench.x [all|rw|clone|cow|churn|handoff|key|scale] [SAMPLES]
+ *                    [THREADS] [READS] [FLAGS]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tps.h>
+
+#define TEMPLATE_PAGES 16
+#define RW_SIZE (32 * TPS_PAGE_SIZE)
+#define RW_MAX 16384
+#define SCALE_SIZE (16 * TPS_PAGE_SIZE)
+#define SCALE_CHUNK 64
+
+static size_t nsamples = 1000;
+static size_t max_threads = 64;
+static size_t read_pct = 90;
+
+static pthread_t template_tid;
+static pthread_barrier_t start_barrier, end_barrier;
+
+/* Whether the handoff benchmark uses tps_transfer() */
+static int handoff_transfer;
+
+/* First and last time any thread of the scale benchmark was working */
+static uint64_t scale_start, scale_end;
+
+/* Latencies of the current measurement, nsamples per thread */
+static uint64_t *samples;
+static size_t nthreads;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint64_t first = *(const uint64_t *) a;
+	uint64_t second = *(const uint64_t *) b;
+
+	return first < second ? -1 : first > second;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double q)
+{
+	return sorted[(size_t) ((count - 1) * q)];
+}
+
+/* Prints the distribution of count samples, which it sorts. Throughput is
+given for elapsed nanoseconds of wall time if not 0, or derived from the mean
+latency otherwise */
+static void report(const char *bench, const char *op, size_t length,
+	size_t offset, size_t threads, uint64_t *values, size_t count,
+	uint64_t elapsed)
+{
+	double sum = 0;
+
+	qsort(values, count, sizeof(uint64_t), compare_samples);
+	for (size_t i = 0; i < count; i++) {
+		sum += values[i];
+	}
+
+	double mean = sum / count;
+	double throughput = elapsed ? count * 1e9 / elapsed : 1e9 / mean;
+
+	printf("%s,%s,%zu,%zu,%zu,%zu,%.0f,%lu,%lu,%lu,%lu,%.0f\n", bench, op,
+		length, offset, threads, count, mean,
+		(unsigned long) percentile(values, count, 0.5),
+		(unsigned long) percentile(values, count, 0.9),
+		(unsigned long) percentile(values, count, 0.99),
+		(unsigned long) values[count - 1], throughput);
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "%s failed\n", what);
+	exit(1);
+}
+
+static void bench_rw(void)
+{
+	static const size_t lengths[] = { 8, 64, 512, 4096, RW_MAX };
+	char *buffer = calloc(1, RW_MAX);
+
+	if (buffer == NULL || tps_create_sized(RW_SIZE) < 0) {
+		die("rw setup");
+	}
+
+	for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		size_t offsets[] = { TPS_PAGE_SIZE, 2 * TPS_PAGE_SIZE -
+			lengths[l] / 2 };
+
+		for (size_t o = 0; o < 2; o++) {
+			for (int write = 0; write <= 1; write++) {
+				for (size_t n = 0; n < nsamples; n++) {
+					uint64_t start = now_ns();
+					int retval = write ?
+						tps_write(offsets[o],
+						lengths[l], buffer) :
+						tps_read(offsets[o],
+						lengths[l], buffer);
+
+					samples[n] = now_ns() - start;
+					if (retval < 0) {
+						die("rw access");
+					}
+				}
+				report("rw", write ? "write" : "read",
+					lengths[l], offsets[o], 1, samples,
+					nsamples, 0);
+			}
+		}
+	}
+
+	tps_destroy();
+	free(buffer);
+}
+
+/* Fills the template the clone and cow benchmarks clone */
+static void create_template(void)
+{
+	char *buffer = malloc(TEMPLATE_PAGES * TPS_PAGE_SIZE);
+
+	memset(buffer, 't', TEMPLATE_PAGES * TPS_PAGE_SIZE);
+	template_tid = pthread_self();
+	if (tps_create_sized(TEMPLATE_PAGES * TPS_PAGE_SIZE) < 0 ||
+		tps_write(0, TEMPLATE_PAGES * TPS_PAGE_SIZE, buffer) < 0) {
+		die("template");
+	}
+	free(buffer);
+}
+
+/* Every thread clones the template at the same time, as many rounds as needed
+to take nsamples samples in all */
+static void *clone_thread(void *arg)
+{
+	size_t index = (size_t) arg;
+	size_t rounds = (nsamples + nthreads - 1) / nthreads;
+
+	for (size_t round = 0; round < rounds; round++) {
+		pthread_barrier_wait(&start_barrier);
+		uint64_t start = now_ns();
+		if (tps_clone(template_tid) < 0) {
+			die("tps_clone");
+		}
+		samples[round * nthreads + index] = now_ns() - start;
+		pthread_barrier_wait(&end_barrier);
+		tps_destroy();
+	}
+	return NULL;
+}
+
+/* Runs nthreads threads of func until they are all done */
+static void run_threads(void *(*func)(void *))
+{
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+
+	for (size_t i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, func, (void *) i)) {
+			die("pthread_create");
+		}
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	free(tids);
+}
+
+static void bench_clone(void)
+{
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		size_t count = (nsamples + nthreads - 1) / nthreads * nthreads;
+
+		pthread_barrier_init(&start_barrier, NULL, nthreads);
+		pthread_barrier_init(&end_barrier, NULL, nthreads);
+		run_threads(clone_thread);
+		report("clone", "clone", TEMPLATE_PAGES * TPS_PAGE_SIZE, 0,
+			nthreads, samples, count, 0);
+		pthread_barrier_destroy(&start_barrier);
+		pthread_barrier_destroy(&end_barrier);
+	}
+}
+
+static void *cow_thread(__attribute__((unused)) void *arg)
+{
+	uint64_t *second = samples + nsamples;
+	char byte = 'c';
+
+	for (size_t n = 0; n < nsamples; n++) {
+		size_t offset = n % TEMPLATE_PAGES * TPS_PAGE_SIZE;
+
+		if (tps_clone(template_tid) < 0) {
+			die("tps_clone");
+		}
+		uint64_t start = now_ns();
+		tps_write(offset, 1, &byte);
+		uint64_t middle = now_ns();
+		tps_write(offset + 1, 1, &byte);
+		samples[n] = middle - start;
+		second[n] = now_ns() - middle;
+		tps_destroy();
+	}
+	return NULL;
+}
+
+static void bench_cow(void)
+{
+	nthreads = 1;
+	run_threads(cow_thread);
+	report("cow", "first_write", 1, 0, 1, samples, nsamples, 0);
+	report("cow", "second_write", 1, 0, 1, samples + nsamples, nsamples,
+		0);
+}
+
+static void bench_churn(void)
+{
+	uint64_t *destroys = samples + nsamples;
+
+	for (size_t n = 0; n < nsamples; n++) {
+		uint64_t start = now_ns();
+		if (tps_create() < 0) {
+			die("tps_create");
+		}
+		uint64_t middle = now_ns();
+		tps_destroy();
+		samples[n] = middle - start;
+		destroys[n] = now_ns() - middle;
+	}
+	report("churn", "create", TPS_SIZE, 0, 1, samples, nsamples, 0);
+	report("churn", "destroy", TPS_SIZE, 0, 1, destroys, nsamples, 0);
+}
+
+/* Receives the TPS of the main thread, which is only done with it once the
+writes are over. The TPS received is destroyed before the next one comes */
+static void *handoff_thread(__attribute__((unused)) void *arg)
+{
+	char byte = 'h';
+
+	for (size_t n = 0; n < nsamples; n++) {
+		pthread_barrier_wait(&start_barrier);
+		if (!handoff_transfer && tps_clone(template_tid) < 0) {
+			die("tps_clone");
+		}
+		for (size_t i = 0; i < TEMPLATE_PAGES; i++) {
+			if (tps_write(i * TPS_PAGE_SIZE, 1, &byte) < 0) {
+				die("handoff write");
+			}
+		}
+		tps_destroy();
+		pthread_barrier_wait(&end_barrier);
+	}
+	return NULL;
+}
+
+static void bench_handoff(void)
+{
+	pthread_t tid;
+
+	pthread_barrier_init(&start_barrier, NULL, 2);
+	pthread_barrier_init(&end_barrier, NULL, 2);
+	for (handoff_transfer = 0; handoff_transfer <= 1; handoff_transfer++) {
+		if (pthread_create(&tid, NULL, handoff_thread, NULL)) {
+			die("pthread_create");
+		}
+		for (size_t n = 0; n < nsamples; n++) {
+			create_template();
+			uint64_t start = now_ns();
+			if (handoff_transfer && tps_transfer(tid) < 0) {
+				die("tps_transfer");
+			}
+			pthread_barrier_wait(&start_barrier);
+			pthread_barrier_wait(&end_barrier);
+			if (!handoff_transfer) {
+				tps_destroy();
+			}
+			samples[n] = now_ns() - start;
+		}
+		pthread_join(tid, NULL);
+		report("handoff", handoff_transfer ? "transfer" : "clone",
+			TEMPLATE_PAGES * TPS_PAGE_SIZE, 0, 2, samples,
+			nsamples, 0);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&end_barrier);
+}
+
+static void bench_key(void)
+{
+	static const char *ops[] = { "get64", "set64", "get", "set" };
+	ssize_t word_key = tps_key_create(8, 8);
+	ssize_t text_key = tps_key_create(64, 64);
+	char buffer[64] = { 0 };
+	uint64_t value = 0;
+
+	if (word_key < 0 || text_key < 0 || tps_create() < 0) {
+		die("key setup");
+	}
+
+	for (int op = 0; op < 4; op++) {
+		for (size_t n = 0; n < nsamples; n++) {
+			uint64_t start = now_ns();
+			int retval;
+
+			switch (op) {
+			case 0:
+				retval = tps_get64(word_key, &value);
+				break;
+			case 1:
+				retval = tps_set64(word_key, n);
+				break;
+			case 2:
+				retval = tps_get(text_key, buffer);
+				break;
+			default:
+				retval = tps_set(text_key, buffer);
+			}
+			samples[n] = now_ns() - start;
+			if (retval < 0) {
+				die("key access");
+			}
+		}
+		report("key", ops[op], op < 2 ? 8 : 64, op < 2 ? word_key :
+			text_key, 1, samples, nsamples, 0);
+	}
+
+	tps_destroy();
+}
+
+static void *scale_thread(void *arg)
+{
+	uint64_t *latencies = samples + (size_t) arg * nsamples;
+	unsigned int seed = (size_t) arg + 1;
+	char buffer[SCALE_CHUNK] = { 0 };
+
+	if (tps_create_sized(SCALE_SIZE) < 0) {
+		die("tps_create_sized");
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	uint64_t first = now_ns();
+	for (size_t n = 0; n < nsamples; n++) {
+		size_t offset = rand_r(&seed) % (SCALE_SIZE - SCALE_CHUNK);
+		int read = (size_t) (rand_r(&seed) % 100) < read_pct;
+		uint64_t start = now_ns();
+
+		if (read) {
+			tps_read(offset, SCALE_CHUNK, buffer);
+		} else {
+			tps_write(offset, SCALE_CHUNK, buffer);
+		}
+		latencies[n] = now_ns() - start;
+	}
+	uint64_t last = now_ns();
+
+	/* The threads don't all start at once on fewer CPUs than threads */
+	uint64_t seen = __atomic_load_n(&scale_start, __ATOMIC_RELAXED);
+	while ((seen == 0 || first < seen) &&
+		!__atomic_compare_exchange_n(&scale_start, &seen, first, 0,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+	seen = __atomic_load_n(&scale_end, __ATOMIC_RELAXED);
+	while (last > seen && !__atomic_compare_exchange_n(&scale_end, &seen,
+		last, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	tps_destroy();
+	return NULL;
+}
+
+static void bench_scale(void)
+{
+	char op[32];
+
+	snprintf(op, sizeof(op), "mix%zu", read_pct);
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		/* The threads time themselves once they are all set up */
+		scale_start = 0;
+		scale_end = 0;
+		pthread_barrier_init(&start_barrier, NULL, nthreads);
+		run_threads(scale_thread);
+		report("scale", op, SCALE_CHUNK, 0, nthreads, samples,
+			nthreads * nsamples, scale_end - scale_start);
+		pthread_barrier_destroy(&start_barrier);
+	}
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *suite = "all";
+	int flags = 0;
+
+	if (argc > 1)
+		suite = argv[1];
+	if (argc > 2)
+		nsamples = get_argv(argv[2]);
+	if (argc > 3)
+		max_threads = get_argv(argv[3]);
+	if (argc > 4)
+		read_pct = strtol(argv[4], NULL, 0);
+	if (argc > 5)
+		flags = strtol(argv[5], NULL, 0);
+	if (strcmp(suite, "all") && strcmp(suite, "rw") &&
+		strcmp(suite, "clone") && strcmp(suite, "cow") &&
+		strcmp(suite, "churn") && strcmp(suite, "handoff") &&
+		strcmp(suite, "key") &&
+		strcmp(suite, "scale")) {
+		fprintf(stderr, "invalid suite: %s\n", suite);
+		return 1;
+	}
+	if (read_pct > 100) {
+		fprintf(stderr, "invalid argument: %s\n", argv[4]);
+		return 1;
+	}
+
+	/* Enough room for the samples of all the threads of the scale
+	benchmark, with a clone round of every thread on top, and for the two
+	series of the cow and churn benchmarks */
+	size_t nslots = (nsamples + max_threads) * max_threads;
+	if (nslots < 2 * nsamples) {
+		nslots = 2 * nsamples;
+	}
+	samples = malloc(nslots * sizeof(uint64_t));
+	if (samples == NULL || tps_init(flags) < 0) {
+		die("setup");
+	}
+
+	int all = !strcmp(suite, "all");
+	printf("bench,op,length,offset,threads,samples,mean_ns,p50_ns,p90_ns,"
+		"p99_ns,max_ns,ops_per_sec\n");
+	if (all || !strcmp(suite, "rw")) {
+		bench_rw();
+	}
+	if (all || !strcmp(suite, "clone") || !strcmp(suite, "cow")) {
+		create_template();
+		if (all || !strcmp(suite, "clone")) {
+			bench_clone();
+		}
+		if (all || !strcmp(suite, "cow")) {
+			bench_cow();
+		}
+		tps_destroy();
+	}
+	if (all || !strcmp(suite, "churn")) {
+		bench_churn();
+	}
+	if (all || !strcmp(suite, "handoff")) {
+		bench_handoff();
+	}
+	if (all || !strcmp(suite, "key")) {
+		bench_key();
+	}
+	if (all || !strcmp(suite, "scale")) {
+		bench_scale();
+	}
+
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * TPS thread churn benchmark
+ *
+ * ROUNDS rounds (200 by default) each start THREADS threads (64 by default)
+ * which create a TPS of PAGES pages (4 by default), write to all of it and
+ * exit. In "exit" mode (the default), the threads exit without destroying
+ * their TPS, which is then reclaimed by the library. In "destroy" mode, they
+ * call tps_destroy() first. The number of TPS's still alive at the end, the
+ * munmap() calls made per thread, the average lifetime of a thread and the
+ * resident set size after the first and the last round are printed as a line
+ * of CSV. A leak shows as live TPS's and as a growing resident set size.
+ *
+ * Usage: tps_churn_bench.x [exit|destroy] [ROUNDS] [THREADS] [PAGES]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+
+static size_t nrounds = 200;
+static size_t nthreads = 64;
+static size_t npages = 4;
+static int destroy_mode = 0;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Resident set size in kB, taken from /proc */
+static long rss_kb(void)
+{
+	long size, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *churn_thread(void *arg)
+{
+	if (tps_create_sized(npages * TPS_PAGE_SIZE) < 0 ||
+		tps_write(0, npages * TPS_PAGE_SIZE, arg) < 0) {
+		fprintf(stderr, "tps_create_sized failed\n");
+		exit(1);
+	}
+	if (destroy_mode) {
+		tps_destroy();
+	}
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "exit";
+	struct tps_stats before, after;
+	long rss_first = 0;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nrounds = get_argv(argv[2]);
+	if (argc > 3)
+		nthreads = get_argv(argv[3]);
+	if (argc > 4)
+		npages = get_argv(argv[4]);
+	if (strcmp(mode, "exit") && strcmp(mode, "destroy")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	destroy_mode = !strcmp(mode, "destroy");
+
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+	char *buffer = malloc(npages * TPS_PAGE_SIZE);
+
+	memset(buffer, 'c', npages * TPS_PAGE_SIZE);
+	tps_init(0);
+	tps_get_stats(&before);
+
+	double start = now_ns();
+	for (size_t round = 0; round < nrounds; round++) {
+		for (size_t i = 0; i < nthreads; i++) {
+			pthread_create(&tids[i], NULL, churn_thread, buffer);
+		}
+		for (size_t i = 0; i < nthreads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		if (round == 0) {
+			rss_first = rss_kb();
+		}
+	}
+	double elapsed = now_ns() - start;
+	tps_get_stats(&after);
+
+	printf("mode,rounds,threads,pages,live_tps,munmap_per_thread,"
+		"thread_us,rss_first_kb,rss_last_kb\n");
+	printf("%s,%zu,%zu,%zu,%zu,%.2f,%.2f,%ld,%ld\n", mode, nrounds,
+		nthreads, npages, after.live_tps, (double) (after.munmap_calls -
+		before.munmap_calls) / (nrounds * nthreads), elapsed /
+		(nrounds * nthreads) / 1e3, rss_first, rss_kb());
+
+	free(tids);
+	free(buffer);
+	return after.live_tps != 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * TPS clone benchmark
+ *
+ * A template thread fills a TPS of PAGES pages (64 by default), which CLONES
+ * threads (64 by default) then clone one after the other, each writing one
+ * byte to WRITES of the cloned pages (1 by default). The average latency of
+ * tps_clone() and of the writes, along with the growth of the resident set
+ * size, is printed as a line of CSV.
+ *
+ * The first argument selects the copy-on-write engine: "anon" for the default
+ * reference counted pages, or "memfd" for TPS_MEMFD.
+ *
+ * Usage: tps_clone_bench.x [anon|memfd] [CLONES] [PAGES] [WRITES]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sem.h>
+#include <tps.h>
+
+static size_t nclones = 64;
+static size_t npages = 64;
+static size_t nwrites = 1;
+
+static pthread_t template_tid;
+static sem_t ready, release;
+static double clone_ns, write_ns;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Resident set size in kB, taken from /proc */
+static long rss_kb(void)
+{
+	long size, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *template_thread(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(npages * TPS_PAGE_SIZE);
+
+	memset(buffer, 'a', npages * TPS_PAGE_SIZE);
+	tps_create_sized(npages * TPS_PAGE_SIZE);
+	tps_write(0, npages * TPS_PAGE_SIZE, buffer);
+	free(buffer);
+
+	sem_up(ready);
+	sem_down(release);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *clone_thread(__attribute__((unused)) void *arg)
+{
+	char byte = 'b';
+	double start = now_ns();
+
+	if (tps_clone(template_tid) < 0) {
+		fprintf(stderr, "tps_clone failed\n");
+		exit(1);
+	}
+	clone_ns += now_ns() - start;
+
+	start = now_ns();
+	for (size_t i = 0; i < nwrites; i++) {
+		tps_write(i * TPS_PAGE_SIZE, 1, &byte);
+	}
+	write_ns += now_ns() - start;
+
+	/* Stays alive until every clone is done, so that RSS can be measured */
+	sem_up(ready);
+	sem_down(release);
+
+	tps_destroy();
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int memfd = argc > 1 && !strcmp(argv[1], "memfd");
+
+	if (argc > 2)
+		nclones = get_argv(argv[2]);
+	if (argc > 3)
+		npages = get_argv(argv[3]);
+	if (argc > 4)
+		nwrites = get_argv(argv[4]);
+	if (nwrites > npages)
+		nwrites = npages;
+
+	pthread_t *tids = malloc(nclones * sizeof(pthread_t));
+
+	ready = sem_create(0);
+	release = sem_create(0);
+	if (tps_init(memfd ? TPS_MEMFD : 0) < 0) {
+		fprintf(stderr, "tps_init failed\n");
+		return 1;
+	}
+
+	pthread_create(&template_tid, NULL, template_thread, NULL);
+	sem_down(ready);
+
+	/* Clones are made one at a time to measure the operations alone */
+	long rss_before = rss_kb();
+	for (size_t i = 0; i < nclones; i++) {
+		pthread_create(&tids[i], NULL, clone_thread, NULL);
+		sem_down(ready);
+	}
+	long rss_after = rss_kb();
+
+	for (size_t i = 0; i <= nclones; i++) {
+		sem_up(release);
+	}
+	for (size_t i = 0; i < nclones; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	pthread_join(template_tid, NULL);
+
+	printf("engine,clones,pages,writes,clone_us,write_us,rss_growth_kb\n");
+	printf("%s,%zu,%zu,%zu,%.2f,%.2f,%ld\n", memfd ? "memfd" : "anon",
+		nclones, npages, nwrites, clone_ns / nclones / 1e3,
+		write_ns / nclones / 1e3, rss_after - rss_before);
+
+	sem_destroy(ready);
+	sem_destroy(release);
+	free(tids);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * TPS compaction benchmark
+ *
+ * A template thread fills a TPS of PAGES pages (256 by default), which CLONES
+ * threads (32 by default) clone and then overwrite with the same content,
+ * giving every clone private copies identical to the template's pages. The
+ * main thread then calls tps_compact() with a budget of BUDGET microseconds
+ * (200 by default) until every copy is merged, or until it has made 100 calls
+ * per page. The number of pages merged, the number of calls, the longest call
+ * and the resident set size before and after are printed as a line of CSV.
+ *
+ * Usage: tps_compact_bench.x [CLONES] [PAGES] [BUDGET]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sem.h>
+#include <tps.h>
+
+static size_t nclones = 32;
+static size_t npages = 256;
+static size_t budget_us = 200;
+
+static pthread_t template_tid;
+static sem_t ready, release;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Resident set size in kB, taken from /proc */
+static long rss_kb(void)
+{
+	long size, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void fill(char *buffer)
+{
+	for (size_t i = 0; i < npages * TPS_PAGE_SIZE; i++) {
+		buffer[i] = i / TPS_PAGE_SIZE + i % 251;
+	}
+}
+
+static void *template_thread(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(npages * TPS_PAGE_SIZE);
+
+	fill(buffer);
+	tps_create_sized(npages * TPS_PAGE_SIZE);
+	tps_write(0, npages * TPS_PAGE_SIZE, buffer);
+	free(buffer);
+
+	sem_up(ready);
+	sem_down(release);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *clone_thread(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(npages * TPS_PAGE_SIZE);
+
+	fill(buffer);
+	if (tps_clone(template_tid) < 0) {
+		fprintf(stderr, "tps_clone failed\n");
+		exit(1);
+	}
+	tps_write(0, npages * TPS_PAGE_SIZE, buffer);
+
+	sem_up(ready);
+	sem_down(release);
+
+	/* Merged pages must still read the same */
+	char *check = malloc(npages * TPS_PAGE_SIZE);
+	tps_read(0, npages * TPS_PAGE_SIZE, check);
+	if (memcmp(buffer, check, npages * TPS_PAGE_SIZE)) {
+		fprintf(stderr, "content changed by compaction\n");
+		exit(1);
+	}
+
+	tps_destroy();
+	free(buffer);
+	free(check);
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		nclones = get_argv(argv[1]);
+	if (argc > 2)
+		npages = get_argv(argv[2]);
+	if (argc > 3)
+		budget_us = get_argv(argv[3]);
+
+	pthread_t *tids = malloc(nclones * sizeof(pthread_t));
+
+	ready = sem_create(0);
+	release = sem_create(0);
+	tps_init(0);
+
+	pthread_create(&template_tid, NULL, template_thread, NULL);
+	sem_down(ready);
+	for (size_t i = 0; i < nclones; i++) {
+		pthread_create(&tids[i], NULL, clone_thread, NULL);
+		sem_down(ready);
+	}
+
+	long rss_before = rss_kb();
+	ssize_t merged = 0;
+	double max_pause = 0;
+	size_t calls = 0;
+	for (; (size_t) merged < nclones * npages && calls < 100 * npages;
+		calls++) {
+		double start = now_ns();
+
+		merged += tps_compact(budget_us);
+		if (now_ns() - start > max_pause) {
+			max_pause = now_ns() - start;
+		}
+	}
+	long rss_after = rss_kb();
+
+	for (size_t i = 0; i <= nclones; i++) {
+		sem_up(release);
+	}
+	for (size_t i = 0; i < nclones; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	pthread_join(template_tid, NULL);
+
+	printf("clones,pages,budget_us,merged,calls,max_pause_us,rss_before_kb,"
+		"rss_after_kb\n");
+	printf("%zu,%zu,%zu,%zd,%zu,%.2f,%ld,%ld\n", nclones, npages,
+		budget_us, merged, calls, max_pause / 1e3, rss_before,
+		rss_after);
+
+	sem_destroy(ready);
+	sem_destroy(release);
+	free(tids);
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * TPS fault recording benchmark
+ *
+ * The TPS API is initialized with TPS_FAULTS, over a SIGSEGV handler of our own
+ * which recovers from faults with siglongjmp(). THREADS threads (4 by default)
+ * each make FAULTS invalid accesses (10000 by default) to their own TPS,
+ * alternately reading and writing. The records of the last faults are then
+ * checked against the accesses made, and dumped to a temporary file whose lines
+ * are counted. The average time taken by a fault, recovery included, and the
+ * number of faults recorded and dumped are printed as a line of CSV.
+ *
+ * Usage: tps_fault_bench.x [THREADS] [FAULTS]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+
+static size_t nthreads = 4;
+static size_t nfaults = 10000;
+
+static __thread sigjmp_buf recovery;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void recover(__attribute__((unused)) int sig)
+{
+	siglongjmp(recovery, 1);
+}
+
+static void *fault_thread(__attribute__((unused)) void *arg)
+{
+	tps_create();
+	volatile char *area = tps_map(TPS_MAP_READ);
+	tps_unmap();
+
+	/* n must keep its value across siglongjmp() */
+	for (volatile size_t n = 0; n < nfaults; n++) {
+		if (sigsetjmp(recovery, 1) == 0) {
+			if (n % 2) {
+				area[n % TPS_SIZE] = 1;
+			} else {
+				(void) area[n % TPS_SIZE];
+			}
+		}
+	}
+
+	/* The last fault recorded is checked if it is ours, as the other threads
+	keep faulting */
+	struct tps_fault fault;
+	size_t last = nfaults - 1;
+	if (tps_faults(&fault, 1) == 1 && fault.tid == pthread_self() &&
+		(fault.owner != pthread_self() || fault.offset != (ssize_t) (last %
+		TPS_SIZE) || fault.access == (last % 2 ? TPS_FAULT_READ :
+		TPS_FAULT_WRITE))) {
+		fprintf(stderr, "wrong record\n");
+		exit(1);
+	}
+
+	tps_destroy();
+	return NULL;
+}
+
+/* Counts the lines written by tps_fault_dump() */
+static size_t dump_lines(void)
+{
+	FILE *dump = tmpfile();
+	size_t lines = 0;
+	int c;
+
+	if (dump == NULL || tps_fault_dump(fileno(dump)) < 0) {
+		fprintf(stderr, "tps_fault_dump failed\n");
+		exit(1);
+	}
+	rewind(dump);
+	while ((c = fgetc(dump)) != EOF) {
+		lines += c == '\n';
+	}
+	fclose(dump);
+	return lines;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+	if (argc > 2)
+		nfaults = get_argv(argv[2]);
+
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+	struct tps_fault *faults = malloc(TPS_FAULT_RING *
+		sizeof(struct tps_fault));
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = recover;
+	sigaction(SIGSEGV, &sa, NULL);
+	tps_init(TPS_FAULTS);
+
+	double start = now_ns();
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&tids[i], NULL, fault_thread, NULL);
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	double elapsed = now_ns() - start;
+
+	ssize_t recorded = tps_faults(faults, TPS_FAULT_RING);
+	size_t expected = nthreads * nfaults < TPS_FAULT_RING ?
+		nthreads * nfaults : TPS_FAULT_RING;
+	size_t dumped = dump_lines();
+	if (recorded != (ssize_t) expected || dumped != expected) {
+		fprintf(stderr, "%zd faults recorded, %zu dumped\n", recorded,
+			dumped);
+		return 1;
+	}
+
+	printf("threads,faults,fault_us,recorded,dumped\n");
+	printf("%zu,%zu,%.2f,%zd,%zu\n", nthreads, nfaults,
+		elapsed / (nthreads * nfaults) / 1e3, recorded, dumped);
+
+	free(tids);
+	free(faults);
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * TPS huge page benchmark
+ *
+ * A thread creates a TPS of SIZE megabytes (8 by default) and fills it with a
+ * single tps_write(). It then maps it with tps_map() and makes OPS accesses
+ * (1000000 by default) of 8 bytes at random offsets through the returned
+ * pointer, which is where huge pages spare TLB misses. Last, it writes a single
+ * byte with tps_write(), which splits the huge page holding it.
+ *
+ * In "huge" mode the API is initialized with TPS_HUGE, in "4k" mode (the
+ * default) without it. The time taken by the fill and by an access are printed
+ * as a line of CSV, along with the number of kB of the TPS backed by huge pages
+ * after the fill and after the last write (always 0 in "4k" mode).
+ *
+ * Usage: tps_huge_bench.x [4k|huge] [SIZE] [OPS]
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tps.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+static size_t huge_kb(void)
+{
+	struct tps_huge_stats stats;
+
+	if (tps_huge_stats(&stats) < 0) {
+		return 0;
+	}
+	return stats.huge_bytes / 1024;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "4k";
+	size_t size = 8;
+	size_t nops = 1000000;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		size = get_argv(argv[2]);
+	if (argc > 3)
+		nops = get_argv(argv[3]);
+	if (strcmp(mode, "4k") && strcmp(mode, "huge")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+
+	size_t bytes = size * 1024 * 1024;
+	char *buffer = malloc(bytes);
+
+	if (buffer == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", bytes);
+		return 1;
+	}
+	memset(buffer, 'a', bytes);
+	tps_init(strcmp(mode, "huge") ? 0 : TPS_HUGE);
+	if (tps_create_sized(bytes) < 0) {
+		fprintf(stderr, "tps_create_sized failed\n");
+		return 1;
+	}
+
+	double start = now_ns();
+	tps_write(0, bytes, buffer);
+	double fill_ns = now_ns() - start;
+	size_t filled_kb = huge_kb();
+
+	/* A simple xorshift generator keeps the offsets unpredictable */
+	char *tps_addr = tps_map(TPS_MAP_READ);
+	if (tps_addr == NULL) {
+		fprintf(stderr, "tps_map failed\n");
+		return 1;
+	}
+	uint64_t state = 88172645463325252ULL;
+	uint64_t sum = 0;
+
+	start = now_ns();
+	for (size_t op = 0; op < nops; op++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		sum += *(uint64_t *) (tps_addr + (state % (bytes / 8)) * 8);
+	}
+	double access_ns = (now_ns() - start) / nops;
+	tps_unmap();
+
+	tps_write(0, 1, buffer);
+	size_t split_kb = huge_kb();
+
+	printf("mode,size_mb,fill_ms,access_ns,huge_kb_filled,huge_kb_split\n");
+	printf("%s,%zu,%.2f,%.2f,%zu,%zu\n", mode, size, fill_ns / 1e6,
+		access_ns, filled_kb, split_kb);
+
+	tps_destroy();
+	free(buffer);
+	return sum == 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * TPS monitoring benchmark
+ *
+ * WORKERS threads (8 by default) each keep writing 64 bytes of state to their
+ * own TPS for MS milliseconds (1000 by default). In "read_from" mode (the
+ * default), a monitor thread meanwhile scrapes the state of every worker over
+ * and over with tps_read_from(), checking that it is never torn. In "none"
+ * mode, nobody scrapes the workers. The write throughput of the workers and
+ * the number of states scraped per second are printed as a line of CSV.
+ *
+ * Usage: tps_monitor_bench.x [none|read_from] [WORKERS] [MS]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sem.h>
+#include <tps.h>
+
+#define STATE_SIZE 64
+
+static size_t nworkers = 8;
+static size_t duration_ms = 1000;
+
+static pthread_t *tids;
+static size_t *nwrites;
+static sem_t ready;
+static volatile int stop = 0;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker_thread(void *arg)
+{
+	size_t id = (size_t) arg;
+	char state[STATE_SIZE];
+	size_t n = 0;
+
+	tps_create();
+	memset(state, 0, STATE_SIZE);
+	tps_write(0, STATE_SIZE, state);
+	sem_up(ready);
+
+	while (!stop) {
+		memset(state, n++ % 128, STATE_SIZE);
+		tps_write(0, STATE_SIZE, state);
+	}
+
+	nwrites[id] = n;
+	tps_destroy();
+	return NULL;
+}
+
+/* Every byte of a state is written with the same value */
+static int torn(const char *state)
+{
+	for (size_t i = 1; i < STATE_SIZE; i++) {
+		if (state[i] != state[0]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *monitor_thread(void *arg)
+{
+	size_t *nscrapes = arg;
+	char state[STATE_SIZE];
+
+	while (!stop) {
+		for (size_t i = 0; i < nworkers; i++) {
+			if (tps_read_from(tids[i], 0, STATE_SIZE, state) < 0) {
+				continue;
+			}
+			if (torn(state)) {
+				fprintf(stderr, "torn state\n");
+				exit(1);
+			}
+			(*nscrapes)++;
+		}
+	}
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "read_from";
+	pthread_t monitor;
+	size_t nscrapes = 0;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nworkers = get_argv(argv[2]);
+	if (argc > 3)
+		duration_ms = get_argv(argv[3]);
+	if (strcmp(mode, "none") && strcmp(mode, "read_from")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	int monitor_mode = !strcmp(mode, "read_from");
+
+	tids = malloc(nworkers * sizeof(pthread_t));
+	nwrites = calloc(nworkers, sizeof(size_t));
+	ready = sem_create(0);
+	tps_init(0);
+
+	for (size_t i = 0; i < nworkers; i++) {
+		pthread_create(&tids[i], NULL, worker_thread, (void *) i);
+		sem_down(ready);
+	}
+	if (monitor_mode) {
+		pthread_create(&monitor, NULL, monitor_thread, &nscrapes);
+	}
+
+	double start = now_ns();
+	struct timespec duration = { duration_ms / 1000,
+		duration_ms % 1000 * 1000000 };
+	nanosleep(&duration, NULL);
+	stop = 1;
+
+	size_t total = 0;
+	for (size_t i = 0; i < nworkers; i++) {
+		pthread_join(tids[i], NULL);
+		total += nwrites[i];
+	}
+	if (monitor_mode) {
+		pthread_join(monitor, NULL);
+	}
+	double elapsed_s = (now_ns() - start) / 1e9;
+
+	printf("mode,workers,writes_per_s,scrapes_per_s\n");
+	printf("%s,%zu,%.0f,%.0f\n", mode, nworkers, total / elapsed_s,
+		nscrapes / elapsed_s);
+
+	sem_destroy(ready);
+	free(tids);
+	free(nwrites);
+	return 0;
+}
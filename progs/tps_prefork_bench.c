@@ -0,0 +1,190 @@
+/*
+ * TPS prefork sharing benchmark
+ *
+ * The parent process fills a TPS of PAGES pages (1024 by default) with a
+ * read-mostly table, exports it with tps_export() and forks CHILDREN processes
+ * (8 by default) which all need the table in a TPS of their own. In "copy"
+ * mode, every child reads the exported file into a buffer and writes it to a
+ * new TPS. In "import" mode (the default), every child maps it with
+ * tps_import(). Each child then reads its whole TPS and, once all of them are
+ * ready, measures its proportional set size, in which pages shared with the
+ * other processes only count for their share. The average time a child takes
+ * to get its TPS and its average proportional set size are printed as a line
+ * of CSV.
+ *
+ * Usage: tps_prefork_bench.x [copy|import] [CHILDREN] [PAGES]
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+
+static size_t nchildren = 8;
+static size_t npages = 1024;
+static int import_mode = 1;
+
+/* A child reports how it went through the result pipe */
+struct result {
+	double setup_ns;
+	long pss_kb;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Proportional set size in kB, taken from /proc */
+static long pss_kb(void)
+{
+	char line[256];
+	long pss = 0;
+	FILE *rollup = fopen("/proc/self/smaps_rollup", "r");
+
+	if (rollup == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), rollup) != NULL) {
+		if (sscanf(line, "Pss: %ld kB", &pss) == 1) {
+			break;
+		}
+	}
+	fclose(rollup);
+	return pss;
+}
+
+static void run_child(int fd, int ready, int go, int results)
+{
+	size_t size = npages * TPS_PAGE_SIZE;
+	char *buffer = malloc(size);
+	struct result result;
+	char byte = 0;
+
+	double start = now_ns();
+	if (import_mode) {
+		if (tps_import(fd) < 0) {
+			fprintf(stderr, "tps_import failed\n");
+			exit(1);
+		}
+	} else if (pread(fd, buffer, size, 0) != (ssize_t) size ||
+		tps_create_sized(size) < 0 || tps_write(0, size, buffer) < 0) {
+		fprintf(stderr, "copy failed\n");
+		exit(1);
+	}
+	result.setup_ns = now_ns() - start;
+
+	tps_read(0, size, buffer);
+	for (size_t i = 0; i < size; i++) {
+		if (buffer[i] != (char) (i / TPS_PAGE_SIZE + i % 251)) {
+			fprintf(stderr, "wrong table\n");
+			exit(1);
+		}
+	}
+
+	/* The buffer is not part of what is measured */
+	free(buffer);
+	if (write(ready, &byte, 1) != 1 || read(go, &byte, 1) != 0) {
+		exit(1);
+	}
+	result.pss_kb = pss_kb();
+	if (write(results, &result, sizeof(result)) != sizeof(result)) {
+		exit(1);
+	}
+
+	tps_destroy();
+	exit(0);
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "import";
+	int ready[2], go[2], results[2];
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nchildren = get_argv(argv[2]);
+	if (argc > 3)
+		npages = get_argv(argv[3]);
+	if (strcmp(mode, "copy") && strcmp(mode, "import")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	import_mode = !strcmp(mode, "import");
+
+	size_t size = npages * TPS_PAGE_SIZE;
+	char *buffer = malloc(size);
+	for (size_t i = 0; i < size; i++) {
+		buffer[i] = i / TPS_PAGE_SIZE + i % 251;
+	}
+
+	tps_init(0);
+	tps_create_sized(size);
+	tps_write(0, size, buffer);
+	int fd = tps_export();
+	tps_destroy();
+	free(buffer);
+	if (fd < 0 || pipe(ready) < 0 || pipe(go) < 0 || pipe(results) < 0) {
+		fprintf(stderr, "tps_export failed\n");
+		return 1;
+	}
+
+	for (size_t k = 0; k < nchildren; k++) {
+		if (fork() == 0) {
+			close(go[1]);
+			run_child(fd, ready[1], go[0], results[1]);
+		}
+	}
+
+	/* Lets the children measure themselves once they are all ready */
+	char byte;
+	for (size_t k = 0; k < nchildren; k++) {
+		if (read(ready[0], &byte, 1) != 1) {
+			fprintf(stderr, "child failed\n");
+			return 1;
+		}
+	}
+	close(go[1]);
+
+	double setup_ns = 0;
+	long pss = 0;
+	for (size_t k = 0; k < nchildren; k++) {
+		struct result result;
+
+		if (read(results[0], &result, sizeof(result)) !=
+			sizeof(result)) {
+			fprintf(stderr, "child failed\n");
+			return 1;
+		}
+		setup_ns += result.setup_ns;
+		pss += result.pss_kb;
+	}
+	while (wait(NULL) > 0) {
+	}
+
+	printf("mode,children,pages,setup_us,pss_kb\n");
+	printf("%s,%zu,%zu,%.2f,%ld\n", mode, nchildren, npages,
+		setup_ns / nchildren / 1e3, pss / (long) nchildren);
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * TPS protection level benchmark
+ *
+ * The TPS API is initialized with the given protection level: TPS_STRICT with
+ * "strict" (the default), TPS_DEFERRED with "deferred" or TPS_GUARD_ONLY with
+ * "guard". A thread then makes OPS writes (100000 by default) of LENGTH bytes
+ * (64 by default) to its TPS of PAGES pages (4 by default), walking through
+ * all of them, followed by as many reads. Every BLOCK accesses (64 by default),
+ * the thread goes through a semaphore, which closes the pages TPS_DEFERRED
+ * left open. The average time taken by a write and by a read, the number of
+ * mprotect() calls made per access, and the level reported by tps_get_stats()
+ * are printed as a line of CSV.
+ *
+ * Usage: tps_protect_bench.x [strict|deferred|guard] [OPS] [LENGTH] [PAGES]
+ *	[BLOCK]
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sem.h>
+#include <tps.h>
+
+static size_t nops = 100000;
+static size_t length = 64;
+static size_t npages = 4;
+static size_t block = 64;
+
+static sem_t sem;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t mprotect_calls(void)
+{
+	struct tps_stats stats;
+
+	tps_get_stats(&stats);
+	return stats.mprotect_calls;
+}
+
+/* Makes nops accesses, going through the semaphore every block of them */
+static double run(int write, char *buffer)
+{
+	size_t size = npages * TPS_PAGE_SIZE;
+
+	double start = now_ns();
+	for (size_t n = 0; n < nops; n++) {
+		size_t offset = n * length % (size - length + 1);
+		int retval = write ? tps_write(offset, length, buffer) :
+			tps_read(offset, length, buffer);
+
+		if (retval < 0) {
+			fprintf(stderr, "access failed\n");
+			exit(1);
+		}
+		if ((n + 1) % block == 0) {
+			sem_up(sem);
+			sem_down(sem);
+		}
+	}
+	return now_ns() - start;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *level = "strict";
+	int flags = TPS_STRICT;
+
+	if (argc > 1)
+		level = argv[1];
+	if (argc > 2)
+		nops = get_argv(argv[2]);
+	if (argc > 3)
+		length = get_argv(argv[3]);
+	if (argc > 4)
+		npages = get_argv(argv[4]);
+	if (argc > 5)
+		block = get_argv(argv[5]);
+	if (!strcmp(level, "deferred")) {
+		flags = TPS_DEFERRED;
+	} else if (!strcmp(level, "guard")) {
+		flags = TPS_GUARD_ONLY;
+	} else if (strcmp(level, "strict")) {
+		fprintf(stderr, "invalid level: %s\n", level);
+		return 1;
+	}
+	if (length > npages * TPS_PAGE_SIZE) {
+		fprintf(stderr, "invalid length: %zu\n", length);
+		return 1;
+	}
+
+	char *buffer = malloc(length);
+	memset(buffer, 'x', length);
+	sem = sem_create(0);
+	if (tps_init(flags) < 0 || tps_create_sized(npages * TPS_PAGE_SIZE) < 0) {
+		fprintf(stderr, "tps_init failed\n");
+		return 1;
+	}
+
+	uint64_t before = mprotect_calls();
+	double write_ns = run(1, buffer);
+	double read_ns = run(0, buffer);
+	uint64_t calls = mprotect_calls() - before;
+
+	struct tps_stats stats;
+	tps_get_stats(&stats);
+	if (stats.protection != flags) {
+		fprintf(stderr, "wrong level reported: %d\n", stats.protection);
+		return 1;
+	}
+
+	printf("level,ops,length,pages,block,write_ns,read_ns,mprotect_per_op,"
+		"protection\n");
+	printf("%s,%zu,%zu,%zu,%zu,%.1f,%.1f,%.3f,%d\n", level, nops, length,
+		npages, block, write_ns / nops, read_ns / nops,
+		(double) calls / (2 * nops), stats.protection);
+
+	tps_destroy();
+	sem_destroy(sem);
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * TPS region stress test
+ *
+ * AREAS threads (100000 by default) each create a TPS, write their index to
+ * it and wait until all the others have done so, then check that their TPS
+ * still holds their index. In "default" mode, the TPS's are mapped on their
+ * own. In "region" mode, the API is initialized with TPS_REGION, and in "guard"
+ * mode (the default) with TPS_GUARD. The number of TPS's created, the number
+ * of mappings of the process while they are all alive, which the kernel limits
+ * to vm.max_map_count (65530 by default), and the time taken to create them
+ * are printed as a line of CSV.
+ *
+ * With "shared" stacks (the default), the stacks of the threads are carved
+ * from a single mapping. With "own" stacks, every thread gets the stack
+ * mapped by the C library, which takes two mappings of its own that separate
+ * the TPS's mapped on their own from each other, so that the limit is reached
+ * much sooner in "default" mode. How many threads can run at once is also
+ * limited by kernel.pid_max and kernel.threads-max: the test stops at the
+ * first thread that cannot be created.
+ *
+ * Usage: tps_region_stress.x [default|region|guard] [AREAS] [shared|own]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <sem.h>
+#include <tps.h>
+
+#define STACK_SIZE (64 * 1024)
+
+static size_t nareas = 100000;
+static size_t nfailed = 0;
+
+static sem_t created, release;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Number of mappings of the process, taken from /proc */
+static size_t count_maps(void)
+{
+	FILE *maps = fopen("/proc/self/maps", "r");
+	size_t lines = 0;
+	int c;
+
+	if (maps == NULL) {
+		return 0;
+	}
+	while ((c = fgetc(maps)) != EOF) {
+		lines += c == '\n';
+	}
+	fclose(maps);
+	return lines;
+}
+
+static void *area_thread(void *arg)
+{
+	size_t index = (size_t) arg;
+	size_t found;
+	int failed = tps_create() < 0 || tps_write(0, sizeof(index),
+		&index) < 0;
+
+	if (failed) {
+		__atomic_fetch_add(&nfailed, 1, __ATOMIC_RELAXED);
+	}
+	sem_up(created);
+
+	sem_down(release);
+	if (failed) {
+		return NULL;
+	}
+	if (tps_read(0, sizeof(found), &found) < 0 || found != index) {
+		fprintf(stderr, "area %zu: wrong content\n", index);
+		exit(1);
+	}
+	tps_destroy();
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "guard";
+	const char *stack_mode = "shared";
+	pthread_attr_t attr;
+	int flags = TPS_GUARD;
+	char *stacks = NULL;
+	size_t nthreads;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nareas = get_argv(argv[2]);
+	if (argc > 3)
+		stack_mode = argv[3];
+	if (strcmp(stack_mode, "shared") && strcmp(stack_mode, "own")) {
+		fprintf(stderr, "invalid stacks: %s\n", stack_mode);
+		return 1;
+	}
+	if (!strcmp(mode, "default")) {
+		flags = 0;
+	} else if (!strcmp(mode, "region")) {
+		flags = TPS_REGION;
+	} else if (strcmp(mode, "guard")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+
+	pthread_t *tids = malloc(nareas * sizeof(pthread_t));
+	if (!strcmp(stack_mode, "shared")) {
+		stacks = mmap(NULL, nareas * STACK_SIZE, PROT_READ|PROT_WRITE,
+			MAP_ANON|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+	}
+	if (tids == NULL || stacks == MAP_FAILED) {
+		fprintf(stderr, "cannot allocate %zu stacks\n", nareas);
+		return 1;
+	}
+
+	created = sem_create(0);
+	release = sem_create(0);
+	if (tps_init(flags) < 0) {
+		fprintf(stderr, "tps_init failed\n");
+		return 1;
+	}
+	pthread_attr_init(&attr);
+
+	double start = now_ns();
+	for (nthreads = 0; nthreads < nareas; nthreads++) {
+		if (stacks != NULL) {
+			pthread_attr_setstack(&attr, stacks + nthreads *
+				STACK_SIZE, STACK_SIZE);
+		}
+		if (pthread_create(&tids[nthreads], &attr, area_thread,
+			(void *) nthreads)) {
+			fprintf(stderr, "pthread_create failed after %zu "
+				"threads\n", nthreads);
+			break;
+		}
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		sem_down(created);
+	}
+	double elapsed = now_ns() - start;
+	size_t maps = count_maps();
+
+	for (size_t i = 0; i < nthreads; i++) {
+		sem_up(release);
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	printf("mode,stacks,threads,areas,maps,create_ms\n");
+	printf("%s,%s,%zu,%zu,%zu,%.2f\n", mode, stack_mode, nthreads,
+		nthreads - nfailed, maps, elapsed / 1e6);
+
+	pthread_attr_destroy(&attr);
+	sem_destroy(created);
+	sem_destroy(release);
+	if (stacks != NULL) {
+		munmap(stacks, nareas * STACK_SIZE);
+	}
+	free(tids);
+	return nthreads < nareas || nfailed > 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * TPS warm restart benchmark
+ *
+ * A worker thread needs a lookup table of PAGES pages (64 by default) in its
+ * TPS, whose entries are expensive to compute, and then looks LOOKUPS entries
+ * (1000 by default) up. The worker is restarted ROUNDS times (20 by default).
+ * In "rebuild" mode, every worker computes the table again. In "backed" mode
+ * (the default), the table lives in a TPS created with tps_create_backed(): the
+ * first worker computes it and syncs it to the file, and the following ones
+ * only page in the entries they look up. The file stays in the page cache, as
+ * it would across a restart of the process. The average time from the start
+ * of a worker until it is done with its lookups, first worker excluded, is
+ * printed as a line of CSV.
+ *
+ * Usage: tps_restart_bench.x [rebuild|backed] [PAGES] [ROUNDS] [LOOKUPS]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+
+#define ENTRIES_PER_PAGE (TPS_PAGE_SIZE / sizeof(uint64_t))
+
+static size_t npages = 64;
+static size_t nrounds = 20;
+static size_t nlookups = 1000;
+static int backed_mode = 1;
+static char path[] = "/tmp/tps_restart_XXXXXX";
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Stands for the work of deriving an entry of the table */
+static uint64_t compute_entry(uint64_t key)
+{
+	uint64_t value = key;
+
+	for (int round = 0; round < 256; round++) {
+		value = (value ^ (value >> 31)) * 0x9e3779b97f4a7c15ULL + round;
+	}
+	return value;
+}
+
+static void build_table(void)
+{
+	uint64_t *page = malloc(TPS_PAGE_SIZE);
+
+	for (size_t p = 0; p < npages; p++) {
+		for (size_t e = 0; e < ENTRIES_PER_PAGE; e++) {
+			page[e] = compute_entry(p * ENTRIES_PER_PAGE + e);
+		}
+		tps_write(p * TPS_PAGE_SIZE, TPS_PAGE_SIZE, page);
+	}
+	free(page);
+}
+
+static void *worker_thread(void *arg)
+{
+	int first = arg != NULL;
+	size_t nentries = npages * ENTRIES_PER_PAGE;
+	unsigned int seed = 1;
+
+	if (backed_mode) {
+		if (tps_create_backed(path, TPS_BACKED_SHARED) < 0) {
+			fprintf(stderr, "tps_create_backed failed\n");
+			exit(1);
+		}
+		if (first) {
+			build_table();
+			tps_sync();
+		}
+	} else {
+		tps_create_sized(npages * TPS_PAGE_SIZE);
+		build_table();
+	}
+
+	for (size_t n = 0; n < nlookups; n++) {
+		uint64_t key = rand_r(&seed) % nentries;
+		uint64_t value;
+
+		tps_read(key * sizeof(uint64_t), sizeof(uint64_t), &value);
+		if (value != compute_entry(key)) {
+			fprintf(stderr, "wrong entry\n");
+			exit(1);
+		}
+	}
+
+	tps_destroy();
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "backed";
+	pthread_t tid;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		npages = get_argv(argv[2]);
+	if (argc > 3)
+		nrounds = get_argv(argv[3]);
+	if (argc > 4)
+		nlookups = get_argv(argv[4]);
+	if (strcmp(mode, "rebuild") && strcmp(mode, "backed")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	backed_mode = !strcmp(mode, "backed");
+
+	/* The file gets the size of the table before the first worker */
+	int fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, npages * TPS_PAGE_SIZE) < 0) {
+		fprintf(stderr, "cannot create %s\n", path);
+		return 1;
+	}
+	close(fd);
+	tps_init(0);
+
+	pthread_create(&tid, NULL, worker_thread, path);
+	pthread_join(tid, NULL);
+
+	double start = now_ns();
+	for (size_t round = 0; round < nrounds; round++) {
+		pthread_create(&tid, NULL, worker_thread, NULL);
+		pthread_join(tid, NULL);
+	}
+	double elapsed = now_ns() - start;
+
+	printf("mode,pages,rounds,lookups,restart_us\n");
+	printf("%s,%zu,%zu,%zu,%.2f\n", mode, npages, nrounds, nlookups,
+		elapsed / nrounds / 1e3);
+
+	unlink(path);
+	return 0;
+}
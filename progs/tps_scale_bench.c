@@ -0,0 +1,172 @@
+/*
+ * TPS multi-core scaling benchmark
+ *
+ * For 1, 2, 4... up to THREADS threads (the number of online CPUs by default),
+ * every thread performs OPS operations (100000 by default) on its TPS, all
+ * threads running at the same time. In "private" mode (the default), every
+ * thread creates its own TPS and alternates 64-byte writes and reads to it. In
+ * "clone" mode, every thread clones the same TPS and only reads from it, so
+ * that all threads work on the same shared pages. In "read" mode, every thread
+ * only reads from its own TPS, whose pages are private: that is the lock-free
+ * path of tps_read(), whose latency should not depend on the number of
+ * threads. The throughput for every number of threads is printed as CSV,
+ * along with the speedup over a single thread.
+ *
+ * Usage: tps_scale_bench.x [private|read|clone] [THREADS] [OPS]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+
+#define TPS_BENCH_SIZE (16 * TPS_PAGE_SIZE)
+#define CHUNK 64
+
+static int clone_mode = 0;
+static int read_mode = 0;
+static size_t nops = 100000;
+static pthread_t template_tid;
+static pthread_barrier_t start_barrier;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_thread(__attribute__((unused)) void *arg)
+{
+	char buffer[CHUNK];
+
+	memset(buffer, 0x5a, CHUNK);
+	if (clone_mode) {
+		tps_clone(template_tid);
+	} else {
+		tps_create_sized(TPS_BENCH_SIZE);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for (size_t op = 0; op < nops; op++) {
+		size_t offset = (op * 4099) % (TPS_BENCH_SIZE / CHUNK) * CHUNK;
+
+		if (clone_mode || read_mode || op % 2) {
+			tps_read(offset, CHUNK, buffer);
+		} else {
+			tps_write(offset, CHUNK, buffer);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+
+	tps_destroy();
+	return NULL;
+}
+
+/* Owns the TPS cloned by every thread in clone mode, until they are done */
+static void *template_thread(void *arg)
+{
+	char byte = 1;
+
+	tps_create_sized(TPS_BENCH_SIZE);
+	for (size_t i = 0; i < TPS_BENCH_SIZE / TPS_PAGE_SIZE; i++) {
+		tps_write(i * TPS_PAGE_SIZE, 1, &byte);
+	}
+
+	pthread_barrier_wait(arg);
+	pthread_barrier_wait(arg);
+	tps_destroy();
+	return NULL;
+}
+
+static double run(size_t nthreads)
+{
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (size_t t = 0; t < nthreads; t++) {
+		pthread_create(&tids[t], NULL, bench_thread, NULL);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	double start = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	double elapsed = now_ns() - start;
+
+	for (size_t t = 0; t < nthreads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	free(tids);
+
+	return nthreads * nops / (elapsed / 1e9);
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "private";
+	size_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_barrier_t template_barrier;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		max_threads = get_argv(argv[2]);
+	if (argc > 3)
+		nops = get_argv(argv[3]);
+	if (strcmp(mode, "private") && strcmp(mode, "read") &&
+		strcmp(mode, "clone")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	clone_mode = !strcmp(mode, "clone");
+	read_mode = !strcmp(mode, "read");
+
+	tps_init(0);
+	if (clone_mode) {
+		pthread_barrier_init(&template_barrier, NULL, 2);
+		pthread_create(&template_tid, NULL, template_thread,
+			&template_barrier);
+		pthread_barrier_wait(&template_barrier);
+	}
+
+	printf("mode,threads,ops_per_thread,ops_per_sec,speedup\n");
+
+	double single = 0;
+	for (size_t n = 1; n <= max_threads; n *= 2) {
+		double rate = run(n);
+
+		if (n == 1) {
+			single = rate;
+		}
+		printf("%s,%zu,%zu,%.0f,%.2f\n", mode, n, nops, rate,
+			rate / single);
+		if (n < max_threads && n * 2 > max_threads) {
+			n = max_threads / 2;
+		}
+	}
+
+	if (clone_mode) {
+		pthread_barrier_wait(&template_barrier);
+		pthread_join(template_tid, NULL);
+		pthread_barrier_destroy(&template_barrier);
+	}
+
+	return 0;
+}
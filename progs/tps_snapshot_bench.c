@@ -0,0 +1,110 @@
+/*
+ * TPS snapshot benchmark
+ *
+ * A thread with a TPS of PAGES pages (64 by default) makes ROUNDS attempts
+ * (10000 by default) at changing its state, each writing one byte to WRITES
+ * of its pages (1 by default) and then restoring the state the TPS had before
+ * the attempt. In "copy" mode, the state is saved once into a buffer with
+ * tps_read() and restored with tps_write(). In "snapshot" mode, it is saved
+ * with tps_snapshot() and restored with tps_rollback(). The average latency of
+ * an attempt is printed as a line of CSV.
+ *
+ * Usage: tps_snapshot_bench.x [copy|snapshot] [ROUNDS] [PAGES] [WRITES]
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tps.h>
+
+static size_t nrounds = 10000;
+static size_t npages = 64;
+static size_t nwrites = 1;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "snapshot";
+	char byte = 'b';
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nrounds = get_argv(argv[2]);
+	if (argc > 3)
+		npages = get_argv(argv[3]);
+	if (argc > 4)
+		nwrites = get_argv(argv[4]);
+	if (nwrites > npages)
+		nwrites = npages;
+	if (strcmp(mode, "copy") && strcmp(mode, "snapshot")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	int snapshot_mode = !strcmp(mode, "snapshot");
+
+	char *saved = malloc(npages * TPS_PAGE_SIZE);
+	memset(saved, 'a', npages * TPS_PAGE_SIZE);
+	tps_init(0);
+	tps_create_sized(npages * TPS_PAGE_SIZE);
+	tps_write(0, npages * TPS_PAGE_SIZE, saved);
+
+	tps_snapshot_t snap = NULL;
+	double start = now_ns();
+	if (snapshot_mode) {
+		snap = tps_snapshot();
+	} else {
+		tps_read(0, npages * TPS_PAGE_SIZE, saved);
+	}
+
+	for (size_t round = 0; round < nrounds; round++) {
+		for (size_t i = 0; i < nwrites; i++) {
+			tps_write(i * TPS_PAGE_SIZE, 1, &byte);
+		}
+
+		if (snapshot_mode) {
+			tps_rollback(snap);
+		} else {
+			tps_write(0, npages * TPS_PAGE_SIZE, saved);
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	/* The restored state must be the original one */
+	tps_read(0, 1, &byte);
+	if (byte != 'a') {
+		fprintf(stderr, "state was not restored\n");
+		return 1;
+	}
+
+	printf("mode,rounds,pages,writes,attempt_us\n");
+	printf("%s,%zu,%zu,%zu,%.2f\n", mode, nrounds, npages, nwrites,
+		elapsed / nrounds / 1e3);
+
+	if (snapshot_mode) {
+		tps_snapshot_destroy(snap);
+	}
+	tps_destroy();
+	free(saved);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * TPS pool startup benchmark
+ *
+ * The main thread fills a template TPS of PAGES pages (16 by default), then
+ * starts WORKERS threads (1000 by default) which all need a clone of it. In
+ * "clone" mode, every worker calls tps_clone() on its own. In "batch" mode
+ * (the default), the main thread clones the template for all of them with a
+ * single tps_clone_batch() before letting them go. Every worker then reads
+ * its first byte. The total time spent cloning, and the time from the release
+ * of the workers until all of them have read their clone, are printed as a
+ * line of CSV. The latter includes waking the workers up through a semaphore,
+ * which doesn't scale linearly with their number.
+ *
+ * Usage: tps_startup_bench.x [clone|batch] [WORKERS] [PAGES]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sem.h>
+#include <tps.h>
+
+static size_t nworkers = 1000;
+static size_t npages = 16;
+static int batch_mode = 1;
+
+static pthread_t template_tid;
+static sem_t release, done, finish;
+static uint64_t clone_ns = 0;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker_thread(__attribute__((unused)) void *arg)
+{
+	char byte;
+
+	sem_down(release);
+	if (!batch_mode) {
+		double start = now_ns();
+
+		if (tps_clone(template_tid) < 0) {
+			fprintf(stderr, "tps_clone failed\n");
+			exit(1);
+		}
+		__atomic_fetch_add(&clone_ns, (uint64_t) (now_ns() - start),
+			__ATOMIC_RELAXED);
+	}
+	if (tps_read(0, 1, &byte) < 0 || byte != 't') {
+		fprintf(stderr, "clone not found\n");
+		exit(1);
+	}
+	sem_up(done);
+
+	/* Stay alive until every worker is done, so that TIDs are not reused */
+	sem_down(finish);
+	tps_destroy();
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "batch";
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		nworkers = get_argv(argv[2]);
+	if (argc > 3)
+		npages = get_argv(argv[3]);
+	if (strcmp(mode, "clone") && strcmp(mode, "batch")) {
+		fprintf(stderr, "invalid mode: %s\n", mode);
+		return 1;
+	}
+	batch_mode = !strcmp(mode, "batch");
+
+	pthread_t *tids = malloc(nworkers * sizeof(pthread_t));
+	char *buffer = malloc(npages * TPS_PAGE_SIZE);
+
+	release = sem_create(0);
+	done = sem_create(0);
+	finish = sem_create(0);
+	tps_init(0);
+
+	template_tid = pthread_self();
+	memset(buffer, 't', npages * TPS_PAGE_SIZE);
+	tps_create_sized(npages * TPS_PAGE_SIZE);
+	tps_write(0, npages * TPS_PAGE_SIZE, buffer);
+
+	for (size_t i = 0; i < nworkers; i++) {
+		if (pthread_create(&tids[i], NULL, worker_thread, NULL)) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+
+	double start = now_ns();
+	if (batch_mode) {
+		if (tps_clone_batch(template_tid, tids, nworkers) < 0) {
+			fprintf(stderr, "tps_clone_batch failed\n");
+			return 1;
+		}
+		clone_ns = now_ns() - start;
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		sem_up(release);
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		sem_down(done);
+	}
+	double elapsed = now_ns() - start;
+
+	for (size_t i = 0; i < nworkers; i++) {
+		sem_up(finish);
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	printf("mode,workers,pages,clone_ms,startup_ms\n");
+	printf("%s,%zu,%zu,%.2f,%.2f\n", mode, nworkers, npages, clone_ns / 1e6,
+		elapsed / 1e6);
+
+	tps_destroy();
+	sem_destroy(release);
+	sem_destroy(done);
+	sem_destroy(finish);
+	free(tids);
+	free(buffer);
+	return 0;
+}
@@ -1,9 +1,15 @@
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <tps.h>
 #include <sem.h>
@@ -93,6 +99,9 @@ void test_no_init_cd(void)
 {
 	assert(tps_create() == -1);
 	assert(tps_destroy() == -1);
+	assert(tps_compact(0) == -1);
+	assert(tps_get_stats(NULL) == -1);
+	assert(tps_read_from(pthread_self(), 0, 1, msg1) == -1);
 }
 
 void test_no_init_wr(void)
@@ -354,6 +363,1414 @@ void test_clone_copy_on_write_only(void)
 
 }
 
+void test_create_sized(void)
+{
+	size_t size = 3 * TPS_PAGE_SIZE + 10;
+	char *buffer = malloc(size);
+	char *result = malloc(size);
+
+	for (size_t i = 0; i < size; i++) {
+		buffer[i] = i % 128;
+	}
+
+	assert(tps_create_sized(0) == -1);
+	assert(tps_create_sized(size) == 0);
+	assert(tps_size() == (ssize_t) size);
+
+	/* Write across page boundaries and read it back */
+	assert(tps_write(0, size, buffer) == 0);
+	memset(result, 0, size);
+	assert(tps_read(0, size, result) == 0);
+	assert(!memcmp(buffer, result, size));
+
+	assert(tps_read(TPS_PAGE_SIZE - 5, 10, result) == 0);
+	assert(!memcmp(buffer + TPS_PAGE_SIZE - 5, result, 10));
+
+	/* The size is checked to the byte, not to the page */
+	assert(tps_write(size, 1, buffer) == -1);
+	assert(tps_read(size - 1, 2, buffer) == -1);
+
+	tps_destroy();
+	free(buffer);
+	free(result);
+}
+
+void test_resize(void)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+
+	assert(tps_resize(TPS_SIZE) == -1);
+	tps_create();
+	tps_write(0, TPS_SIZE, msg1);
+
+	/* Growing keeps the content and zeroes the new bytes */
+	assert(tps_resize(4 * TPS_PAGE_SIZE) == 0);
+	assert(tps_read(0, 4 * TPS_PAGE_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+	for (size_t i = TPS_SIZE; i < 4 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 0);
+	}
+
+	/* Shrinking and growing back doesn't resurrect old data */
+	assert(tps_resize(5) == 0);
+	assert(tps_read(0, 6, buffer) == -1);
+	assert(tps_resize(TPS_SIZE) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg1, 5));
+	for (size_t i = 5; i < TPS_SIZE; i++) {
+		assert(buffer[i] == 0);
+	}
+
+	tps_destroy();
+	free(buffer);
+}
+
+void *clone_pages_help(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+
+	tps_create_sized(4 * TPS_PAGE_SIZE);
+	memset(buffer, 'a', 4 * TPS_PAGE_SIZE);
+	tps_write(0, 4 * TPS_PAGE_SIZE, buffer);
+
+	/* Move to main thread */
+	sem_up(sem2);
+	sem_down(sem1);
+
+	/* The clone's write must not be visible here */
+	tps_read(0, 4 * TPS_PAGE_SIZE, buffer);
+	for (size_t i = 0; i < 4 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 'a');
+	}
+
+	/* Write to a page which is still shared with the clone */
+	buffer[0] = 'c';
+	tps_write(3 * TPS_PAGE_SIZE, 1, buffer);
+
+	sem_up(sem2);
+	sem_down(sem1);
+
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+void test_clone_pages(void)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+
+	pthread_t tid;
+	pthread_create(&tid, NULL, clone_pages_help, NULL);
+	sem_down(sem2);
+
+	assert(tps_clone(tid) == 0);
+	assert(tps_size() == 4 * TPS_PAGE_SIZE);
+
+	/* Write to the second page only */
+	buffer[0] = 'b';
+	assert(tps_write(TPS_PAGE_SIZE + 1, 1, buffer) == 0);
+
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* Every page but the one we wrote to still matches the original,
+	including the page the helper thread wrote to after we cloned it */
+	assert(tps_read(0, 4 * TPS_PAGE_SIZE, buffer) == 0);
+	for (size_t i = 0; i < 4 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == (i == TPS_PAGE_SIZE + 1 ? 'b' : 'a'));
+	}
+
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+
+	tps_destroy();
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+void test_map(void)
+{
+	char *buffer = malloc(2 * TPS_PAGE_SIZE);
+
+	assert(tps_map(TPS_MAP_WRITE) == NULL);
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	assert(tps_map(0) == NULL);
+
+	char *tps_addr = tps_map(TPS_MAP_WRITE);
+	assert(tps_addr != NULL);
+	assert(tps_map(TPS_MAP_READ) == NULL);
+	assert(tps_resize(TPS_SIZE) == -1);
+
+	/* Writes through the pointer are seen by tps_read() and the other way
+	around */
+	strcpy(tps_addr + TPS_PAGE_SIZE - 6, msg1);
+	assert(tps_read(TPS_PAGE_SIZE - 6, strlen(msg1), buffer) == 0);
+	assert(!memcmp(buffer, msg1, strlen(msg1)));
+	tps_write(0, 5, "hello");
+	assert(!memcmp(tps_addr, "hello", 5));
+
+	assert(tps_unmap() == 0);
+	assert(tps_unmap() == -1);
+	assert(tps_read(TPS_PAGE_SIZE - 6, strlen(msg1), buffer) == 0);
+	assert(!memcmp(buffer, msg1, strlen(msg1)));
+
+	tps_destroy();
+	free(buffer);
+}
+
+void *map_cow_help(__attribute__((unused)) void *arg)
+{
+	char *tps_addr;
+
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	tps_addr = tps_map(TPS_MAP_WRITE);
+	memset(tps_addr, 'a', 2 * TPS_PAGE_SIZE);
+
+	/* Move to main thread, which clones our TPS */
+	sem_up(sem2);
+	sem_down(sem1);
+
+	/* Our pages are now shared, writing to the first one copies it, into a
+	page that the clone set aside */
+	void *spare = latest_mmap_addr;
+	tps_addr[0] = 'b';
+	assert(tps_addr[0] == 'b' && tps_addr[1] == 'a');
+	assert(latest_mmap_addr == spare);
+
+	/* Copying into the mapped area would fault with the TPS locked */
+	assert(tps_read(0, 1, tps_addr + TPS_PAGE_SIZE) == -1);
+
+	sem_up(sem2);
+	sem_down(sem1);
+
+	tps_unmap();
+	tps_destroy();
+	return NULL;
+}
+
+void test_map_cow(void)
+{
+	char *buffer = malloc(2 * TPS_PAGE_SIZE);
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+
+	pthread_t tid;
+	pthread_create(&tid, NULL, map_cow_help, NULL);
+	sem_down(sem2);
+
+	void *temp = latest_mmap_addr;
+	assert(tps_clone(tid) == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* The helper's write has been copied away from our TPS */
+	assert(latest_mmap_addr != temp);
+	assert(tps_read(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+	for (size_t i = 0; i < 2 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 'a');
+	}
+
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+
+	/* Our pages outlived the helper's TPS, mapping moves them in */
+	char *tps_addr = tps_map(TPS_MAP_READ);
+	assert(tps_addr != NULL && tps_addr[0] == 'a');
+	tps_unmap();
+
+	tps_destroy();
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+void test_snapshot(void)
+{
+	char *buffer = malloc(2 * TPS_PAGE_SIZE);
+	char byte = 'b';
+
+	assert(tps_snapshot() == NULL);
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	assert(tps_rollback(NULL) == -1);
+	memset(buffer, 'a', 2 * TPS_PAGE_SIZE);
+	tps_write(0, 2 * TPS_PAGE_SIZE, buffer);
+
+	tps_snapshot_t snap = tps_snapshot();
+	assert(snap != NULL);
+
+	/* Every attempt starts over from the snapshot, size included */
+	for (int round = 0; round < 3; round++) {
+		assert(tps_write(TPS_PAGE_SIZE + round, 1, &byte) == 0);
+		assert(tps_resize(4 * TPS_PAGE_SIZE) == 0);
+		assert(tps_rollback(snap) == 0);
+		assert(tps_size() == 2 * TPS_PAGE_SIZE);
+		assert(tps_read(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+		for (size_t i = 0; i < 2 * TPS_PAGE_SIZE; i++) {
+			assert(buffer[i] == 'a');
+		}
+	}
+
+	/* The snapshot outlives the TPS it was taken from */
+	tps_destroy();
+	tps_create();
+	assert(tps_map(TPS_MAP_READ) != NULL);
+	assert(tps_rollback(snap) == -1);
+	tps_unmap();
+	assert(tps_rollback(snap) == 0);
+	assert(tps_read(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+	assert(buffer[0] == 'a' && buffer[2 * TPS_PAGE_SIZE - 1] == 'a');
+	tps_destroy();
+
+	assert(tps_snapshot_destroy(snap) == 0);
+	assert(tps_snapshot_destroy(NULL) == -1);
+	free(buffer);
+}
+
+void test_rw_vec(void)
+{
+	char str1[] = "Hello world!";
+	char str2[] = "Hello, TA's!";
+	char buf1[sizeof(str1)], buf2[sizeof(str2)];
+	struct tps_iovec iov[2] = {
+		{ 0, sizeof(str1), str1 },
+		{ 2 * TPS_PAGE_SIZE - 4, sizeof(str2), str2 },
+	};
+
+	tps_create_sized(3 * TPS_PAGE_SIZE);
+	assert(tps_writev(iov, 2) == 0);
+
+	iov[0].buffer = buf1;
+	iov[1].buffer = buf2;
+	assert(tps_readv(iov, 2) == 0);
+	assert(!strcmp(buf1, str1));
+	assert(!strcmp(buf2, str2));
+
+	/* A single invalid segment fails the whole call */
+	memset(buf1, 0, sizeof(buf1));
+	iov[1].offset = 3 * TPS_PAGE_SIZE;
+	assert(tps_readv(iov, 2) == -1);
+	assert(buf1[0] == 0);
+	assert(tps_readv(NULL, 1) == -1);
+	assert(tps_readv(iov, 0) == 0);
+
+	tps_destroy();
+}
+
+#define CONCURRENT_CLONES 4
+
+static pthread_t concurrent_tid;
+
+void *concurrent_clone_help(void *arg)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+	size_t page = (long) arg;
+	char id = 'b' + page;
+
+	/* Every clone writes to its own pages while the others still share
+	them, and must only ever see its own writes */
+	assert(tps_clone(concurrent_tid) == 0);
+	for (int round = 0; round < 100; round++) {
+		assert(tps_write(page * TPS_PAGE_SIZE + round, 1, &id) == 0);
+		assert(tps_read(0, 4 * TPS_PAGE_SIZE, buffer) == 0);
+		for (size_t i = 0; i < 4 * TPS_PAGE_SIZE; i++) {
+			assert(buffer[i] == (i / TPS_PAGE_SIZE == page &&
+				i % TPS_PAGE_SIZE <= (size_t) round ? id : 'a'));
+		}
+	}
+	tps_destroy();
+
+	free(buffer);
+	return NULL;
+}
+
+void test_concurrent_clones(void)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+	pthread_t tids[CONCURRENT_CLONES];
+
+	concurrent_tid = pthread_self();
+	tps_create_sized(4 * TPS_PAGE_SIZE);
+	memset(buffer, 'a', 4 * TPS_PAGE_SIZE);
+	tps_write(0, 4 * TPS_PAGE_SIZE, buffer);
+
+	for (long t = 0; t < CONCURRENT_CLONES; t++) {
+		pthread_create(&tids[t], NULL, concurrent_clone_help,
+			(void *) t);
+	}
+	for (long t = 0; t < CONCURRENT_CLONES; t++) {
+		pthread_join(tids[t], NULL);
+	}
+
+	assert(tps_read(0, 4 * TPS_PAGE_SIZE, buffer) == 0);
+	for (size_t i = 0; i < 4 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 'a');
+	}
+
+	tps_destroy();
+	free(buffer);
+}
+
+void *read_clone_help(__attribute__((unused)) void *arg)
+{
+	char id = 'z';
+
+	for (int round = 0; round < 20; round++) {
+		assert(tps_clone(concurrent_tid) == 0);
+		assert(tps_write(round % 4 * TPS_PAGE_SIZE, 1, &id) == 0);
+		tps_destroy();
+	}
+
+	return NULL;
+}
+
+void test_reads_while_cloned(void)
+{
+	char *buffer = malloc(4 * TPS_PAGE_SIZE);
+	pthread_t tids[CONCURRENT_CLONES];
+
+	concurrent_tid = pthread_self();
+	tps_create_sized(4 * TPS_PAGE_SIZE);
+	memset(buffer, 'a', 4 * TPS_PAGE_SIZE);
+	tps_write(0, 4 * TPS_PAGE_SIZE, buffer);
+
+	/* Our pages go from private to shared and back while we read them,
+	taking the lock-free path or not */
+	for (long t = 0; t < CONCURRENT_CLONES; t++) {
+		pthread_create(&tids[t], NULL, read_clone_help, NULL);
+	}
+	for (int round = 0; round < 500; round++) {
+		assert(tps_read(0, 4 * TPS_PAGE_SIZE, buffer) == 0);
+		for (size_t i = 0; i < 4 * TPS_PAGE_SIZE; i++) {
+			assert(buffer[i] == 'a');
+		}
+	}
+	for (long t = 0; t < CONCURRENT_CLONES; t++) {
+		pthread_join(tids[t], NULL);
+	}
+
+	tps_destroy();
+	free(buffer);
+}
+
+void *compact_help(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(2 * TPS_PAGE_SIZE);
+
+	/* Writing the same content gives us private copies all the same */
+	memset(buffer, 'a', 2 * TPS_PAGE_SIZE);
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_write(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+
+	/* Merged pages read the same, and are copied on write again */
+	assert(tps_read(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+	for (size_t i = 0; i < 2 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 'a');
+	}
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	tps_destroy();
+
+	free(buffer);
+	return NULL;
+}
+
+void test_compact(void)
+{
+	char *buffer = malloc(2 * TPS_PAGE_SIZE);
+	pthread_t tid;
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	memset(buffer, 'a', 2 * TPS_PAGE_SIZE);
+	tps_write(0, 2 * TPS_PAGE_SIZE, buffer);
+
+	pthread_create(&tid, NULL, compact_help, NULL);
+	sem_down(sem2);
+	assert(tps_compact(1000000) == 2);
+	assert(tps_compact(1000000) == 0);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+
+	assert(tps_read(0, 2 * TPS_PAGE_SIZE, buffer) == 0);
+	for (size_t i = 0; i < 2 * TPS_PAGE_SIZE; i++) {
+		assert(buffer[i] == 'a');
+	}
+
+	tps_destroy();
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+/* Pages left open by the protection level are merged as well, and copied on
+the next write like the pages of a clone */
+void test_compact_deferred(void)
+{
+	assert(tps_init(TPS_DEFERRED) == 0);
+	test_compact();
+}
+
+void test_compact_guard_only(void)
+{
+	assert(tps_init(TPS_GUARD_ONLY) == 0);
+	test_compact();
+}
+
+#define COMPACT_CLONES 40
+
+void *compact_batches_help(__attribute__((unused)) void *arg)
+{
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+
+	char *buffer = malloc(TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(buffer, msg1, TPS_SIZE) == 0);
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+void test_compact_batches(void)
+{
+	pthread_t tids[COMPACT_CLONES];
+	ssize_t merged = 0;
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	for (int t = 0; t < COMPACT_CLONES; t++) {
+		pthread_create(&tids[t], NULL, compact_batches_help, NULL);
+		sem_down(sem2);
+	}
+
+	/* Without any budget, a call merges a page at most, and the calls
+	after it go on from there until every copy is merged */
+	for (int call = 0; call < 100 * COMPACT_CLONES &&
+		merged < COMPACT_CLONES; call++) {
+		ssize_t retval = tps_compact(0);
+
+		assert(retval == 0 || retval == 1);
+		merged += retval;
+	}
+	assert(merged == COMPACT_CLONES);
+	assert(tps_compact(1000000) == 0);
+
+	for (int t = 0; t < COMPACT_CLONES; t++) {
+		sem_up(sem1);
+	}
+	for (int t = 0; t < COMPACT_CLONES; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	tps_destroy();
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+}
+
+void *clone_batch_help(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(TPS_SIZE);
+
+	/* The clone is already there when we first use the API */
+	sem_down(sem1);
+	assert(tps_create() == -1);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	tps_destroy();
+
+	free(buffer);
+	return NULL;
+}
+
+void test_clone_batch(void)
+{
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t tids[2], bad[3];
+
+	sem1 = sem_create(0);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	for (int i = 0; i < 2; i++) {
+		pthread_create(&tids[i], NULL, clone_batch_help, NULL);
+	}
+
+	/* Nothing is cloned when one of the threads can't get a clone */
+	bad[0] = tids[0];
+	bad[1] = tids[1];
+	bad[2] = tids[0];
+	assert(tps_clone_batch(pthread_self(), bad, 3) == -1);
+	bad[2] = pthread_self();
+	assert(tps_clone_batch(pthread_self(), bad, 3) == -1);
+	assert(tps_read_from(tids[0], 0, 1, buffer) == -1);
+	assert(tps_clone_batch(pthread_self(), NULL, 2) == -1);
+
+	assert(tps_clone_batch(pthread_self(), tids, 2) == 0);
+	assert(tps_clone_batch(pthread_self(), tids, 1) == -1);
+	sem_up(sem1);
+	sem_up(sem1);
+	pthread_join(tids[0], NULL);
+	pthread_join(tids[1], NULL);
+
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	tps_destroy();
+	sem_destroy(sem1);
+	free(buffer);
+}
+
+void *idle_help(__attribute__((unused)) void *arg)
+{
+	sem_down(sem1);
+	return NULL;
+}
+
+void *create_help(__attribute__((unused)) void *arg)
+{
+	assert(tps_create() == 0);
+	tps_destroy();
+	return NULL;
+}
+
+/* The TPS made for thread tid, which exited without using it, is destroyed by
+the first call of a later thread reusing its TID, which can create its own, or
+else by tps_reclaim() */
+void check_unclaimed(pthread_t tid, size_t live_tps)
+{
+	struct tps_stats stats;
+	pthread_t next;
+
+	pthread_create(&next, NULL, create_help, NULL);
+	pthread_join(next, NULL);
+	assert(tps_reclaim(tid) == (pthread_equal(next, tid) ? -1 : 0));
+	assert(tps_reclaim(tid) == -1);
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.live_tps == live_tps);
+}
+
+void test_clone_batch_unclaimed(void)
+{
+	struct tps_stats before;
+	pthread_t tid;
+
+	sem1 = sem_create(0);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_get_stats(&before) == 0);
+
+	pthread_create(&tid, NULL, idle_help, NULL);
+	assert(tps_clone_batch(pthread_self(), &tid, 1) == 0);
+	assert(tps_reclaim(pthread_self()) == -1);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	check_unclaimed(tid, before.live_tps);
+
+	tps_destroy();
+	sem_destroy(sem1);
+}
+
+void *read_from_help(__attribute__((unused)) void *arg)
+{
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+	tps_destroy();
+	return NULL;
+}
+
+void test_read_from(void)
+{
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t tid;
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	pthread_create(&tid, NULL, read_from_help, NULL);
+	sem_down(sem2);
+
+	/* No TPS of our own is needed, and no reference is kept */
+	assert(tps_read_from(tid, 0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	assert(tps_read_from(tid, 1, TPS_SIZE, buffer) == -1);
+	assert(tps_read_from(tid, 0, 1, NULL) == -1);
+	assert(tps_read_from(pthread_self(), 0, 1, buffer) == -1);
+
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	assert(tps_read_from(tid, 0, 1, buffer) == -1);
+
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+void *clone_write_help(__attribute__((unused)) void *arg)
+{
+	tps_clone(concurrent_tid);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+	tps_destroy();
+	return NULL;
+}
+
+/* With TPS_MEMFD, pages are read from the memory file, but for the ones the
+kernel copied on write */
+void test_read_from_memfd(void)
+{
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t tid;
+
+	assert(tps_init(TPS_MEMFD) == 0);
+	test_read_from();
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_write(TPS_PAGE_SIZE, TPS_SIZE, msg1) == 0);
+	pthread_create(&tid, NULL, clone_write_help, NULL);
+	sem_down(sem2);
+	assert(tps_read_from(tid, 0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg2, buffer, TPS_SIZE) == 0);
+	assert(tps_read_from(tid, TPS_PAGE_SIZE, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	tps_destroy();
+
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+#define MONITOR_CLONERS 8
+
+static int monitor_done;
+
+void *monitor_help(__attribute__((unused)) void *arg)
+{
+	char buffer[64];
+
+	while (!__atomic_load_n(&monitor_done, __ATOMIC_ACQUIRE)) {
+		assert(tps_read_from(concurrent_tid, 0, 64, buffer) == 0);
+		assert(buffer[0] == 'a' && buffer[63] == 'a');
+	}
+	return NULL;
+}
+
+void *monitor_clone_help(__attribute__((unused)) void *arg)
+{
+	char id = 'b';
+
+	for (int round = 0; round < 200; round++) {
+		assert(tps_clone(concurrent_tid) == 0);
+		assert(tps_write(0, 1, &id) == 0);
+		tps_destroy();
+	}
+	return NULL;
+}
+
+/* A monitor reading a TPS must not hold up the threads cloning it */
+void test_read_from_cloners(void)
+{
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t monitor, tids[MONITOR_CLONERS];
+
+	concurrent_tid = pthread_self();
+	tps_create();
+	memset(buffer, 'a', TPS_SIZE);
+	assert(tps_write(0, TPS_SIZE, buffer) == 0);
+
+	monitor_done = 0;
+	pthread_create(&monitor, NULL, monitor_help, NULL);
+	for (int t = 0; t < MONITOR_CLONERS; t++) {
+		pthread_create(&tids[t], NULL, monitor_clone_help, NULL);
+	}
+	for (int t = 0; t < MONITOR_CLONERS; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	__atomic_store_n(&monitor_done, 1, __ATOMIC_RELEASE);
+	pthread_join(monitor, NULL);
+
+	tps_destroy();
+	free(buffer);
+}
+
+void *transfer_help(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(TPS_SIZE);
+
+	/* The TPS is ours when we first use the API, and can be passed on */
+	sem_down(sem1);
+	assert(tps_create() == -1);
+	assert(tps_size() == 2 * TPS_PAGE_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	assert(tps_transfer(concurrent_tid) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == -1);
+
+	free(buffer);
+	return NULL;
+}
+
+void test_transfer(void)
+{
+	struct tps_stats before, stats;
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t tid;
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	pthread_create(&tid, NULL, transfer_help, NULL);
+	assert(tps_transfer(tid) == -1);
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_transfer(pthread_self()) == -1);
+	assert(tps_map(TPS_MAP_READ) != NULL);
+	assert(tps_transfer(tid) == -1);
+	assert(tps_unmap() == 0);
+
+	/* Nothing is copied, before or after the handover */
+	assert(tps_get_stats(&before) == 0);
+	assert(tps_transfer(tid) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == -1);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.cow_copies == before.cow_copies);
+	assert(stats.live_tps == before.live_tps);
+
+	/* The TPS came back to us, and a thread with a TPS can't get another */
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg2, buffer, TPS_SIZE) == 0);
+	pthread_create(&tid, NULL, read_from_help, NULL);
+	sem_down(sem2);
+	assert(tps_transfer(tid) == -1);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	tps_destroy();
+
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	free(buffer);
+}
+
+void *claim_help(__attribute__((unused)) void *arg)
+{
+	char buffer[TPS_SIZE];
+
+	sem_down(sem1);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	return NULL;
+}
+
+/* A TPS handed to a thread is either claimed by it, and destroyed when it
+exits, or reclaimed like an unused clone */
+void test_transfer_unclaimed(void)
+{
+	struct tps_stats before, stats;
+	pthread_t tid;
+
+	sem1 = sem_create(0);
+	assert(tps_get_stats(&before) == 0);
+
+	pthread_create(&tid, NULL, claim_help, NULL);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_transfer(tid) == 0);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.live_tps == before.live_tps);
+	assert(tps_reclaim(tid) == -1);
+	assert(tps_transfer(tid) == -1);
+
+	pthread_create(&tid, NULL, idle_help, NULL);
+	tps_create();
+	assert(tps_transfer(tid) == 0);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+	check_unclaimed(tid, before.live_tps);
+
+	/* A thread which has exited can't be handed anything */
+	tps_create();
+	assert(tps_transfer(tid) == -1);
+	tps_destroy();
+	sem_destroy(sem1);
+}
+
+void *atomic_help(__attribute__((unused)) void *arg)
+{
+	uint64_t old;
+
+	/* The shared page is copied before the word changes */
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_fetch_add(8, 8, 5, &old) == 0);
+	assert(old == 40);
+	assert(tps_fetch_add(8, 8, 0, &old) == 0);
+	assert(old == 45);
+	tps_destroy();
+	return NULL;
+}
+
+void test_atomic(void)
+{
+	uint64_t old, word = 40;
+	uint32_t half;
+	pthread_t tid;
+
+	concurrent_tid = pthread_self();
+	tps_create();
+	assert(tps_write(8, 8, &word) == 0);
+	pthread_create(&tid, NULL, atomic_help, NULL);
+	pthread_join(tid, NULL);
+	assert(tps_read(8, 8, &word) == 0);
+	assert(word == 40);
+
+	assert(tps_fetch_add(8, 8, 2, &old) == 0);
+	assert(old == 40);
+	assert(tps_fetch_or(8, 8, 0x100, NULL) == 0);
+	assert(tps_fetch_and(8, 8, 0x10f, &old) == 0);
+	assert(old == 0x12a);
+	assert(tps_swap(8, 8, 7, &old) == 0);
+	assert(old == 0x10a);
+	old = 6;
+	assert(tps_cas(8, 8, &old, 9) == 0);
+	assert(old == 7);
+	assert(tps_cas(8, 8, &old, 9) == 1);
+	assert(tps_read(8, 8, &word) == 0);
+	assert(word == 9);
+
+	/* 4-byte words wrap around on their own */
+	assert(tps_fetch_add(16, 4, 0xffffffff, &old) == 0);
+	assert(old == 0);
+	assert(tps_fetch_add(16, 4, 2, &old) == 0);
+	assert(old == 0xffffffff);
+	assert(tps_read(16, 4, &half) == 0);
+	assert(half == 1);
+	assert(tps_read(20, 4, &half) == 0);
+	assert(half == 0);
+
+	assert(tps_fetch_add(4, 8, 1, NULL) == -1);
+	assert(tps_fetch_add(8, 2, 1, NULL) == -1);
+	assert(tps_fetch_add(TPS_SIZE, 4, 1, NULL) == -1);
+	assert(tps_cas(8, 8, NULL, 1) == -1);
+	tps_destroy();
+	assert(tps_fetch_add(8, 8, 1, NULL) == -1);
+}
+
+static ssize_t word_key, half_key, text_key;
+
+void *keys_help(__attribute__((unused)) void *arg)
+{
+	uint64_t value;
+	char text[5];
+
+	/* The keys are the same for every thread, and a clone gets the slots
+	of the cloned TPS */
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_get64(word_key, &value) == 0);
+	assert(value == 42);
+	assert(tps_get(text_key, text) == 0);
+	assert(memcmp(text, "slot", 5) == 0);
+	assert(tps_set64(word_key, 43) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+void test_keys(void)
+{
+	uint64_t value;
+	uint32_t half = 7;
+	char text[5] = "slot";
+	pthread_t tid;
+
+	assert(tps_key_create(0, 1) == -1);
+	assert(tps_key_create(8, 3) == -1);
+	assert(tps_key_create(TPS_SIZE + 1, 1) == -1);
+
+	word_key = tps_key_create(8, 8);
+	half_key = tps_key_create(4, 4);
+	text_key = tps_key_create(sizeof(text), 1);
+	assert(word_key >= 0 && word_key % 8 == 0);
+	assert(half_key >= 0 && half_key % 4 == 0);
+	assert(half_key + 4 <= word_key);
+	assert(text_key >= 0 && text_key + (ssize_t) sizeof(text) <= half_key);
+	assert(tps_set64(word_key, 1) == -1);
+
+	concurrent_tid = pthread_self();
+	tps_create();
+	assert(tps_set64(word_key, 42) == 0);
+	assert(tps_set(half_key, &half) == 0);
+	assert(tps_set(text_key, text) == 0);
+	pthread_create(&tid, NULL, keys_help, NULL);
+	pthread_join(tid, NULL);
+
+	/* Slots are plain ranges of the TPS */
+	assert(tps_read(word_key, 8, &value) == 0);
+	assert(value == 42);
+	half = 0;
+	assert(tps_get(half_key, &half) == 0);
+	assert(half == 7);
+	value = 0;
+	assert(tps_get(word_key, &value) == 0);
+	assert(value == 42);
+
+	/* The size of a slot is known from its key */
+	assert(tps_get64(half_key, &value) == -1);
+	assert(tps_get64(word_key, NULL) == -1);
+	assert(tps_get(word_key + 1, &value) == -1);
+	assert(tps_get(TPS_SIZE, &value) == -1);
+	tps_destroy();
+
+	/* A slot beyond the end of a smaller TPS can't be reached */
+	tps_create_sized(16);
+	assert(tps_get64(word_key, &value) == -1);
+	tps_destroy();
+}
+
+void *reclaim_help(void *arg)
+{
+	/* Exits without destroying its TPS */
+	if (arg == NULL) {
+		assert(tps_create() == 0);
+	} else {
+		assert(tps_clone(concurrent_tid) == 0);
+	}
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	return NULL;
+}
+
+void test_reclaim(void)
+{
+	struct tps_stats before, stats;
+	char *buffer = malloc(TPS_SIZE);
+	pthread_t tid;
+
+	concurrent_tid = pthread_self();
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_get_stats(&before) == 0);
+
+	for (int i = 0; i < 2; i++) {
+		pthread_create(&tid, NULL, reclaim_help, i ? msg1 : NULL);
+		pthread_join(tid, NULL);
+		assert(tps_get_stats(&stats) == 0);
+		assert(stats.live_tps == before.live_tps);
+		assert(stats.pages == before.pages);
+	}
+
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	tps_destroy();
+	free(buffer);
+}
+
+#define EXIT_THREADS 8
+
+void *exit_range_help(void *arg)
+{
+	void **addr = arg;
+
+	/* The range of a mapped TPS is where its pages are */
+	assert(tps_create() == 0);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	*addr = tps_map(TPS_MAP_READ);
+	assert(*addr != NULL);
+	assert(tps_unmap() == 0);
+	return NULL;
+}
+
+/* Fewer threads than make a batch exit with their TPS: their ranges hold no
+memory anymore, and are gone once a TPS is destroyed */
+void test_reclaim_partial(void)
+{
+	void *addrs[EXIT_THREADS];
+	unsigned char vec;
+	pthread_t tid;
+
+	for (int t = 0; t < EXIT_THREADS; t++) {
+		pthread_create(&tid, NULL, exit_range_help, &addrs[t]);
+		pthread_join(tid, NULL);
+		assert(mincore(addrs[t], TPS_PAGE_SIZE, &vec) < 0 ?
+			errno == ENOMEM : !(vec & 1));
+	}
+
+	tps_create();
+	tps_destroy();
+	for (int t = 0; t < EXIT_THREADS; t++) {
+		assert(mincore(addrs[t], TPS_PAGE_SIZE, &vec) == -1 &&
+			errno == ENOMEM);
+	}
+}
+
+void *backed_help(__attribute__((unused)) void *arg)
+{
+	char *buffer = malloc(TPS_SIZE);
+
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+
+	/* The template is gone, along with its own writes */
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+void test_backed(void)
+{
+	char path[] = "/tmp/tps_backed_XXXXXX";
+	char *buffer = malloc(TPS_SIZE);
+	int fd = mkstemp(path);
+	pthread_t tid;
+
+	assert(fd >= 0);
+	assert(tps_create_backed(NULL, TPS_BACKED_SHARED) == -1);
+	assert(tps_create_backed(path, 0) == -1);
+	assert(tps_create_backed(path, TPS_BACKED_PRIVATE) == -1);
+
+	/* Writes go to the file, and survive the TPS */
+	assert(tps_create_backed(path, TPS_BACKED_SHARED) == 0);
+	assert(tps_size() == TPS_SIZE);
+	assert(tps_resize(2 * TPS_SIZE) == -1);
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_sync() == 0);
+	assert(pread(fd, buffer, TPS_SIZE, 0) == TPS_SIZE);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	tps_destroy();
+	assert(tps_sync() == -1);
+
+	assert(tps_create_backed(path, TPS_BACKED_SHARED) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+
+	/* Rolling back writes the snapshot to the file */
+	tps_snapshot_t snap = tps_snapshot();
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	assert(tps_rollback(snap) == 0);
+	assert(pread(fd, buffer, TPS_SIZE, 0) == TPS_SIZE);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	assert(tps_snapshot_destroy(snap) == 0);
+	tps_destroy();
+
+	/* A template is a private copy of the file */
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	assert(tps_create_backed(path, TPS_BACKED_PRIVATE) == 0);
+	assert(tps_sync() == -1);
+	pthread_create(&tid, NULL, backed_help, NULL);
+	sem_down(sem2);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	tps_destroy();
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+
+	assert(pread(fd, buffer, TPS_SIZE, 0) == TPS_SIZE);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+	close(fd);
+	unlink(path);
+	free(buffer);
+}
+
+void test_export(void)
+{
+	char *buffer = malloc(TPS_SIZE);
+	int status;
+
+	assert(tps_export() == -1);
+	assert(tps_import(-1) == -1);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	int fd = tps_export();
+	assert(fd >= 0);
+	assert(tps_import(fd) == -1);
+
+	/* The export keeps the content it was made with, and is sealed */
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	assert(pwrite(fd, msg2, 1, 0) == -1);
+	tps_destroy();
+
+	/* A write in the importing process stays private to it */
+	pid_t pid = fork();
+	if (pid == 0) {
+		assert(tps_import(fd) == 0);
+		assert(tps_size() == TPS_SIZE);
+		assert(tps_read(0, TPS_SIZE, buffer) == 0);
+		assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+		assert(tps_write(0, TPS_SIZE, msg2) == 0);
+		tps_destroy();
+		_exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	assert(tps_import(fd) == 0);
+	close(fd);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(memcmp(msg1, buffer, TPS_SIZE) == 0);
+	tps_destroy();
+	free(buffer);
+}
+
+void *stats_help(__attribute__((unused)) void *arg)
+{
+	assert(tps_clone(concurrent_tid) == 0);
+	sem_up(sem2);
+	sem_down(sem1);
+
+	/* Only the page written to gets copied */
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+static uint64_t sum_buckets(const uint64_t *buckets)
+{
+	uint64_t sum = 0;
+
+	for (int b = 0; b < TPS_STATS_BUCKETS; b++) {
+		sum += buckets[b];
+	}
+	return sum;
+}
+
+void test_stats(void)
+{
+	struct tps_stats before, stats;
+	pthread_t tid;
+
+	assert(tps_get_stats(NULL) == -1);
+	assert(tps_get_stats(&before) == 0);
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	concurrent_tid = pthread_self();
+	tps_create_sized(2 * TPS_PAGE_SIZE);
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+
+	/* Both pages are shared by the two areas */
+	pthread_create(&tid, NULL, stats_help, NULL);
+	sem_down(sem2);
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.live_tps == before.live_tps + 2);
+	assert(stats.shared_pages == before.shared_pages + 2);
+	assert(stats.refs[1] == before.refs[1] + 2);
+	sem_up(sem1);
+	pthread_join(tid, NULL);
+
+	/* The counts of the exited thread are kept */
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.live_tps == before.live_tps + 1);
+	assert(stats.pages == before.pages + 2);
+	assert(stats.shared_pages == before.shared_pages);
+	assert(stats.cow_copies == before.cow_copies + 1);
+	assert(stats.mmap_calls > before.mmap_calls);
+
+	/* Operations are only timed with TPS_LATENCY */
+	assert(sum_buckets(stats.write_ns) == 0);
+	assert(sum_buckets(stats.clone_ns) == 0);
+
+	tps_destroy();
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+}
+
+void *latency_help(__attribute__((unused)) void *arg)
+{
+	assert(tps_clone(concurrent_tid) == 0);
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+void test_latency(void)
+{
+	struct tps_stats stats;
+	char buffer[8];
+	pthread_t tid;
+
+	assert(tps_init(TPS_LATENCY) == 0);
+	concurrent_tid = pthread_self();
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg2) == 0);
+	assert(tps_read(0, sizeof(buffer), buffer) == 0);
+	pthread_create(&tid, NULL, latency_help, NULL);
+	pthread_join(tid, NULL);
+
+	/* The exited thread's calls are counted along with ours */
+	assert(tps_get_stats(&stats) == 0);
+	assert(sum_buckets(stats.read_ns) == 1);
+	assert(sum_buckets(stats.write_ns) == 2);
+	assert(sum_buckets(stats.clone_ns) == 1);
+	tps_destroy();
+}
+
+void test_arena_disabled(void)
+{
+	struct tps_arena_stats stats;
+
+	/* The page arena is only used when asked for at initialization */
+	assert(tps_arena_occupancy(&stats) == -1);
+	assert(tps_arena_watermarks(0, 512) == -1);
+}
+
+void test_huge_disabled(void)
+{
+	struct tps_huge_stats stats;
+
+	/* Huge pages are only asked for at initialization */
+	assert(tps_huge_stats(&stats) == -1);
+}
+
+void test_faults_disabled(void)
+{
+	struct tps_fault fault;
+
+	/* Faults are only recorded when asked for at initialization */
+	assert(tps_faults(&fault, 1) == -1);
+	assert(tps_fault_dump(STDERR_FILENO) == -1);
+}
+
+/* The range of a TPS too big for the free lists of the arena is given back to
+the region whole, and reused by the next one rather than carving more of the
+region */
+void test_region_big_runs(void)
+{
+	char *first = NULL;
+
+	assert(tps_init(TPS_REGION) == 0);
+	for (int round = 0; round < 4; round++) {
+		assert(tps_create_sized(128 * TPS_PAGE_SIZE) == 0);
+		char *tps_addr = tps_map(TPS_MAP_READ);
+		assert(tps_addr != NULL);
+		assert(first == NULL || tps_addr == first);
+		first = tps_addr;
+		assert(tps_unmap() == 0);
+		assert(tps_destroy() == 0);
+	}
+}
+
+/* Runs a test in a child process, which can initialize the API with flags of
+its own */
+void in_child(void (*test)(void))
+{
+	int status;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		test();
+		exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static sigjmp_buf fault_recovery;
+
+void fault_recover(__attribute__((unused)) int sig)
+{
+	siglongjmp(fault_recovery, 1);
+}
+
+void *faults_help(void *arg)
+{
+	assert(tps_clone(*(pthread_t *) arg) == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+	tps_destroy();
+	return NULL;
+}
+
+void test_faults_outside(void)
+{
+	struct sigaction sa;
+	struct tps_fault fault;
+	pthread_t tid, self = pthread_self();
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = fault_recover;
+	sigaction(SIGSEGV, &sa, NULL);
+	assert(tps_init(TPS_FAULTS) == 0);
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	volatile char *area = tps_map(TPS_MAP_READ);
+	tps_unmap();
+
+	/* Fill every slot of the ring with faults on the thread's own area */
+	for (volatile int n = 0; n < TPS_FAULT_RING; n++) {
+		if (sigsetjmp(fault_recovery, 1) == 0) {
+			(void) area[n];
+		}
+	}
+	assert(tps_faults(&fault, 1) == 1);
+	assert(pthread_equal(fault.owner, self) && fault.offset ==
+		TPS_FAULT_RING - 1);
+
+	/* The page shared with the clone outlives the area: a fault on it
+	doesn't keep the owner of an older record */
+	pthread_create(&tid, NULL, faults_help, &self);
+	sem_down(sem1);
+	tps_destroy();
+	if (sigsetjmp(fault_recovery, 1) == 0) {
+		(void) area[0];
+	}
+	assert(tps_faults(&fault, 1) == 1);
+	assert(pthread_equal(fault.tid, self) && fault.addr == area);
+	assert(fault.offset == -1 && fault.owner == 0);
+
+	sem_up(sem2);
+	pthread_join(tid, NULL);
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+}
+
+void test_strict_default(void)
+{
+	struct tps_stats before, stats;
+	char buffer[8];
+
+	/* Without a protection level, every access opens and closes the page */
+	tps_create();
+	assert(tps_get_stats(&before) == 0);
+	assert(before.protection == TPS_STRICT);
+	assert(tps_write(0, sizeof(buffer), msg1) == 0);
+	assert(tps_read(0, sizeof(buffer), buffer) == 0);
+	tps_settle();
+	assert(tps_get_stats(&stats) == 0);
+	assert(stats.mprotect_calls == before.mprotect_calls + 4);
+	tps_destroy();
+}
+
 void test_mem_protection(void)
 {
 	tps_create();
@@ -369,6 +1786,14 @@ int main(void)
 	test_no_init_cd();
 	test_no_init_wr();
 
+	/* tests initializing the API with flags of their own */
+	in_child(test_faults_outside);
+	in_child(test_latency);
+	in_child(test_read_from_memfd);
+	in_child(test_compact_deferred);
+	in_child(test_compact_guard_only);
+	in_child(test_region_big_runs);
+
 	/* basic start tests */
 	test_init();
 	test_create();
@@ -389,11 +1814,67 @@ int main(void)
 	test_offset();
 	test_rw_int();
 	test_rw_float();
+	test_rw_vec();
 
 	/* clone functionality and privacy tests */
 	test_clone_mem();
 	test_clone_privacy();
 	test_clone_copy_on_write_only();
+
+	/* variable size TPS tests */
+	test_create_sized();
+	test_resize();
+	test_clone_pages();
+
+	/* direct access tests */
+	test_map();
+	test_map_cow();
+
+	/* snapshot tests */
+	test_snapshot();
+
+	/* compaction tests */
+	test_compact();
+	test_compact_batches();
+
+	/* batch clone tests */
+	test_clone_batch();
+	test_clone_batch_unclaimed();
+
+	/* cross-thread read tests */
+	test_read_from();
+	test_read_from_cloners();
+
+	/* handover tests */
+	test_transfer();
+	test_transfer_unclaimed();
+
+	/* atomic operation tests */
+	test_atomic();
+
+	/* slot allocator tests */
+	test_keys();
+
+	/* statistics tests */
+	test_stats();
+
+	/* reclamation tests */
+	test_reclaim();
+	test_reclaim_partial();
+
+	/* file-backed tests */
+	test_backed();
+	test_export();
+
+	/* page arena tests */
+	test_arena_disabled();
+	test_huge_disabled();
+	test_faults_disabled();
+	test_strict_default();
+
+	/* concurrency tests */
+	test_concurrent_clones();
+	test_reads_while_cloned();
 	
 	/*  segfault test  */
 	test_mem_protection();
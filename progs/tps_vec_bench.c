@@ -0,0 +1,114 @@
+/*
+ * TPS vectored access benchmark
+ *
+ * A thread updates FIELDS fields of 8 bytes (8 by default) spread over its TPS,
+ * UPDATES times (10000 by default), first with one tps_write() per field and
+ * then with a single tps_writev() per update. The number of mprotect() calls
+ * and the time per logical update is printed as CSV for both methods.
+ *
+ * Usage: tps_vec_bench.x [FIELDS] [UPDATES]
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <tps.h>
+
+static size_t nfields = 8;
+static size_t nupdates = 10000;
+
+static size_t mprotect_calls;
+
+int __real_mprotect(void *addr, size_t len, int prot);
+int __wrap_mprotect(void *addr, size_t len, int prot)
+{
+	mprotect_calls++;
+	return __real_mprotect(addr, len, prot);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *method, double start, size_t calls)
+{
+	printf("%s,%zu,%zu,%.2f,%.1f\n", method, nfields, nupdates,
+		(double) calls / nupdates, (now_ns() - start) / nupdates);
+}
+
+static void *bench_thread(__attribute__((unused)) void *arg)
+{
+	uint64_t *values = calloc(nfields, sizeof(uint64_t));
+	struct tps_iovec *iov = calloc(nfields, sizeof(struct tps_iovec));
+	size_t stride = TPS_SIZE / nfields / sizeof(uint64_t) * sizeof(uint64_t);
+
+	tps_create();
+	for (size_t f = 0; f < nfields; f++) {
+		iov[f].offset = f * stride;
+		iov[f].length = sizeof(uint64_t);
+		iov[f].buffer = &values[f];
+	}
+
+	printf("method,fields,updates,mprotect_per_update,ns_per_update\n");
+
+	size_t calls = mprotect_calls;
+	double start = now_ns();
+	for (size_t u = 0; u < nupdates; u++) {
+		for (size_t f = 0; f < nfields; f++) {
+			values[f] = u + f;
+			tps_write(iov[f].offset, iov[f].length, iov[f].buffer);
+		}
+	}
+	report("tps_write", start, mprotect_calls - calls);
+
+	calls = mprotect_calls;
+	start = now_ns();
+	for (size_t u = 0; u < nupdates; u++) {
+		for (size_t f = 0; f < nfields; f++) {
+			values[f] = u + f;
+		}
+		tps_writev(iov, nfields);
+	}
+	report("tps_writev", start, mprotect_calls - calls);
+
+	tps_destroy();
+	free(values);
+	free(iov);
+	return NULL;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX) {
+		fprintf(stderr, "invalid argument: %s\n", argv);
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid;
+
+	if (argc > 1)
+		nfields = get_argv(argv[1]);
+	if (argc > 2)
+		nupdates = get_argv(argv[2]);
+	if (nfields > TPS_SIZE / sizeof(uint64_t))
+		nfields = TPS_SIZE / sizeof(uint64_t);
+
+	tps_init(0);
+	pthread_create(&tid, NULL, bench_thread, NULL);
+	pthread_join(tid, NULL);
+
+	return 0;
+}